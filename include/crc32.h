@@ -0,0 +1,13 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 
+    CRC-32 as used by zlib and Ethernet. Start with crc = 0 and feed the 
+    previous result back in to checksum data that arrives in pieces. 
+*/
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif // _CRC32_H
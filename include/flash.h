@@ -0,0 +1,140 @@
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "stub.h"
+
+typedef enum {
+	FLASH_MODE_FULL = 0,	/* erase every page the image covers and write it */
+	FLASH_MODE_DELTA,		/* read back each page, rewrite only the ones that differ */
+} flash_mode_t;
+
+/* Times we try to get the link back for a single operation */
+#define FLASH_MAX_RETRIES		3
+
+#define FLASH_MIRROR_MAGIC		"ISPM"
+#define FLASH_MIRROR_VERSION	1
+
+#define FLASH_JOURNAL_MAGIC		"ISPJ"
+#define FLASH_JOURNAL_VERSION	1
+
+/*
+    Firmware file we are going to flash. It is read a page at a time. The
+    same struct is used for a mirror file, where the data starts after a
+    header.
+*/
+struct flash_image {
+	FILE *fp;
+	const struct stm32_dev *dev;
+	long offset;
+	long size;
+	unsigned int pages;
+};
+
+/*
+    Header of a mirror file. The mirror holds the flash pages we last wrote
+    to the device with this unique ID.
+*/
+struct flash_mirror_hdr {
+	char magic[4];
+	uint32_t version;
+	uint8_t uid[STM_UID_SIZE];
+	uint32_t size;
+};
+
+/*
+    Header of a journal file. The journal lists the pages of one image the
+    device with this unique ID has ACKed, one byte per page after the
+    header, so an update that was cut off can carry on where it stopped.
+*/
+struct flash_journal_hdr {
+	char magic[4];
+	uint32_t version;
+	uint8_t uid[STM_UID_SIZE];
+	uint32_t image_crc;				/* of the padded image pages */
+	uint32_t size;
+	uint32_t pages;
+};
+
+/*
+    How to get the bootloader back when an operation fails. Without a reset
+    function every error is final.
+*/
+struct flash_link {
+	stm_reset_fn reset;
+	void *reset_arg;
+	unsigned int retries;			/* for the operation in progress */
+	unsigned int relinks;
+	unsigned int downshifts;		/* relinks that dropped the baud rate */
+};
+
+struct flash_stats {
+	unsigned int pages;				/* pages the image covers */
+	unsigned int pages_skipped;		/* already matched the image */
+	unsigned int pages_erased;
+	unsigned int pages_written;
+	unsigned int pages_resumed;		/* done by an earlier, cut off update */
+	unsigned int blocks_written;
+	unsigned int blocks_skipped;	/* erased blocks we did not send */
+	int mirror_hit;					/* pages were diffed against the mirror */
+	unsigned int verify_bad_pages;	/* pages whose CRC did not match */
+	unsigned long verify_bytes;
+	unsigned long write_ms;			/* time spent erasing and writing */
+	unsigned long verify_ms;		/* time spent in the verify pass */
+	unsigned int pipe_stalls;		/* times the link waited on the file */
+};
+
+typedef void (*flash_progress_fn)(void *arg, int remaining);
+typedef void (*flash_mismatch_fn)(void *arg, uint32_t addr, unsigned int len);
+
+struct flash_job {
+	const char *path;
+	const struct stm32_dev *dev;	/* NULL for the default geometry */
+	flash_mode_t mode;
+	int sparse;
+	int verify;						/* read the flash back after writing */
+	const char *mirror_path;		/* NULL to not use a mirror */
+	const uint8_t *uid;				/* mirror and journal need it */
+	const char *journal_path;		/* NULL to not keep a journal */
+	struct flash_link link;
+	flash_progress_fn progress;
+	void *progress_arg;
+	flash_mismatch_fn mismatch;		/* called for each range that differs */
+	void *mismatch_arg;
+	struct stub_session *stub;		/* NULL to go through the ROM bootloader */
+	int remaining;
+	struct flash_stats stats;
+};
+
+/*
+    Flash dump to a file. The file is sized up front and mapped, the flash
+    is read straight into the mapping.
+*/
+struct flash_dump {
+	const char *path;
+	const struct stm32_dev *dev;	/* NULL for the default geometry */
+	uint32_t addr;
+	uint32_t len;
+	int holes;						/* leave erased file pages as holes */
+	struct flash_link link;
+	flash_progress_fn progress;
+	void *progress_arg;
+	unsigned long hole_bytes;
+	unsigned long ms;
+};
+
+int flash_image_open(struct flash_image *img, const char *path,
+        const struct stm32_dev *dev);
+void flash_image_close(struct flash_image *img);
+int flash_image_read(struct flash_image *img, long off, uint8_t *buf,
+        unsigned int len);
+int flash_image_read_page(struct flash_image *img, unsigned int page,
+        uint8_t *buf);
+int flash_update(struct serial_port_options *opts, struct flash_job *job);
+int flash_verify(struct serial_port_options *opts, struct flash_job *job);
+int flash_dump(struct serial_port_options *opts, struct flash_dump *dump);
+
+#endif // _FLASH_H
@@ -1,6 +1,8 @@
 #ifndef _GPIO_H
 #define _GPIO_H
 
+#include <stdint.h>
+
 #define I2C_ADDR 0x3E
 #define I2C_DEV "/dev/i2c-0"
 
@@ -9,14 +11,91 @@
 #define I2C_POLARITY_REG			0x02
 #define I2C_CTRL_REG				0x03
 
-typedef enum {LOW = 0, HIGH} pin_state;
+typedef enum {LOW = 0, HIGH, KEEP} pin_state;
+
+/* 
+    Pin bits as the backends get them. They are the expander pins, 
+    GPIO 2 and 3 on J22, the other backends map them to their own lines. 
+*/
+#define GPIO_BOOT_PIN (1 << 2)
+#define GPIO_RESET_PIN (1 << 3)
 
 #define GPIO_RESET_MASK 0xF7
 #define GPIO_BOOTP_MASK 0xFB
 
+/* 
+    Reset pulse timing. BOOT0 has to be stable before reset is released, 
+    NRST needs 20us low at the pin, the rest is margin for the board RC. 
+*/
+#define GPIO_BOOT_SETUP_US 100
+#define GPIO_RESET_PULSE_US 1000
+
 int gpio_init(void);
 void gpio_deinit(void);
 void gpio_toggle_boot(pin_state p);
+/* 
+    What drives the reset and boot pins. open gets whatever followed the 
+    backend name in the spec, or NULL, and returns 0 or a negative errno. 
+    set gets the level of both pins as GPIO_BOOT_PIN and GPIO_RESET_PIN 
+    bits and changes them in one transaction. close leaves the STM32 
+    running, the pins are set that way before it is called. 
+*/
+struct gpio_backend {
+	const char *name;
+	int (*open)(const char *arg);
+	void (*close)(void);
+	int (*set)(uint8_t pins);
+};
+
+extern const struct gpio_backend gpio_expander_backend;
+extern const struct gpio_backend gpio_chip_backend;
+extern const struct gpio_backend gpio_modem_backend;
+extern const struct gpio_backend gpio_mock_backend;
+
+/* 
+    One step of a pin sequence. Pins set to KEEP stay as they are, 
+    delay_us is how long to hold the new state. 
+*/
+struct gpio_step {
+	pin_state boot;
+	pin_state reset;
+	unsigned int delay_us;
+};
+
+/* Backend transactions, since gpio_init() or for one sequence */
+struct gpio_stats {
+	unsigned long writes;
+};
+
 void gpio_toggle_reset(pin_state p);
+void gpio_reset_pulse(pin_state boot, unsigned int setup_us, 
+        unsigned int pulse_us);
+int gpio_sequence(const struct gpio_step *steps, unsigned int n, 
+        struct gpio_stats *st);
+void gpio_get_stats(struct gpio_stats *st);
+void gpio_get_last_sequence(struct gpio_stats *st);
+int gpio_select(const char *spec);
+const struct gpio_backend *gpio_get_backend(void);
+
+/* 
+    DTR and RTS of the serial port, boot on RTS and reset on DTR unless 
+    the spec says otherwise. The port has to be open, hand its fd over 
+    before gpio_init(). 
+*/
+void gpio_modem_set_fd(int fd);
+
+/* 
+    Mock backend for running without the hardware. It keeps the pins in 
+    memory and a log of every change. 
+*/
+#define GPIO_MOCK_LOG_MAX 64
+
+struct gpio_mock_write {
+	uint8_t val;
+	unsigned long us;			/* since the mock was opened */
+};
+
+uint8_t gpio_mock_pins(void);
+unsigned int gpio_mock_log(const struct gpio_mock_write **log);
 
 #endif // _GPIO_H
@@ -0,0 +1,29 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/* 
+    Latency histogram in the HDR style. Values below HIST_SUB_COUNT get a 
+    bucket each, above that every power of two is split into HIST_SUB_COUNT 
+    linear buckets. Any value is off by at most 1/HIST_SUB_COUNT and adding 
+    one is a shift and an increment, no allocation. 
+*/
+#define HIST_SUB_BITS		4
+#define HIST_SUB_COUNT		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct hist {
+	unsigned long count;
+	unsigned long long sum;
+	uint32_t min;
+	uint32_t max;
+	uint32_t bucket[HIST_BUCKETS];
+};
+
+void hist_reset(struct hist *h);
+void hist_add(struct hist *h, uint32_t v);
+uint32_t hist_percentile(const struct hist *h, unsigned int pct);
+uint32_t hist_mean(const struct hist *h);
+
+#endif // _HIST_H
@@ -1,20 +1,122 @@
 #ifndef _SERIAL_H
 #define _SERIAL_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #define TTY_DEV "/dev/ttymxc4"
 #define SERIAL_BUF_MAX 512
+/* Read deadline when the caller doesn't give one, the old VTIME of 0.5s */
+#define SERIAL_READ_TIMEOUT_MS 500
+
+/* 
+    Baud keys are the termios Bxxx constants. A rate that has no constant 
+    is stored as the speed itself with this bit set and goes through 
+    termios2/BOTHER. 
+*/
+#define SERIAL_BAUD_CUSTOM 0x80000000
+
+/* 
+    Receive ring. Each read() drains everything the tty has into it and 
+    replies are served from memory. head and tail only ever count up, 
+    index with SERIAL_RX_RING_MASK. The size must be a power of 2. 
+*/
+#define SERIAL_RX_RING_SIZE 1024
+#define SERIAL_RX_RING_MASK (SERIAL_RX_RING_SIZE - 1)
+
+struct serial_rx_ring {
+    uint8_t buf[SERIAL_RX_RING_SIZE];
+    unsigned int head;              /* next byte in */
+    unsigned int tail;              /* next byte out */
+};
+
+/* System calls the port has made, to see what each protocol step costs */
+struct serial_stats {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long polls;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long ring_hits;        /* reads served without a system call */
+};
 
+struct serial_port_options;
+
+/* 
+    What carries the bytes to the bootloader. serial_init() picks one by 
+    the device name: tcp:host:port for a ser2net style bridge, loop: for 
+    the in-memory loopback, pty:path or anything under /dev/pts/ for a 
+    pty, otherwise a termios tty. The receive ring and the stats sit on 
+    top of all of them. 
+    readv takes what has arrived without blocking. wait blocks until 
+    there is something to read, returning like poll(). set_baud and 
+    flush act on the link, wire_us is how long n bytes take on it. 
+    Returns are 0 for OK, or what the matching system call returns. 
+*/
+struct serial_transport {
+    const char *name;
+    int (*open)(struct serial_port_options *opts, const char *path);
+    void (*close)(struct serial_port_options *opts);
+    ssize_t (*readv)(struct serial_port_options *opts, 
+            const struct iovec *iov, int iovcnt);
+    ssize_t (*writev)(struct serial_port_options *opts, 
+            const struct iovec *iov, int iovcnt);
+    int (*wait)(struct serial_port_options *opts, int timeout_ms);
+    int (*set_baud)(struct serial_port_options *opts, uint32_t baud_key);
+    void (*flush)(struct serial_port_options *opts);
+    unsigned long (*wire_us)(struct serial_port_options *opts, size_t n);
+};
+
+extern const struct serial_transport serial_termios_transport;
+extern const struct serial_transport serial_pty_transport;
+extern const struct serial_transport serial_tcp_transport;
+extern const struct serial_transport serial_loop_transport;
+
+/* 
+    A transport left NULL is the termios one on fd, so a port can still 
+    be set up by hand. fd is -1 for transports without one. 
+*/
 struct serial_port_options {
     int fd;
 	const char *device;
 	uint32_t baud_rate;
+	struct serial_rx_ring rx;
+	struct serial_stats stats;
+    const struct serial_transport *transport;
+    void *priv;                     /* transport state */
 };
 
 int serial_init(struct serial_port_options *opts);
 void serial_deinit(struct serial_port_options *opts);
 int serial_read(struct serial_port_options *opts, void *buf, size_t nbyte);
+int serial_read_timeout(struct serial_port_options *opts, void *buf, 
+        size_t nbyte, int timeout_ms);
 int serial_write(struct serial_port_options *opts, void *buf, size_t nbyte);
+int serial_writev(struct serial_port_options *opts, const struct iovec *iov, 
+        int iovcnt);
+int serial_set_baud(struct serial_port_options *opts, uint32_t baud_key);
+int serial_set_custom_speed(int fd, uint32_t speed);
+void serial_flush(struct serial_port_options *opts);
 uint32_t serial_baud_str_to_key(const char *baud_str);
 const char *serial_baud_key_to_str(uint32_t baud_key);
+uint32_t serial_baud_key_to_speed(uint32_t baud_key);
+void serial_get_stats(struct serial_port_options *opts, 
+        struct serial_stats *st);
+void serial_reset_stats(struct serial_port_options *opts);
+unsigned long serial_wire_us(struct serial_port_options *opts, size_t n);
+unsigned long serial_baud_wire_us(uint32_t baud_key, size_t n);
+
+/* 
+    The loopback has nothing on the far end unless a peer is set. The 
+    peer gets every write and answers with serial_loop_put(), without 
+    one writes are echoed back. 
+*/
+typedef void (*serial_loop_peer_t)(struct serial_port_options *opts, 
+        const uint8_t *buf, size_t n, void *arg);
+
+void serial_loop_set_peer(struct serial_port_options *opts, 
+        serial_loop_peer_t peer, void *arg);
+int serial_loop_put(struct serial_port_options *opts, const void *buf, 
+        size_t n);
 
 #endif // _SERIAL_H
@@ -2,6 +2,7 @@
 #define _STM32_H
 
 #include "serial.h"
+#include "hist.h"
 
 #define STM_INIT 				0x7F
 #define STM_ACK 				0x79
@@ -19,17 +20,172 @@
 #define STM_CMD_READ_PROTECT	0x82
 #define STM_CMD_READ_UNPROTECT	0x92
 
+/* 
+    Defaults for when the part can't be identified. The real geometry comes 
+    from stm_probe() 
+*/
 #define STM_FLASH_BASE			0x08000000
 #define STM_FLASH_SIZE			0x00040000
+#define STM_PAGE_SIZE			0x00000800
+#define STM_SRAM_BASE			0x20000000
+/* Largest page of any part we know, for sizing page buffers */
+#define STM_PAGE_SIZE_MAX		0x00000800
+
+#define STM_UID_ADDR			0x1FFFF7AC
+#define STM_UID_SIZE			12
+#define STM_FLASH_SIZE_REG		0x1FFFF7CC
+#define STM_MAX_CMDS			32
 #define MAX_RW_SIZE				0x100
+/* 
+    Pages per extended erase frame. The ACK deadline grows with the page 
+    count, so the limit is only the 256 byte frame the bootloader accepts 
+*/
+#define STM_ERASE_PAGES_MAX		126
+#define STM_ERASED_BYTE			0xFF
 
 typedef enum {
 	STM32_ERR_OK = 0,
 	STM32_ERR_UNKNOWN,	/* Generic error */
 	STM32_ERR_NACK,
 	STM32_ERR_NO_CMD,	/* Command not available in bootloader */
+	STM32_ERR_TIMEOUT,	/* Nothing came back before the deadline */
 } stm32_err_t;
 
+/* 
+    How long each kind of operation may take to answer. Flash erase and 
+    program times are the worst case from the datasheet with some margin. 
+    Reads get STM_ACK_TIMEOUT_MS plus twice the time the payload takes on 
+    the wire. 
+*/
+#define STM_ACK_TIMEOUT_MS			200
+#define STM_WRITE_TIMEOUT_MS		500
+#define STM_PAGE_ERASE_TIMEOUT_MS	100		/* per page, on top of an ACK */
+#define STM_MASS_ERASE_TIMEOUT_MS	10000
+
+/* 
+    Bootloader entry. After reset an init byte goes out every 
+    STM_SYNC_PROBE_MS until the bootloader answers, for up to 
+    STM_SYNC_TIMEOUT_MS. Repeated garbage means it locked on to another 
+    rate and we give up early. 
+*/
+#define STM_SYNC_PROBE_MS			10
+#define STM_SYNC_TIMEOUT_MS			1000
+#define STM_SYNC_GARBAGE_MAX		3
+
+/* Where the time went the last time we brought the bootloader up */
+struct stm_entry_stats {
+	unsigned long reset_us;		/* in the reset callback */
+	unsigned long sync_us;		/* from there to the first answer */
+	unsigned int probes;		/* init bytes sent */
+	int was_synced;				/* it answered NACK, already in sync */
+};
+
+/* 
+    Link health. Once there have been at least STM_LINK_ERR_MIN errors and 
+    they make up STM_LINK_ERR_PCT percent of the responses the link counts 
+    as degraded and we drop the baud rate. 
+*/
+#define STM_LINK_ERR_MIN		3
+#define STM_LINK_ERR_PCT		5
+
+struct stm_link_stats {
+	unsigned long acks;
+	unsigned long nacks;
+	unsigned long timeouts;		/* no response before the deadline */
+	unsigned long garbage;		/* a byte that was neither ACK nor NACK */
+	unsigned long fallbacks;	/* send-ahead dropped back to lock-step */
+};
+
+/* 
+    Per command and per phase latency, in microseconds, kept while 
+    stm_set_metrics() has it on. A command is timed from its first byte 
+    out to its last ACK, failures included. The phases are the writes, 
+    the ACK waits and the reply reads the commands are made of. 
+*/
+typedef enum {
+	STM_M_INIT = 0,
+	STM_M_GET,
+	STM_M_GET_ID,
+	STM_M_READ,
+	STM_M_WRITE,
+	STM_M_ERASE,
+	STM_M_GO,
+	STM_M_CMDS,
+} stm_metric_cmd_t;
+
+typedef enum {
+	STM_P_TX = 0,
+	STM_P_ACK,
+	STM_P_RX,
+	STM_P_PHASES,
+} stm_metric_phase_t;
+
+struct stm_metrics {
+	struct hist cmd[STM_M_CMDS];
+	struct hist phase[STM_P_PHASES];
+	unsigned long failed[STM_M_CMDS];
+	unsigned long nacks;
+	unsigned long timeouts;		/* ACKs and replies that never came */
+	unsigned long retries;		/* commands sent again, see stm_metrics_retry() */
+};
+
+/* Device quirks */
+#define STM_QUIRK_CCM_RAM		(1 << 0)	/* 0x10000000 core coupled RAM */
+#define STM_QUIRK_NO_FSIZE		(1 << 1)	/* flash size register not usable */
+
+/* 
+    What we know about a family member at compile time, keyed by the 
+    product ID GET_ID returns. Flash size is the largest the PID comes in, 
+    SRAM the smallest, stm_probe() refines the flash size from the flash 
+    size register. 
+*/
+struct stm32_dev_info {
+	uint16_t pid;
+	const char *name;
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint32_t sram_size;
+	uint32_t bl_ram_end;		/* SRAM below this belongs to the bootloader */
+	uint32_t quirks;
+};
+
+/* 
+    Capabilities of the part we are talking to in this session. All of the 
+    erase, write and dump code works from this. 
+*/
+struct stm32_dev {
+	const struct stm32_dev_info *info;	/* NULL if the PID is unknown */
+	uint16_t pid;
+	uint8_t bl_version;
+	uint8_t cmds[STM_MAX_CMDS];
+	unsigned int ncmds;
+	uint32_t flash_base;
+	uint32_t flash_size;
+	uint32_t page_size;
+	unsigned int pages;
+	uint32_t sram_base;
+	uint32_t sram_size;
+	uint32_t bl_ram_end;
+	uint32_t quirks;
+};
+
+/* 
+    A write command ready to go on the wire. The data frame is the length 
+    byte, the caller's data and the checksum. The data is not copied, it 
+    must stay put and be padded to len until the frame has been sent. 
+*/
+struct stm_write_frame {
+	uint32_t addr;
+	unsigned int len;
+	uint8_t addr_frame[5];
+	uint8_t len_byte;
+	const uint8_t *data;
+	uint8_t cs;
+};
+
+/* Puts the STM32 back into the bootloader, see reset_micro() */
+typedef void (*stm_reset_fn)(void *arg);
+
 typedef enum {
     STM32_IDLE,
     STM32_READY,
@@ -40,12 +196,43 @@ typedef enum {
 #define GPIO_BOOTP_MASK 0xFB
 
 stm32_err_t stm_get_ack(struct serial_port_options *opt);
+stm32_err_t stm_wait_ack(struct serial_port_options *opts, int timeout_ms);
 int stm_init_seq(struct serial_port_options *opts);
-int stm_get_cmds(struct serial_port_options *opts);
+int stm_sync(struct serial_port_options *opts, unsigned int timeout_ms);
+void stm_get_entry_stats(struct stm_entry_stats *st);
+int stm_get_cmds(struct serial_port_options *opts, struct stm32_dev *dev);
 int stm_erase_mem(struct serial_port_options *opts);
+int stm_erase_pages(struct serial_port_options *opts, uint16_t first, 
+        unsigned int count);
 int stm_read_mem(struct serial_port_options *opts, uint32_t address, uint8_t *data , unsigned int len);
 int stm_write_mem(struct serial_port_options *opts, uint32_t address, uint8_t data[], unsigned int len);
-int stm_get_id(struct serial_port_options *opts);
+void stm_write_frame_encode(struct stm_write_frame *f, uint32_t address, 
+        const uint8_t *data, unsigned int len);
+int stm_write_frame_send(struct serial_port_options *opts, 
+        struct stm_write_frame *f);
+int stm_get_id(struct serial_port_options *opts, uint16_t *pid);
+int stm_get_uid(struct serial_port_options *opts, uint8_t uid[STM_UID_SIZE]);
 int stm_go(struct serial_port_options *opts, uint32_t address);
+int stm_probe(struct serial_port_options *opts, struct stm32_dev *dev);
+void stm_dev_default(struct stm32_dev *dev);
+int stm_dev_has_cmd(const struct stm32_dev *dev, uint8_t cmd);
+int stm_block_erased(const uint8_t *data, unsigned int len);
+void stm_get_link_stats(struct stm_link_stats *st);
+void stm_reset_link_stats(void);
+int stm_link_degraded(void);
+void stm_set_metrics(int on);
+const struct stm_metrics *stm_get_metrics(void);
+void stm_reset_metrics(void);
+void stm_metrics_retry(void);
+const char *stm_metric_cmd_name(stm_metric_cmd_t cmd);
+const char *stm_metric_phase_name(stm_metric_phase_t phase);
+void stm_set_send_ahead(int on);
+int stm_get_send_ahead(void);
+int stm_send_ahead_fell_back(void);
+uint32_t stm_baud_step_down(uint32_t baud_key);
+int stm_relink(struct serial_port_options *opts, uint32_t baud_key, 
+        stm_reset_fn reset, void *arg);
+int stm_autobaud(struct serial_port_options *opts, uint32_t max_key, 
+        stm_reset_fn reset, void *arg);
 
 #endif // _STM32_H
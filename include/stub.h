@@ -0,0 +1,57 @@
+#ifndef _STUB_H
+#define _STUB_H
+
+#include <stdint.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "stub_proto.h"
+
+/* Host side limits, the stub's HELLO can only lower them */
+#define STUB_PAYLOAD_MAX		2048
+#define STUB_WINDOW_MAX			8
+
+#define STUB_HELLO_TIMEOUT_MS	1000
+#define STUB_ACK_TIMEOUT_MS		500
+#define STUB_MAX_RETRIES		5
+
+/* A frame in flight, kept until it is ACKed so it can be sent again */
+struct stub_slot {
+	uint8_t seq;
+	unsigned int len;
+	uint8_t *frame;
+};
+
+struct stub_stats {
+	unsigned long frames;
+	unsigned long resent;
+	unsigned long naks;
+	unsigned long timeouts;
+	unsigned long bytes;		/* flash data written */
+};
+
+struct stub_session {
+	struct serial_port_options *opts;
+	unsigned int window;
+	unsigned int max_payload;
+	uint8_t seq;				/* next seq to use */
+	struct stub_slot slots[STUB_WINDOW_MAX];
+	unsigned int first;			/* oldest slot in flight */
+	unsigned int inflight;
+	struct stub_stats stats;
+};
+
+int stub_load(struct serial_port_options *opts, const struct stm32_dev *dev,
+        const char *path, struct stub_session *s);
+void stub_close(struct stub_session *s);
+int stub_ping(struct stub_session *s);
+int stub_set_baud(struct stub_session *s, uint32_t baud_key);
+int stub_erase(struct stub_session *s, uint16_t first, unsigned int count);
+int stub_write(struct stub_session *s, uint32_t addr, const uint8_t *data,
+        unsigned int len);
+int stub_flush(struct stub_session *s);
+int stub_crc(struct stub_session *s, uint32_t addr, uint32_t len,
+        uint32_t chunk, uint32_t *crcs);
+int stub_go(struct stub_session *s, uint32_t addr);
+
+#endif // _STUB_H
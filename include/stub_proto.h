@@ -0,0 +1,58 @@
+#ifndef _STUB_PROTO_H
+#define _STUB_PROTO_H
+
+/*
+    Flash loader stub. The stub is uploaded to SRAM through the ROM
+    bootloader and started with GO. From then on it owns the UART and
+    speaks the protocol below, large frames with a CRC32 and a window of
+    frames in flight instead of 256 byte writes in lock-step.
+
+    Every frame, both ways, is
+
+        SOF | type | seq | len (16 bit LE) | payload | CRC32 (LE)
+
+    and the CRC covers type through payload. Host frames carry a sequence
+    number. The stub handles them strictly in order and answers each one
+    with ACK, or with a CRC frame for STUB_CRC, carrying the same seq. A
+    frame it can't use gets a NAK with the seq it is still waiting for and
+    everything after it is dropped until that seq turns up again. A frame
+    it has already handled is answered again without being redone. All
+    numbers in payloads are little endian.
+
+    The stub itself builds against this file too, keep host headers out.
+*/
+#define STUB_SOF				0xA5
+#define STUB_VERSION			1
+#define STUB_HDR_SIZE			5
+#define STUB_CRC_SIZE			4
+#define STUB_FRAME_MAX(n)		(STUB_HDR_SIZE + (n) + STUB_CRC_SIZE)
+
+/* Where the stub is linked to run, above the bootloader's RAM on any F3 */
+#define STUB_LOAD_ADDR			0x20001800
+
+typedef enum {
+	STUB_HELLO = 0x01,	/* stub: version, window, max payload (16 bit) */
+	STUB_PING = 0x02,
+	STUB_BAUD = 0x03,	/* new and current speed (32 bit each), ACKed at
+						   the current rate. The stub doesn't know the
+						   rate the ROM autobauded to, so it scales the
+						   baud register by the ratio */
+	STUB_ERASE = 0x04,	/* first page, count (16 bit each) */
+	STUB_WRITE = 0x05,	/* address (32 bit), data */
+	STUB_CRC = 0x06,	/* address, length, chunk (32 bit each), the
+						   reply holds a CRC32 for each chunk */
+	STUB_GO = 0x07,		/* address (32 bit) */
+	STUB_ACK = 0x80,	/* status */
+	STUB_NAK = 0x81,	/* status, seq is the one the stub wants next */
+} stub_frame_t;
+
+typedef enum {
+	STUB_OK = 0,
+	STUB_ERR_CRC,		/* frame CRC was bad */
+	STUB_ERR_SEQ,		/* a frame went missing */
+	STUB_ERR_ADDR,		/* outside of flash */
+	STUB_ERR_FLASH,		/* erase or program failed */
+	STUB_ERR_LEN,		/* payload too big or short */
+} stub_status_t;
+
+#endif // _STUB_PROTO_H
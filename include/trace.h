@@ -0,0 +1,26 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* 
+    Span tracer. Finished spans go into a ring that is allocated once by 
+    trace_open(), so recording one is a clock read and a slot claim. When 
+    the ring is full the oldest spans are overwritten. trace_dump() writes 
+    what is there as Chrome trace-event JSON, which chrome://tracing and 
+    Perfetto open as a timeline. Names and categories are kept by pointer, 
+    pass string literals. 
+*/
+#define TRACE_EVENTS_DEFAULT	65536
+
+int trace_open(const char *path, unsigned int nevents);
+void trace_close(void);
+int trace_on(void);
+unsigned long trace_begin(void);
+void trace_end(const char *cat, const char *name, unsigned long start, 
+        long arg);
+int trace_dump(void);
+void trace_request_dump(void);
+void trace_poll(void);
+
+#endif // _TRACE_H
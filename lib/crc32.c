@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xEDB88320
+
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+/* 
+    Build the byte lookup table the first time it is needed 
+*/
+static void crc32_init_table(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for(n = 0; n < 256; n++) {
+		c = n;
+		for(k = 0; k < 8; k++) {
+			c = (c & 1) ? CRC32_POLY ^ (c >> 1) : c >> 1;
+		}
+		crc_table[n] = c;
+	}
+
+	crc_table_ready = 1;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if(!crc_table_ready) {
+		crc32_init_table();
+	}
+
+	crc = ~crc;
+	while(len--) {
+		crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
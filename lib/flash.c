@@ -0,0 +1,1423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "stm32.h"
+#include "crc32.h"
+#include "flash.h"
+#include "trace.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/*
+    Geometry to use when the caller didn't probe the part
+*/
+static const struct stm32_dev *flash_dev(const struct stm32_dev *dev)
+{
+	static struct stm32_dev def;
+
+	if(dev) {
+		return dev;
+	}
+
+	if(def.page_size == 0) {
+		stm_dev_default(&def);
+	}
+
+	return &def;
+}
+
+/*
+    Open a firmware file and work out how many flash pages of dev it covers
+*/
+int flash_image_open(struct flash_image *img, const char *path,
+        const struct stm32_dev *dev)
+{
+	img->dev = flash_dev(dev);
+	img->fp = fopen(path, "rb");
+	if(img->fp == NULL) {
+		LOG("File '%s' not found!", path);
+		return 1;
+	}
+
+	fseek (img->fp , 0 , SEEK_END);
+	img->size = ftell (img->fp);
+	img->offset = 0;
+	rewind (img->fp);
+
+	if(img->size <= 0 || img->size > img->dev->flash_size) {
+		LOG("%s: bad image size %ld", __func__, img->size);
+		flash_image_close(img);
+		return 1;
+	}
+
+	img->pages = (img->size + img->dev->page_size - 1) / img->dev->page_size;
+
+	return 0;
+}
+
+void flash_image_close(struct flash_image *img)
+{
+	if(img->fp) {
+		fclose(img->fp);
+	}
+
+	img->fp = NULL;
+}
+
+/*
+    Read len bytes of the image starting at off. Anything past the end of
+    the file is padded with 0xFF so it matches erased flash. Sequential
+    reads don't seek, so stdio keeps its buffer.
+*/
+int flash_image_read(struct flash_image *img, long off, uint8_t *buf,
+        unsigned int len)
+{
+	unsigned long start = trace_begin();
+	size_t r;
+
+	if(ftell(img->fp) != img->offset + off &&
+            fseek(img->fp, img->offset + off, SEEK_SET) != 0) {
+		return 1;
+	}
+
+	r = 0;
+	if(off < img->size) {
+		r = fread(buf, 1, len, img->fp);
+	}
+	trace_end("file", "read", start, len);
+	if(r < len) {
+		if(ferror(img->fp)) {
+			return 1;
+		}
+		memset(buf + r, STM_ERASED_BYTE, len - r);
+	}
+
+	return 0;
+}
+
+/*
+    Read one page of the image
+*/
+int flash_image_read_page(struct flash_image *img, unsigned int page,
+        uint8_t *buf)
+{
+	uint32_t page_size = img->dev->page_size;
+
+	return flash_image_read(img, (long)page * page_size, buf, page_size);
+}
+
+/*
+    Monotonic time in milliseconds, for timing the write and verify passes
+*/
+static unsigned long flash_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+    Report progress for count blocks. The count goes down by one per 256
+    byte block, same as the old write loops did
+*/
+static void flash_progress(struct flash_job *job, unsigned int count)
+{
+	while(count--) {
+		if(job->progress) {
+			job->progress(job->progress_arg, job->remaining);
+		}
+		job->remaining--;
+	}
+}
+
+/*
+    Get the bootloader back after a failed operation. When the error rate
+    says the link is degraded, or it won't come back at the current rate,
+    we drop down a baud rate. Otherwise we just reset and resync.
+*/
+static int flash_recover(struct serial_port_options *opts,
+        struct flash_link *link)
+{
+	uint32_t key = opts->baud_rate;
+	int degraded = stm_link_degraded();
+
+	if(link->reset == NULL) {
+		return 1;
+	}
+
+	while(link->retries < FLASH_MAX_RETRIES) {
+		link->retries++;
+		if(degraded) {
+			key = stm_baud_step_down(key);
+			if(key == 0) {
+				return 1;
+			}
+			link->downshifts++;
+		}
+		link->relinks++;
+		LOG("%s: relink at %s", __func__, serial_baud_key_to_str(key));
+		if(stm_relink(opts, key, link->reset, link->reset_arg) == 0) {
+			return 0;
+		}
+		degraded = 1;
+	}
+
+	return 1;
+}
+
+/*
+    Read, write and erase with recovery. A failed operation gets the link
+    back through flash_recover() and is tried again.
+*/
+static int flash_read(struct serial_port_options *opts,
+        struct flash_link *link, uint32_t addr, uint8_t *buf,
+        unsigned int len)
+{
+	while(stm_read_mem(opts, addr, buf, len) != 0) {
+		LOG("%s: read failed at 0x%08X", __func__, addr);
+		if(!stm_send_ahead_fell_back() && flash_recover(opts, link) != 0) {
+			return 1;
+		}
+		stm_metrics_retry();
+	}
+	link->retries = 0;
+
+	return 0;
+}
+
+static int flash_erase(struct serial_port_options *opts,
+        struct flash_link *link, unsigned int first, unsigned int count)
+{
+	while(stm_erase_pages(opts, first, count) != 0) {
+		LOG("%s: erase failed at page %d", __func__, first);
+		if(flash_recover(opts, link) != 0) {
+			return 1;
+		}
+		stm_metrics_retry();
+	}
+	link->retries = 0;
+
+	return 0;
+}
+
+/*
+    The write may have gone through before the link dropped, and flash
+    can't be programmed twice without an erase. So after a recovery we read
+    the block back first and only write it again if it is still blank. A
+    read back that can't be done fails the block, it is never written
+    blind.
+*/
+static int flash_write(struct serial_port_options *opts,
+        struct flash_link *link, struct stm_write_frame *f)
+{
+	uint8_t check[MAX_RW_SIZE];
+	const uint8_t *data = f->data;
+	unsigned int retries;
+
+	while(stm_write_frame_send(opts, f) != 0) {
+		LOG("%s: write failed at 0x%08X", __func__, f->addr);
+		/* Dropping out of send-ahead leaves the link in sync */
+		if(!stm_send_ahead_fell_back() && flash_recover(opts, link) != 0) {
+			return 1;
+		}
+		stm_metrics_retry();
+
+		/* The read back must not reset the retries the write has used */
+		retries = link->retries;
+		if(flash_read(opts, link, f->addr, check, f->len) != 0) {
+			LOG("%s: can't read back 0x%08X", __func__, f->addr);
+			return 1;
+		}
+		link->retries = retries;
+		if(memcmp(check, data, f->len) == 0) {
+			break;
+		}
+		if(!stm_block_erased(check, f->len)) {
+			LOG("%s: block 0x%08X is half written", __func__, f->addr);
+			return 1;
+		}
+	}
+	link->retries = 0;
+
+	return 0;
+}
+
+/*
+    Number of 256 byte blocks of a page that hold image data. Only the last
+    page can be short
+*/
+static unsigned int flash_page_blocks(struct flash_image *img,
+        unsigned int page)
+{
+	long left = img->size - (long)page * img->dev->page_size;
+
+	if(left >= img->dev->page_size) {
+		return img->dev->page_size / MAX_RW_SIZE;
+	}
+
+	return (left + MAX_RW_SIZE - 1) / MAX_RW_SIZE;
+}
+
+/*
+    Write the image blocks of an already erased page. Erased blocks are
+    skipped when skip_erased is set
+*/
+static int flash_write_page(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img, unsigned int page,
+        uint8_t *buf, int skip_erased)
+{
+	uint32_t addr = img->dev->flash_base + page * img->dev->page_size;
+	unsigned int b, blocks = flash_page_blocks(img, page);
+	struct stm_write_frame frame;
+	int written = 0;
+
+	for(b = 0; b < blocks; b++) {
+		if(skip_erased && stm_block_erased(buf + b * MAX_RW_SIZE, MAX_RW_SIZE)) {
+			LOG("%s: skipping erased block 0x%08X", __func__, addr);
+			job->stats.blocks_skipped++;
+		} else {
+			LOG("%s: writing %d bytes to 0x%08X", __func__, MAX_RW_SIZE, addr);
+			stm_write_frame_encode(&frame, addr, buf + b * MAX_RW_SIZE, 
+                    MAX_RW_SIZE);
+			if(flash_write(opts, &job->link, &frame) != 0) {
+				LOG("%s: write failed at 0x%08X", __func__, addr);
+				return 1;
+			}
+			job->stats.blocks_written++;
+			written = 1;
+		}
+		addr += MAX_RW_SIZE;
+		flash_progress(job, 1);
+	}
+
+	if(written) {
+		job->stats.pages_written++;
+	}
+
+	return 0;
+}
+
+/*
+    Pages go out in this order. The vector table lives in the first page,
+    it is written last so an update that is cut off never leaves an image
+    the part would boot.
+*/
+static unsigned int flash_page_order(struct flash_image *img, unsigned int i)
+{
+	return (i + 1) % img->pages;
+}
+
+/*
+    Journal of the pages the device has ACKed for one image. Each page
+    is marked with a single byte write that is synced before we go on, so
+    after a crash or a dropped link the journal never claims more than was
+    written. fd is -1 when there is no journal.
+*/
+struct flash_journal {
+	int fd;
+	unsigned int pages;
+	uint8_t *done;
+};
+
+static int flash_journal_done(struct flash_journal *jr, unsigned int page)
+{
+	return jr->fd >= 0 && jr->done[page];
+}
+
+static int flash_image_crc(struct flash_image *img, uint32_t *crc)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	unsigned int page;
+
+	*crc = 0;
+	for(page = 0; page < img->pages; page++) {
+		if(flash_image_read_page(img, page, page_buf) != 0) {
+			return 1;
+		}
+		*crc = crc32_update(*crc, page_buf, img->dev->page_size);
+	}
+
+	return 0;
+}
+
+/*
+    Open the journal at job->journal_path. When it is for this image and
+    this device the pages it lists are left alone, anything else is thrown
+    away and a fresh journal is started.
+*/
+static int flash_journal_open(struct flash_journal *jr, struct flash_job *job,
+        struct flash_image *img)
+{
+	struct flash_journal_hdr hdr, want;
+	unsigned int page;
+
+	jr->fd = -1;
+	jr->pages = img->pages;
+	jr->done = calloc(img->pages, 1);
+	if(jr->done == NULL) {
+		return 1;
+	}
+
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, FLASH_JOURNAL_MAGIC, sizeof(want.magic));
+	want.version = FLASH_JOURNAL_VERSION;
+	memcpy(want.uid, job->uid, STM_UID_SIZE);
+	want.size = img->size;
+	want.pages = img->pages;
+	if(flash_image_crc(img, &want.image_crc) != 0) {
+		goto err;
+	}
+
+	jr->fd = open(job->journal_path, O_RDWR | O_CREAT, 0644);
+	if(jr->fd < 0) {
+		LOG("%s: can't open '%s'", __func__, job->journal_path);
+		goto err;
+	}
+
+	if(read(jr->fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+            memcmp(&hdr, &want, sizeof(hdr)) == 0 &&
+            read(jr->fd, jr->done, jr->pages) == jr->pages) {
+		for(page = 0; page < jr->pages; page++) {
+			job->stats.pages_resumed += jr->done[page] ? 1 : 0;
+		}
+		LOG("%s: resuming, %d pages done", __func__,
+            job->stats.pages_resumed);
+		return 0;
+	}
+
+	memset(jr->done, 0, jr->pages);
+	if(ftruncate(jr->fd, 0) != 0 ||
+            pwrite(jr->fd, &want, sizeof(want), 0) != sizeof(want) ||
+            pwrite(jr->fd, jr->done, jr->pages, sizeof(want)) != jr->pages ||
+            fdatasync(jr->fd) != 0) {
+		close(jr->fd);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	jr->fd = -1;
+	free(jr->done);
+	jr->done = NULL;
+	return 1;
+}
+
+static int flash_journal_mark(struct flash_journal *jr, unsigned int page)
+{
+	uint8_t one = 1;
+
+	if(jr->fd < 0) {
+		return 0;
+	}
+	jr->done[page] = 1;
+	if(pwrite(jr->fd, &one, 1, sizeof(struct flash_journal_hdr) + page) != 1 ||
+            fdatasync(jr->fd) != 0) {
+		LOG("%s: can't mark page %d", __func__, page);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+    Once the write pass has gone through the journal has served its
+    purpose and is removed, before any verify pass. Pages are marked on
+    the ACK, not on a verify. A cut off update leaves it for the next try.
+*/
+static void flash_journal_close(struct flash_journal *jr, const char *path,
+        int finished)
+{
+	if(jr->fd >= 0) {
+		close(jr->fd);
+		if(finished) {
+			unlink(path);
+		}
+	}
+	jr->fd = -1;
+	free(jr->done);
+	jr->done = NULL;
+}
+
+/*
+    Count the pages an earlier update finished as done for this one
+*/
+static void flash_journal_skip(struct flash_job *job, struct flash_image *img,
+        struct flash_journal *jr)
+{
+	unsigned int page;
+
+	for(page = 0; page < img->pages; page++) {
+		if(flash_journal_done(jr, page)) {
+			flash_progress(job, flash_page_blocks(img, page));
+		}
+	}
+}
+
+/*
+    Write pipeline for the full update. A producer thread reads the image
+    a block at a time straight into a ring slot, pads it and encodes the
+    write frame around it ahead of time, and hands the
+    frames over through a single producer, single consumer ring. The
+    serial side only sends frames and waits for ACKs. Each index is only
+    ever written by one side, so the ring needs no lock, just the acquire
+    and release ordering on the index the other side reads.
+*/
+#define FLASH_PIPE_SLOTS	32		/* power of 2 */
+#define FLASH_PIPE_MASK		(FLASH_PIPE_SLOTS - 1)
+#define FLASH_PIPE_NAP_US	100
+
+typedef enum {
+	FLASH_SLOT_WRITE = 0,
+	FLASH_SLOT_SKIP,				/* erased block, nothing to send */
+	FLASH_SLOT_END,
+	FLASH_SLOT_ERROR,				/* the image could not be read */
+} flash_slot_t;
+
+struct flash_slot {
+	flash_slot_t type;
+	unsigned int page;
+	int last;						/* last block of its page */
+	struct stm_write_frame frame;
+	uint8_t data[MAX_RW_SIZE];		/* the frame is sent from here */
+};
+
+struct flash_pipe {
+	struct flash_slot slots[FLASH_PIPE_SLOTS];
+	unsigned int head;				/* next slot the producer fills */
+	unsigned int tail;				/* next slot the consumer sends */
+	int stop;						/* the consumer gave up */
+	struct flash_image *img;
+	struct flash_journal *journal;	/* pages it lists are not produced */
+	int sparse;
+};
+
+/*
+    Producer side. Returns the next free slot, waiting for the consumer if
+    the ring is full, or NULL once the consumer has stopped.
+*/
+static struct flash_slot *flash_pipe_slot(struct flash_pipe *pipe)
+{
+	while(pipe->head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) ==
+            FLASH_PIPE_SLOTS) {
+		if(__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		usleep(FLASH_PIPE_NAP_US);
+	}
+
+	return &pipe->slots[pipe->head & FLASH_PIPE_MASK];
+}
+
+static void flash_pipe_push(struct flash_pipe *pipe)
+{
+	__atomic_store_n(&pipe->head, pipe->head + 1, __ATOMIC_RELEASE);
+}
+
+static void *flash_pipe_producer(void *arg)
+{
+	struct flash_pipe *pipe = arg;
+	struct flash_image *img = pipe->img;
+	struct flash_slot *slot;
+	unsigned int i, page, b, blocks;
+	uint32_t addr;
+	long off;
+
+	for(i = 0; i < img->pages; i++) {
+		page = flash_page_order(img, i);
+		if(flash_journal_done(pipe->journal, page)) {
+			continue;
+		}
+		off = (long)page * img->dev->page_size;
+		addr = img->dev->flash_base + off;
+		blocks = flash_page_blocks(img, page);
+		for(b = 0; b < blocks; b++) {
+			if((slot = flash_pipe_slot(pipe)) == NULL) {
+				return NULL;
+			}
+			if(flash_image_read(img, off, slot->data, MAX_RW_SIZE) != 0) {
+				slot->type = FLASH_SLOT_ERROR;
+				flash_pipe_push(pipe);
+				return NULL;
+			}
+			slot->page = page;
+			slot->last = (b == blocks - 1);
+			if(pipe->sparse && stm_block_erased(slot->data, MAX_RW_SIZE)) {
+				slot->type = FLASH_SLOT_SKIP;
+			} else {
+				slot->type = FLASH_SLOT_WRITE;
+				stm_write_frame_encode(&slot->frame, addr, slot->data,
+                        MAX_RW_SIZE);
+			}
+			flash_pipe_push(pipe);
+			off += MAX_RW_SIZE;
+			addr += MAX_RW_SIZE;
+		}
+	}
+
+	if((slot = flash_pipe_slot(pipe)) != NULL) {
+		slot->type = FLASH_SLOT_END;
+		flash_pipe_push(pipe);
+	}
+
+	return NULL;
+}
+
+/*
+    Consumer side. Waits for the producer if the ring is empty, every time
+    that happens the link sat idle on host side work and it is counted.
+*/
+static struct flash_slot *flash_pipe_next(struct flash_pipe *pipe,
+        struct flash_job *job)
+{
+	if(__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == pipe->tail) {
+		job->stats.pipe_stalls++;
+		while(__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == pipe->tail) {
+			usleep(FLASH_PIPE_NAP_US);
+		}
+	}
+
+	return &pipe->slots[pipe->tail & FLASH_PIPE_MASK];
+}
+
+static void flash_pipe_pop(struct flash_pipe *pipe)
+{
+	__atomic_store_n(&pipe->tail, pipe->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Erase the pages of the image the journal doesn't list as done, a run
+    at a time. Without a journal that is all of them in one go.
+*/
+static int flash_erase_pending(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img,
+        struct flash_journal *jr)
+{
+	unsigned int first, page = 0;
+
+	while(page < img->pages) {
+		if(flash_journal_done(jr, page)) {
+			page++;
+			continue;
+		}
+		first = page;
+		while(page < img->pages && !flash_journal_done(jr, page)) {
+			page++;
+		}
+		LOG("%s: erasing %d pages from %d", __func__, page - first, first);
+		if(flash_erase(opts, &job->link, first, page - first) != 0) {
+			return 1;
+		}
+		job->stats.pages_erased += page - first;
+	}
+
+	return 0;
+}
+
+/*
+    Full update, erase every page the image covers and then write it. The
+    producer starts before the erase so the ring is full by the time the
+    first frame can go out. Pages the journal lists are neither erased nor
+    written, the rest are marked in it as they are ACKed.
+*/
+static int flash_update_full(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img,
+        struct flash_journal *jr)
+{
+	struct flash_pipe *pipe;
+	struct flash_slot *slot;
+	pthread_t producer;
+	int ret = 0, written = 0, done = 0;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if(pipe == NULL) {
+		return 1;
+	}
+	pipe->img = img;
+	pipe->journal = jr;
+	pipe->sparse = job->sparse;
+
+	if(pthread_create(&producer, NULL, flash_pipe_producer, pipe) != 0) {
+		LOG("%s: no producer thread", __func__);
+		free(pipe);
+		return 1;
+	}
+
+	flash_journal_skip(job, img, jr);
+	if(flash_erase_pending(opts, job, img, jr) != 0) {
+		ret = 1;
+		done = 1;
+	}
+
+	while(!done) {
+		slot = flash_pipe_next(pipe, job);
+		switch(slot->type) {
+			case FLASH_SLOT_WRITE:
+				LOG("%s: writing %d bytes to 0x%08X", __func__,
+					slot->frame.len, slot->frame.addr);
+				if(flash_write(opts, &job->link, &slot->frame) != 0) {
+					ret = 1;
+					done = 1;
+					break;
+				}
+				job->stats.blocks_written++;
+				written = 1;
+				break;
+			case FLASH_SLOT_SKIP:
+				job->stats.blocks_skipped++;
+				break;
+			case FLASH_SLOT_END:
+				done = 1;
+				break;
+			case FLASH_SLOT_ERROR:
+				ret = 1;
+				done = 1;
+				break;
+		}
+		if(!done) {
+			flash_progress(job, 1);
+			if(slot->last) {
+				job->stats.pages_written += written;
+				written = 0;
+				flash_journal_mark(jr, slot->page);
+			}
+		}
+		flash_pipe_pop(pipe);
+	}
+
+	__atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(producer, NULL);
+	free(pipe);
+
+	job->stats.pages_skipped = img->pages - job->stats.pages_written -
+		job->stats.pages_resumed;
+
+	return ret;
+}
+
+/*
+    Read what is currently in a flash page, either from the device or, when
+    we trust it, from the mirror of what we last wrote.
+*/
+static int flash_read_current(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img,
+        struct flash_image *mirror, unsigned int page, uint8_t *buf)
+{
+	uint32_t addr = img->dev->flash_base + page * img->dev->page_size;
+	unsigned int off;
+
+	if(mirror) {
+		return flash_image_read_page(mirror, page, buf);
+	}
+
+	for(off = 0; off < img->dev->page_size; off += MAX_RW_SIZE) {
+		if(flash_read(opts, &job->link, addr + off, buf + off,
+                    MAX_RW_SIZE) != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    Delta update, compare each page to what the flash holds now. Pages
+    that match are left alone. Pages that differ are erased, unless they
+    are already blank, and rewritten. Without a mirror the current contents
+    come from reading the page back. Pages past the end of the mirror are
+    unknown so they are always rewritten. The vector page is erased before
+    the first other page changes and written at the end.
+*/
+static int flash_update_delta(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img,
+        struct flash_image *mirror, struct flash_journal *jr)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	uint8_t dev_buf[STM_PAGE_SIZE_MAX];
+	uint32_t page_size = img->dev->page_size;
+	unsigned int i, page;
+	int known, vectors_erased = 0;
+
+	flash_journal_skip(job, img, jr);
+
+	for(i = 0; i < img->pages; i++) {
+		page = flash_page_order(img, i);
+		if(flash_journal_done(jr, page)) {
+			continue;
+		}
+		if(flash_image_read_page(img, page, page_buf) != 0) {
+			return 1;
+		}
+
+		if(page == 0 && vectors_erased) {
+			if(flash_write_page(opts, job, img, page, page_buf, 1) != 0) {
+				return 1;
+			}
+			flash_journal_mark(jr, page);
+			continue;
+		}
+
+		known = !mirror || page < mirror->pages;
+		if(known) {
+			if(flash_read_current(opts, job, img, mirror, page, dev_buf) != 0) {
+				return 1;
+			}
+
+			if(memcmp(page_buf, dev_buf, page_size) == 0) {
+				LOG("%s: page %d matches", __func__, page);
+				job->stats.pages_skipped++;
+				flash_progress(job, flash_page_blocks(img, page));
+				flash_journal_mark(jr, page);
+				continue;
+			}
+		}
+
+		if(page != 0 && !vectors_erased) {
+			LOG("%s: erasing the vector page", __func__);
+			if(flash_erase(opts, &job->link, 0, 1) != 0) {
+				return 1;
+			}
+			job->stats.pages_erased++;
+			vectors_erased = 1;
+		}
+
+		if(!known || !stm_block_erased(dev_buf, page_size)) {
+			LOG("%s: erasing page %d", __func__, page);
+			if(flash_erase(opts, &job->link, page, 1) != 0) {
+				return 1;
+			}
+			job->stats.pages_erased++;
+		}
+
+		/* The page is blank now so erased blocks never need writing */
+		if(flash_write_page(opts, job, img, page, page_buf, 1) != 0) {
+			return 1;
+		}
+		flash_journal_mark(jr, page);
+	}
+
+	return 0;
+}
+
+/*
+    Stub versions of the passes above. The loader stub takes large frames
+    with a window in flight and checks pages with a CRC on the target, so
+    nothing is read back over the link. Sparse and delta work the same as
+    through the ROM.
+*/
+static int flash_stub_write_page(struct flash_job *job,
+        struct flash_image *img, unsigned int page, uint8_t *buf,
+        int skip_erased)
+{
+	uint32_t addr = img->dev->flash_base + page * img->dev->page_size;
+	unsigned int b, run = 0, blocks = flash_page_blocks(img, page);
+	int written = 0;
+
+	/* Runs of blocks that need writing go out as one stub_write() */
+	for(b = 0; b <= blocks; b++) {
+		if(b < blocks && !(skip_erased &&
+                stm_block_erased(buf + b * MAX_RW_SIZE, MAX_RW_SIZE))) {
+			run++;
+			continue;
+		}
+		if(run) {
+			if(stub_write(job->stub, addr + (b - run) * MAX_RW_SIZE,
+                        buf + (b - run) * MAX_RW_SIZE, run * MAX_RW_SIZE) != 0) {
+				return 1;
+			}
+			job->stats.blocks_written += run;
+			flash_progress(job, run);
+			written = 1;
+			run = 0;
+		}
+		if(b < blocks) {
+			job->stats.blocks_skipped++;
+			flash_progress(job, 1);
+		}
+	}
+
+	if(written) {
+		job->stats.pages_written++;
+	}
+
+	return 0;
+}
+
+static int flash_stub_update_full(struct flash_job *job,
+        struct flash_image *img)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	unsigned int i, page;
+
+	if(stub_erase(job->stub, 0, img->pages) != 0) {
+		return 1;
+	}
+	job->stats.pages_erased = img->pages;
+
+	for(i = 0; i < img->pages; i++) {
+		page = flash_page_order(img, i);
+		if(flash_image_read_page(img, page, page_buf) != 0 ||
+                flash_stub_write_page(job, img, page, page_buf,
+                    job->sparse) != 0) {
+			return 1;
+		}
+	}
+	job->stats.pages_skipped = img->pages - job->stats.pages_written;
+
+	return stub_flush(job->stub);
+}
+
+/*
+    Delta through the stub, one CRC request covers many pages. A page
+    whose CRC matches the image is left alone, one that matches an erased
+    page is written without an erase. Resuming a cut off update costs no
+    more than that, so the stub doesn't keep a journal. The vector page
+    is handled last as in flash_update_delta().
+*/
+static int flash_stub_update_delta(struct flash_job *job,
+        struct flash_image *img)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	uint32_t page_size = img->dev->page_size;
+	uint32_t *crcs, erased_crc;
+	unsigned int i, page;
+	int ret = 1;
+
+	crcs = malloc(img->pages * sizeof(*crcs));
+	if(crcs == NULL) {
+		return 1;
+	}
+	if(stub_crc(job->stub, img->dev->flash_base, img->pages * page_size,
+                page_size, crcs) != 0) {
+		goto out;
+	}
+
+	memset(page_buf, STM_ERASED_BYTE, page_size);
+	erased_crc = crc32_update(0, page_buf, page_size);
+
+	for(i = 0; i < img->pages; i++) {
+		page = flash_page_order(img, i);
+		if(flash_image_read_page(img, page, page_buf) != 0) {
+			goto out;
+		}
+		if(crc32_update(0, page_buf, page_size) == crcs[page]) {
+			job->stats.pages_skipped++;
+			flash_progress(job, flash_page_blocks(img, page));
+			continue;
+		}
+		if(page != 0 && crcs[0] != erased_crc) {
+			if(stub_erase(job->stub, 0, 1) != 0) {
+				goto out;
+			}
+			job->stats.pages_erased++;
+			crcs[0] = erased_crc;
+		}
+		if(crcs[page] != erased_crc) {
+			if(stub_erase(job->stub, page, 1) != 0) {
+				goto out;
+			}
+			job->stats.pages_erased++;
+		}
+		if(flash_stub_write_page(job, img, page, page_buf, 1) != 0) {
+			goto out;
+		}
+	}
+
+	ret = stub_flush(job->stub);
+
+out:
+	free(crcs);
+	return ret;
+}
+
+/*
+    Verify through the stub. Only page CRCs come back, so a bad page is
+    reported to the mismatch callback as a whole.
+*/
+static int flash_stub_verify(struct flash_job *job, struct flash_image *img)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	uint32_t page_size = img->dev->page_size;
+	uint32_t *crcs, addr, len;
+	unsigned long start = flash_now_ms();
+	unsigned int page;
+
+	job->stats.verify_bad_pages = 0;
+	job->stats.verify_bytes = 0;
+
+	crcs = malloc(img->pages * sizeof(*crcs));
+	if(crcs == NULL) {
+		return 1;
+	}
+	if(stub_crc(job->stub, img->dev->flash_base, img->size, page_size,
+                crcs) != 0) {
+		free(crcs);
+		return 1;
+	}
+
+	for(page = 0; page < img->pages; page++) {
+		if(flash_image_read_page(img, page, page_buf) != 0) {
+			free(crcs);
+			return 1;
+		}
+		len = img->size - (long)page * page_size;
+		if(len > page_size) {
+			len = page_size;
+		}
+		job->stats.verify_bytes += len;
+		if(crc32_update(0, page_buf, len) != crcs[page]) {
+			addr = img->dev->flash_base + page * page_size;
+			LOG("%s: page %d crc 0x%08X", __func__, page, crcs[page]);
+			job->stats.verify_bad_pages++;
+			if(job->mismatch) {
+				job->mismatch(job->mismatch_arg, addr, len);
+			}
+		}
+	}
+	free(crcs);
+
+	job->stats.verify_ms = flash_now_ms() - start;
+
+	return job->stats.verify_bad_pages ? 1 : 0;
+}
+
+/*
+    Open the mirror file for this device. It has to have our header and
+    the unique ID has to match.
+*/
+static int flash_mirror_open(struct flash_image *mirror, const char *path,
+        const uint8_t *uid, const struct stm32_dev *dev)
+{
+	struct flash_mirror_hdr hdr;
+
+	mirror->dev = dev;
+	mirror->fp = fopen(path, "rb");
+	if(mirror->fp == NULL) {
+		LOG("%s: no mirror '%s'", __func__, path);
+		return 1;
+	}
+
+	if(fread(&hdr, sizeof(hdr), 1, mirror->fp) != 1 ||
+            memcmp(hdr.magic, FLASH_MIRROR_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != FLASH_MIRROR_VERSION ||
+            memcmp(hdr.uid, uid, STM_UID_SIZE) != 0 ||
+            hdr.size == 0 || hdr.size > dev->flash_size) {
+		LOG("%s: mirror '%s' is not valid", __func__, path);
+		flash_image_close(mirror);
+		return 1;
+	}
+
+	mirror->offset = sizeof(hdr);
+	mirror->size = hdr.size;
+	mirror->pages = (hdr.size + dev->page_size - 1) / dev->page_size;
+
+	return 0;
+}
+
+/*
+    Cheap check that the device still holds what the mirror says. We read
+    the first and the last block the mirror covers and compare them.
+*/
+static int flash_mirror_spot_check(struct serial_port_options *opts,
+        struct flash_image *mirror)
+{
+	const struct stm32_dev *dev = mirror->dev;
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	uint8_t dev_buf[MAX_RW_SIZE];
+	unsigned int page, off;
+	unsigned int last = mirror->pages - 1;
+
+	for(page = 0; page <= last; page += (last ? last : 1)) {
+		off = page == 0 ? 0 : dev->page_size - MAX_RW_SIZE;
+		if(flash_image_read_page(mirror, page, page_buf) != 0) {
+			return 1;
+		}
+		if(stm_read_mem(opts, dev->flash_base + page * dev->page_size + off,
+                    dev_buf, MAX_RW_SIZE) != 0) {
+			return 1;
+		}
+		if(memcmp(page_buf + off, dev_buf, MAX_RW_SIZE) != 0) {
+			LOG("%s: page %d does not match the mirror", __func__, page);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    Save the pages of the image we just flashed as the new mirror. It goes
+    to a temp file first and is renamed into place, so a crash never leaves
+    a half written mirror behind.
+*/
+static int flash_mirror_save(struct flash_job *job, struct flash_image *img)
+{
+	struct flash_mirror_hdr hdr;
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	char tmp_path[256];
+	unsigned int page;
+	FILE *fp;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->mirror_path);
+	fp = fopen(tmp_path, "wb");
+	if(fp == NULL) {
+		LOG("%s: can't create '%s'", __func__, tmp_path);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FLASH_MIRROR_MAGIC, sizeof(hdr.magic));
+	hdr.version = FLASH_MIRROR_VERSION;
+	memcpy(hdr.uid, job->uid, STM_UID_SIZE);
+	hdr.size = img->pages * img->dev->page_size;
+
+	if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		goto err;
+	}
+
+	for(page = 0; page < img->pages; page++) {
+		if(flash_image_read_page(img, page, page_buf) != 0 ||
+                fwrite(page_buf, img->dev->page_size, 1, fp) != 1) {
+			goto err;
+		}
+	}
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		goto err;
+	}
+	fclose(fp);
+
+	if(rename(tmp_path, job->mirror_path) != 0) {
+		unlink(tmp_path);
+		return 1;
+	}
+
+	return 0;
+
+err:
+	fclose(fp);
+	unlink(tmp_path);
+	return 1;
+}
+
+/*
+    Hand each run of bytes that differ between the image and the device
+    to the mismatch callback.
+*/
+static void flash_report_mismatch(struct flash_job *job, uint32_t addr,
+        const uint8_t *want, const uint8_t *got, unsigned int len)
+{
+	unsigned int i = 0, start;
+
+	while(i < len) {
+		if(want[i] == got[i]) {
+			i++;
+			continue;
+		}
+		start = i;
+		while(i < len && want[i] != got[i]) {
+			i++;
+		}
+		LOG("%s: mismatch at 0x%08X, %d bytes", __func__, addr + start,
+                i - start);
+		if(job->mismatch) {
+			job->mismatch(job->mismatch_arg, addr + start, i - start);
+		}
+	}
+}
+
+/*
+    Verify pass over the image. The flash is streamed back a MAX_RW_SIZE
+    chunk at a time and the CRC of each page is built up as the chunks
+    arrive, then compared with the CRC of the same page of the file. Only
+    one page of each is held at a time. When a page CRC is off the two
+    copies are compared byte by byte so the exact addresses get reported.
+*/
+static int flash_verify_image(struct serial_port_options *opts,
+        struct flash_job *job, struct flash_image *img)
+{
+	uint8_t page_buf[STM_PAGE_SIZE_MAX];
+	uint8_t dev_buf[STM_PAGE_SIZE_MAX];
+	uint32_t page_size = img->dev->page_size;
+	uint32_t addr, want_crc, got_crc;
+	unsigned int page, off, len, chunk;
+	unsigned long start = flash_now_ms();
+
+	job->stats.verify_bad_pages = 0;
+	job->stats.verify_bytes = 0;
+
+	for(page = 0; page < img->pages; page++) {
+		if(flash_image_read_page(img, page, page_buf) != 0) {
+			return 1;
+		}
+
+		/* Only the bytes that came from the file count */
+		len = img->size - (long)page * page_size;
+		if(len > page_size) {
+			len = page_size;
+		}
+		want_crc = crc32_update(0, page_buf, len);
+
+		addr = img->dev->flash_base + page * page_size;
+		got_crc = 0;
+		for(off = 0; off < len; off += chunk) {
+			chunk = len - off < MAX_RW_SIZE ? len - off : MAX_RW_SIZE;
+			if(flash_read(opts, &job->link, addr + off, dev_buf + off,
+                        chunk) != 0) {
+				return 1;
+			}
+			got_crc = crc32_update(got_crc, dev_buf + off, chunk);
+		}
+		job->stats.verify_bytes += len;
+
+		if(got_crc != want_crc) {
+			LOG("%s: page %d crc 0x%08X expected 0x%08X", __func__, page,
+                    got_crc, want_crc);
+			job->stats.verify_bad_pages++;
+			flash_report_mismatch(job, addr, page_buf, dev_buf, len);
+		}
+	}
+
+	job->stats.verify_ms = flash_now_ms() - start;
+
+	return job->stats.verify_bad_pages ? 1 : 0;
+}
+
+/*
+    Verify the flash against the firmware file in job->path without
+    writing anything.
+*/
+int flash_verify(struct serial_port_options *opts, struct flash_job *job)
+{
+	struct flash_image img;
+	int ret;
+
+	if(flash_image_open(&img, job->path, job->dev) != 0) {
+		return 1;
+	}
+
+	if(job->stub) {
+		ret = flash_stub_verify(job, &img);
+	} else {
+		ret = flash_verify_image(opts, job, &img);
+	}
+	flash_image_close(&img);
+
+	return ret;
+}
+
+/*
+    Flash the firmware file in job->path. Progress is reported through
+    job->progress and a summary of what was done is left in job->stats.
+
+    With a journal path set the pages the device ACKs are recorded as we
+    go. If the update is cut off the next one for the same image and device
+    carries on from the first page that wasn't done. Either way the vector
+    page is written last.
+
+    With a mirror path set we first try the mirror of what was last written
+    to this device. If it is there and a spot check of the flash agrees with
+    it, only the pages that differ from the mirror are touched and nothing
+    is read back. Otherwise we fall back to job->mode. The mirror is
+    replaced after a successful update and dropped when one fails. With
+    job->verify set the update only counts as successful once the verify
+    pass agrees with the file.
+*/
+int flash_update(struct serial_port_options *opts, struct flash_job *job)
+{
+	struct flash_image img;
+	struct flash_image mirror = { .fp = NULL };
+	struct flash_journal journal = { .fd = -1 };
+	int use_mirror = 0;
+	unsigned long start;
+	int ret;
+
+	memset(&job->stats, 0, sizeof(job->stats));
+
+	if(flash_image_open(&img, job->path, job->dev) != 0) {
+		return 1;
+	}
+
+	/* How many 256 byte chunks we have */
+	job->remaining = img.size / MAX_RW_SIZE;
+	job->stats.pages = img.pages;
+
+	LOG("%s: file size is %ld; pages = %d, fw = %s", __func__,
+            img.size, img.pages, job->path);
+
+	start = flash_now_ms();
+	/* Without the UID a journal can't tell boards apart */
+	if(job->journal_path && job->uid && job->stub == NULL &&
+            flash_journal_open(&journal, job, &img) != 0) {
+		LOG("%s: no journal, '%s'", __func__, job->journal_path);
+	}
+
+	if(job->mirror_path && job->uid) {
+		/* The spot check needs the ROM, the stub has page CRCs instead */
+		if(job->stub == NULL && flash_mirror_open(&mirror, job->mirror_path,
+                    job->uid, img.dev) == 0) {
+			use_mirror = flash_mirror_spot_check(opts, &mirror) == 0;
+			LOG("%s: mirror %s", __func__, use_mirror ? "hit" : "stale");
+		}
+		/* From here on the flash may not match the mirror any more */
+		unlink(job->mirror_path);
+	}
+
+	if(job->stub) {
+		if(job->mode == FLASH_MODE_DELTA) {
+			ret = flash_stub_update_delta(job, &img);
+		} else {
+			ret = flash_stub_update_full(job, &img);
+		}
+	} else if(use_mirror) {
+		job->stats.mirror_hit = 1;
+		ret = flash_update_delta(opts, job, &img, &mirror, &journal);
+	} else {
+		switch(job->mode) {
+			case FLASH_MODE_DELTA:
+				ret = flash_update_delta(opts, job, &img, NULL, &journal);
+				break;
+			case FLASH_MODE_FULL:
+			default:
+				ret = flash_update_full(opts, job, &img, &journal);
+				break;
+		}
+	}
+	flash_image_close(&mirror);
+	flash_journal_close(&journal, job->journal_path, ret == 0);
+	job->stats.write_ms = flash_now_ms() - start;
+
+	if(ret == 0 && job->verify) {
+		if(job->stub) {
+			ret = flash_stub_verify(job, &img);
+		} else {
+			ret = flash_verify_image(opts, job, &img);
+		}
+	}
+
+	if(ret == 0 && job->mirror_path && job->uid) {
+		if(flash_mirror_save(job, &img) != 0) {
+			LOG("%s: saving mirror '%s' failed", __func__, job->mirror_path);
+		}
+	}
+
+	flash_image_close(&img);
+
+	LOG("%s: pages %d, skipped %d, erased %d, written %d", __func__,
+            job->stats.pages, job->stats.pages_skipped,
+            job->stats.pages_erased, job->stats.pages_written);
+
+	return ret;
+}
+
+/*
+    Dump dump->len bytes of flash starting at dump->addr to dump->path. The
+    file is preallocated to the dump size and mapped, and each chunk is
+    read straight into the mapping.
+
+    With holes set the file is only truncated to size, and file pages that
+    come back fully erased are never touched, so they stay holes and cost
+    no disk space. Holes read back as 0x00, not 0xFF. We work a whole file
+    page at a time in that mode, skipping part of a page would leave zeros
+    in a page that does get written.
+*/
+int flash_dump(struct serial_port_options *opts, struct flash_dump *dump)
+{
+	const struct stm32_dev *dev = flash_dev(dump->dev);
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long start = flash_now_ms();
+	uint8_t *map, *unit_buf = NULL;
+	uint32_t off, unit, chunk, pos;
+	int fd, ret = 1;
+	int remaining;
+
+	dump->hole_bytes = 0;
+	/* Written so that nothing can wrap around in 32 bits */
+	if(dump->len == 0 || dump->addr < dev->flash_base ||
+            dump->addr - dev->flash_base > dev->flash_size ||
+            dump->len > dev->flash_size - (dump->addr - dev->flash_base)) {
+		LOG("%s: 0x%08X+0x%X is outside flash", __func__, dump->addr,
+                dump->len);
+		return 1;
+	}
+
+	fd = open(dump->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		LOG("%s: can't create '%s'", __func__, dump->path);
+		return 1;
+	}
+
+	if(dump->holes) {
+		if(ftruncate(fd, dump->len) != 0) {
+			goto out_close;
+		}
+		unit_buf = malloc(page_size);
+		if(unit_buf == NULL) {
+			goto out_close;
+		}
+	} else if(posix_fallocate(fd, 0, dump->len) != 0) {
+		LOG("%s: can't allocate %d bytes", __func__, dump->len);
+		goto out_close;
+	}
+
+	map = mmap(NULL, dump->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		LOG("%s: mmap failed", __func__);
+		goto out_close;
+	}
+
+	remaining = (dump->len + MAX_RW_SIZE - 1) / MAX_RW_SIZE;
+	for(off = 0; off < dump->len; off += unit) {
+		unit = dump->holes ? page_size : MAX_RW_SIZE;
+		if(unit > dump->len - off) {
+			unit = dump->len - off;
+		}
+
+		for(pos = 0; pos < unit; pos += chunk) {
+			chunk = unit - pos < MAX_RW_SIZE ? unit - pos : MAX_RW_SIZE;
+			if(flash_read(opts, &dump->link, dump->addr + off + pos,
+                        dump->holes ? unit_buf + pos : map + off + pos,
+                        chunk) != 0) {
+				LOG("%s: read failed at 0x%08X", __func__,
+                        dump->addr + off + pos);
+				goto out_unmap;
+			}
+			if(dump->progress) {
+				dump->progress(dump->progress_arg, remaining--);
+			}
+		}
+
+		if(dump->holes) {
+			if(stm_block_erased(unit_buf, unit)) {
+				dump->hole_bytes += unit;
+			} else {
+				memcpy(map + off, unit_buf, unit);
+			}
+		}
+	}
+
+	ret = msync(map, dump->len, MS_SYNC) == 0 ? 0 : 1;
+	dump->ms = flash_now_ms() - start;
+
+out_unmap:
+	munmap(map, dump->len);
+out_close:
+	free(unit_buf);
+	close(fd);
+	return ret;
+}
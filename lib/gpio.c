@@ -2,11 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
 
-#include "linux/i2c-dev-user.h"
 #include "gpio.h"
+#include "trace.h"
 
 /* Uncomment for full debugging */
 //#define DEBUG
@@ -16,139 +14,218 @@
 #define LOG(format, ...)
 #endif
 
-static int fd = 0;
+static const struct gpio_backend *backends[] = {
+	&gpio_expander_backend,
+	&gpio_chip_backend,
+	&gpio_modem_backend,
+	&gpio_mock_backend,
+};
 
+static const struct gpio_backend *backend = &gpio_expander_backend;
+static char *backend_arg;
 
-/* 
-    Set up the GPIO for the reset and boot pin on the STM32 
+/*
+    Shadow of the pin levels. Every change goes through here, so pins are
+    changed without reading the backend back first.
+*/
+static uint8_t shadow;
+static int opened;
+static struct gpio_stats stats;
+static struct gpio_stats last_seq;
+
+static int gpio_write(uint8_t pins)
+{
+	unsigned long start = trace_begin();
+	int r;
+
+	stats.writes++;
+	r = backend->set(pins);
+	trace_end("gpio", "write", start, pins);
+
+	return r;
+}
+
+/*
+    Pick the backend from a spec, the name optionally followed by a colon
+    and whatever the backend takes: expander[:i2c_dev],
+    gpiochip:chip_dev:boot_line,reset_line, modem[:boot,reset] or mock.
+    Call before gpio_init().
+*/
+int gpio_select(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+	unsigned int i;
+
+	for(i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if(strlen(backends[i]->name) == len && 
+                !strncmp(backends[i]->name, spec, len)) {
+			backend = backends[i];
+			free(backend_arg);
+			backend_arg = colon ? strdup(colon + 1) : NULL;
+			return 0;
+		}
+	}
+
+	LOG("unknown gpio backend '%s'", spec);
+	return 1;
+}
+
+const struct gpio_backend *gpio_get_backend(void)
+{
+	return backend;
+}
+
+/*
+    Set up the GPIO for the reset and boot pin on the STM32. The STM32 is
+    left running, boot low and reset high.
 */
 int gpio_init(void)
 {
 	int rv = 0;
-	
-    /* Open the i2c device */
-	fd = open(I2C_DEV, O_RDWR);
-	if(fd < 0) {
-		LOG("open %s failed!", I2C_DEV);
-		return -ENODEV;
-	}
-	
-	rv = ioctl(fd, I2C_SLAVE, I2C_ADDR);
-	if(rv < 0) {
-		LOG("slave ioctl 0x%02X failed!", I2C_ADDR);
-		return -ENODEV;
-	}
-	
-    /* Use GPIO 2 and 3, pins 1 and 2 on J22 */
-	rv = i2c_smbus_write_byte_data(fd, I2C_CTRL_REG, 0xF3);
-	if(rv < 0) {
-		perror("smbus ctrl_reg write failed!");
-		return -1;
-	}
 
-	rv = i2c_smbus_write_byte_data(fd, I2C_OUT_REG, 0x08);
-	if(rv < 0) {
-		perror("smbus out_reg write failed!");
-		return -1;
-	}
-	
-	rv = i2c_smbus_read_byte_data(fd, I2C_CTRL_REG);
+	memset(&stats, 0, sizeof(stats));
+
+	rv = backend->open(backend_arg);
 	if(rv < 0) {
-		perror("smbus ctrl_reg read failed!");
-		return -1;
+		LOG("%s open failed!", backend->name);
+		return rv;
 	}
-	
-	rv = i2c_smbus_read_byte_data(fd, I2C_OUT_REG);
+
+	rv = gpio_write(GPIO_RESET_PIN);
 	if(rv < 0) {
-		perror("smbus out_reg read failed!");
+		perror("gpio write failed!");
+		backend->close();
 		return -1;
 	}
-	
+	shadow = GPIO_RESET_PIN;
+	opened = 1;
+
 	return 0;
 }
 
 
-/* 
-    Reset the GPIO port 
+/*
+    Reset the GPIO port
 */
 void gpio_deinit(void)
 {
-	int rv = 0;
-    
-    /* Set all pins to input */
-	rv = i2c_smbus_write_byte_data(fd, I2C_CTRL_REG, 0xFF);
-	if(rv < 0) {
-		LOG("smbus write failed!");
-	}
-    /* Set all pins to low */
-	rv = i2c_smbus_write_byte_data(fd, I2C_OUT_REG, 0x00);
-	if(rv < 0) {
-		LOG("smbus write failed!");
-	}
-	
-	if(fd) {
-		close(fd);
+	if(!opened) {
+		return;
 	}
+	backend->close();
+	shadow = 0;
+	opened = 0;
 }
 
-/* 
-    Toggle the boot pin, LOW or HIGH 
-*/
-void gpio_toggle_boot(pin_state p)
+static uint8_t gpio_apply(uint8_t reg, uint8_t pin, pin_state p)
 {
-	int rv = 0, reg = 0;
-	
-    /* read the GPIO out reg */
-	reg = i2c_smbus_read_byte_data(fd, I2C_OUT_REG);
-	if(reg < 0) {
-		LOG("smbus read failed!");
-	}
-
     /* Clear or set the GPIO pin */
 	switch (p) {
 		case LOW:
-			reg &= ~(1 << 2);
+			reg &= ~pin;
 			break;
 		case HIGH:
-			reg |= 1 << 2;
+			reg |= pin;
+			break;
+		case KEEP:
 			break;
 		default:
 			LOG("invalid case %d", p);
 	}
-	
-	rv = i2c_smbus_write_byte_data(fd, I2C_OUT_REG, reg);
-	if(rv < 0) {
-		LOG("smbus write failed!");
-	}
+
+	return reg;
 }
 
-/* 
-    Toggle the reset pin, LOW or HIGH 
+/*
+    Run a sequence of pin states. Each step costs one backend write, both
+    pins change in the same write, and a step that changes nothing costs none.
+    st gets the transactions the sequence took, it can be NULL.
 */
-void gpio_toggle_reset(pin_state p)
+int gpio_sequence(const struct gpio_step *steps, unsigned int n,
+        struct gpio_stats *st)
 {
-	int rv = 0, reg = 0;
+	struct gpio_stats before = stats;
+	unsigned int i;
+	uint8_t reg;
+	int ret = 0;
 
-    /* read the GPIO out reg */
-	reg = i2c_smbus_read_byte_data(fd, I2C_OUT_REG);
-	if(reg < 0) {
-		LOG("smbus read failed!");
+	/* Nothing to drive if gpio_init() failed */
+	if(!opened) {
+		n = 0;
+		ret = 1;
 	}
 
-    /* Clear or set the GPIO pin */
-	switch (p) {
-		case LOW:
-			reg &= ~(1 << 3);
-			break;
-		case HIGH:
-			reg |= 1 << 3;			
-			break;
-		default:
-			LOG("invalid case %d", p);
+	for(i = 0; i < n; i++) {
+		reg = gpio_apply(shadow, GPIO_BOOT_PIN, steps[i].boot);
+		reg = gpio_apply(reg, GPIO_RESET_PIN, steps[i].reset);
+		if(reg != shadow) {
+			if(gpio_write(reg) < 0) {
+				LOG("%s write failed!", backend->name);
+				ret = 1;
+				break;
+			}
+			shadow = reg;
+		}
+		if(steps[i].delay_us) {
+			usleep(steps[i].delay_us);
+		}
 	}
-	
-	rv = i2c_smbus_write_byte_data(fd, I2C_OUT_REG, reg);
-	if(rv < 0) {
-		LOG("smbus write failed!");
+
+	last_seq.writes = stats.writes - before.writes;
+	if(st) {
+		*st = last_seq;
 	}
+
+	return ret;
+}
+
+/*
+    Toggle the boot pin, LOW or HIGH
+*/
+void gpio_toggle_boot(pin_state p)
+{
+	struct gpio_step step = { .boot = p, .reset = KEEP };
+
+	gpio_sequence(&step, 1, NULL);
+}
+
+/*
+    Toggle the reset pin, LOW or HIGH
+*/
+void gpio_toggle_reset(pin_state p)
+{
+	struct gpio_step step = { .boot = KEEP, .reset = p };
+
+	gpio_sequence(&step, 1, NULL);
+}
+
+/*
+    Reset the STM32 with the boot pin at boot. BOOT0 is only sampled as
+    reset is released, so it is set in the same write that pulls reset
+    low and has the whole pulse to settle. That is two writes in all.
+*/
+void gpio_reset_pulse(pin_state boot, unsigned int setup_us,
+        unsigned int pulse_us)
+{
+	struct gpio_step steps[] = {
+		{ .boot = boot, .reset = LOW,
+			.delay_us = pulse_us > setup_us ? pulse_us : setup_us },
+		{ .boot = KEEP, .reset = HIGH },
+	};
+
+	gpio_sequence(steps, 2, NULL);
+}
+
+void gpio_get_stats(struct gpio_stats *st)
+{
+	*st = stats;
+}
+
+/*
+    Transactions the last sequence, pulse or toggle took
+*/
+void gpio_get_last_sequence(struct gpio_stats *st)
+{
+	*st = last_seq;
 }
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/*
+    Two lines of a Linux GPIO character device, spec arg
+    chip_dev:boot_line,reset_line, like /dev/gpiochip0:4,5. Both lines are
+    requested as outputs in one handle, so a set is one bulk ioctl.
+*/
+enum {CHIP_BOOT = 0, CHIP_RESET, CHIP_LINES};
+
+static int handle = -1;
+
+static int chip_open(const char *arg)
+{
+	struct gpiohandle_request req;
+	char dev[64];
+	unsigned int boot, reset;
+	int fd, rv;
+
+	if(!arg || sscanf(arg, "%63[^:]:%u,%u", dev, &boot, &reset) != 3) {
+		LOG("gpiochip needs chip_dev:boot_line,reset_line");
+		return -EINVAL;
+	}
+
+	fd = open(dev, O_RDWR);
+	if(fd < 0) {
+		LOG("open %s failed!", dev);
+		return -ENODEV;
+	}
+
+	/* Come up with the STM32 running, boot low and reset high */
+	memset(&req, 0, sizeof(req));
+	req.lineoffsets[CHIP_BOOT] = boot;
+	req.lineoffsets[CHIP_RESET] = reset;
+	req.default_values[CHIP_BOOT] = 0;
+	req.default_values[CHIP_RESET] = 1;
+	req.lines = CHIP_LINES;
+	req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+	strncpy(req.consumer_label, "isp", sizeof(req.consumer_label) - 1);
+
+	rv = ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+	close(fd);
+	if(rv < 0) {
+		perror("gpiochip line request failed!");
+		return -ENODEV;
+	}
+	handle = req.fd;
+
+	return 0;
+}
+
+/*
+    Once the handle is gone the lines keep the level they had
+*/
+static void chip_close(void)
+{
+	if(handle >= 0) {
+		close(handle);
+		handle = -1;
+	}
+}
+
+static int chip_set(uint8_t pins)
+{
+	struct gpiohandle_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.values[CHIP_BOOT] = !!(pins & GPIO_BOOT_PIN);
+	data.values[CHIP_RESET] = !!(pins & GPIO_RESET_PIN);
+
+	return ioctl(handle, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+}
+
+const struct gpio_backend gpio_chip_backend = {
+	.name = "gpiochip",
+	.open = chip_open,
+	.close = chip_close,
+	.set = chip_set,
+};
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "linux/i2c-dev-user.h"
+#include "gpio.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/*
+    The I/O expander at I2C_ADDR, through SMBus on I2C_DEV unless the
+    spec names another bus. Only GPIO 2 and 3 are outputs, so the output
+    register is written as a whole.
+*/
+static int fd = -1;
+
+static int expander_open(const char *arg)
+{
+	const char *dev = arg ? arg : I2C_DEV;
+	int rv = 0;
+
+    /* Open the i2c device */
+	fd = open(dev, O_RDWR);
+	if(fd < 0) {
+		LOG("open %s failed!", dev);
+		return -ENODEV;
+	}
+
+	rv = ioctl(fd, I2C_SLAVE, I2C_ADDR);
+	if(rv < 0) {
+		LOG("slave ioctl 0x%02X failed!", I2C_ADDR);
+		goto fail;
+	}
+
+    /* Use GPIO 2 and 3, pins 1 and 2 on J22 */
+	rv = i2c_smbus_write_byte_data(fd, I2C_CTRL_REG, 0xF3);
+	if(rv < 0) {
+		perror("smbus ctrl_reg write failed!");
+		goto fail;
+	}
+
+	rv = i2c_smbus_read_byte_data(fd, I2C_CTRL_REG);
+	if(rv < 0) {
+		perror("smbus ctrl_reg read failed!");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(fd);
+	fd = -1;
+	return -ENODEV;
+}
+
+static void expander_close(void)
+{
+	int rv = 0;
+
+	if(fd < 0) {
+		return;
+	}
+
+    /* Set all pins to input */
+	rv = i2c_smbus_write_byte_data(fd, I2C_CTRL_REG, 0xFF);
+	if(rv < 0) {
+		LOG("smbus write failed!");
+	}
+    /* Set all pins to low */
+	rv = i2c_smbus_write_byte_data(fd, I2C_OUT_REG, 0x00);
+	if(rv < 0) {
+		LOG("smbus write failed!");
+	}
+
+	close(fd);
+	fd = -1;
+}
+
+static int expander_set(uint8_t pins)
+{
+	return i2c_smbus_write_byte_data(fd, I2C_OUT_REG, pins);
+}
+
+const struct gpio_backend gpio_expander_backend = {
+	.name = "expander",
+	.open = expander_open,
+	.close = expander_close,
+	.set = expander_set,
+};
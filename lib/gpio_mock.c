@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gpio.h"
+
+/*
+    In memory stand-in for the pins. Every write is logged with a
+    timestamp so the edges and the time between them can be checked.
+*/
+static struct {
+	uint8_t pins;
+	struct gpio_mock_write log[GPIO_MOCK_LOG_MAX];
+	unsigned int nlog;
+	unsigned long start_us;
+} mock;
+
+static unsigned long mock_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int mock_open(const char *arg)
+{
+	memset(&mock, 0, sizeof(mock));
+	mock.start_us = mock_now_us();
+
+	return 0;
+}
+
+static void mock_close(void)
+{
+}
+
+static int mock_set(uint8_t pins)
+{
+	mock.pins = pins;
+
+	if(mock.nlog < GPIO_MOCK_LOG_MAX) {
+		mock.log[mock.nlog].val = pins;
+		mock.log[mock.nlog].us = mock_now_us() - mock.start_us;
+		mock.nlog++;
+	}
+
+	return 0;
+}
+
+const struct gpio_backend gpio_mock_backend = {
+	.name = "mock",
+	.open = mock_open,
+	.close = mock_close,
+	.set = mock_set,
+};
+
+uint8_t gpio_mock_pins(void)
+{
+	return mock.pins;
+}
+
+/*
+    The writes so far, oldest first
+*/
+unsigned int gpio_mock_log(const struct gpio_mock_write **log)
+{
+	*log = mock.log;
+	return mock.nlog;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#include "gpio.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/*
+    The modem control lines of the serial port already open to the STM32,
+    the usual wiring of a USB serial adapter. The spec arg is boot,reset
+    naming the line for each pin, rts,dtr if there is none. An asserted
+    line is low at a TTL adapter's pin, a ! in front of the name flips
+    that for boards with an inverter in between.
+*/
+struct modem_line {
+	int bit;
+	int invert;
+};
+
+static int tty_fd = -1;
+static int modem_bits;
+static struct modem_line boot_line, reset_line;
+
+void gpio_modem_set_fd(int fd)
+{
+	tty_fd = fd;
+}
+
+static int modem_parse_line(const char *name, size_t len, 
+        struct modem_line *line)
+{
+	line->invert = 0;
+	if(len && *name == '!') {
+		line->invert = 1;
+		name++;
+		len--;
+	}
+
+	if(len == 3 && !strncmp(name, "rts", 3)) {
+		line->bit = TIOCM_RTS;
+	} else if(len == 3 && !strncmp(name, "dtr", 3)) {
+		line->bit = TIOCM_DTR;
+	} else {
+		return 1;
+	}
+
+	return 0;
+}
+
+static int modem_open(const char *arg)
+{
+	const char *comma;
+
+	if(!arg) {
+		arg = "rts,dtr";
+	}
+	comma = strchr(arg, ',');
+	if(!comma || modem_parse_line(arg, comma - arg, &boot_line) != 0 ||
+            modem_parse_line(comma + 1, strlen(comma + 1), &reset_line) != 0 ||
+            boot_line.bit == reset_line.bit) {
+		LOG("modem needs boot,reset as rts or dtr");
+		return -EINVAL;
+	}
+
+	if(tty_fd < 0) {
+		LOG("no serial port for the modem lines");
+		return -ENODEV;
+	}
+
+	/* The other modem bits are written back as they are */
+	if(ioctl(tty_fd, TIOCMGET, &modem_bits) < 0) {
+		perror("TIOCMGET failed!");
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/*
+    The port is closed by the serial code, the lines stay where they are
+    until then
+*/
+static void modem_close(void)
+{
+}
+
+static int modem_line_bit(const struct modem_line *line, int high)
+{
+	return (high ^ !line->invert) ? line->bit : 0;
+}
+
+static int modem_set(uint8_t pins)
+{
+	int bits = modem_bits & ~(TIOCM_RTS | TIOCM_DTR);
+
+	bits |= modem_line_bit(&boot_line, !!(pins & GPIO_BOOT_PIN));
+	bits |= modem_line_bit(&reset_line, !!(pins & GPIO_RESET_PIN));
+
+	if(ioctl(tty_fd, TIOCMSET, &bits) < 0) {
+		return -errno;
+	}
+	modem_bits = bits;
+
+	return 0;
+}
+
+const struct gpio_backend gpio_modem_backend = {
+	.name = "modem",
+	.open = modem_open,
+	.close = modem_close,
+	.set = modem_set,
+};
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hist.h"
+
+/* 
+    Bucket for a value. The top set bit picks the power of two, the 
+    HIST_SUB_BITS bits below it pick the bucket within it. 
+*/
+static unsigned int hist_index(uint32_t v)
+{
+	unsigned int mag, shift;
+
+	if(v < HIST_SUB_COUNT) {
+		return v;
+	}
+
+	mag = 31 - __builtin_clz(v);
+	shift = mag - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB_COUNT + (v >> shift) - HIST_SUB_COUNT;
+}
+
+/* 
+    Highest value that lands in a bucket 
+*/
+static uint32_t hist_upper(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t low;
+
+	if(idx < HIST_SUB_COUNT) {
+		return idx;
+	}
+
+	shift = idx / HIST_SUB_COUNT - 1;
+	low = (uint64_t)(HIST_SUB_COUNT + idx % HIST_SUB_COUNT) << shift;
+
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_add(struct hist *h, uint32_t v)
+{
+	if(h->count == 0 || v < h->min) {
+		h->min = v;
+	}
+	if(v > h->max) {
+		h->max = v;
+	}
+	h->count++;
+	h->sum += v;
+	h->bucket[hist_index(v)]++;
+}
+
+/* 
+    Value pct percent of the samples are at or below, rounded up to the 
+    end of its bucket but never past the largest value seen 
+*/
+uint32_t hist_percentile(const struct hist *h, unsigned int pct)
+{
+	unsigned long want, seen = 0;
+	unsigned int i;
+
+	if(h->count == 0) {
+		return 0;
+	}
+
+	want = (h->count * pct + 99) / 100;
+	if(want == 0) {
+		want = 1;
+	}
+
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if(seen >= want) {
+			return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+uint32_t hist_mean(const struct hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
@@ -6,6 +6,8 @@
 #include <termios.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/serial.h>
 
@@ -74,33 +76,201 @@ static void serial_tio_init(struct termios *t)
 	t->c_oflag &= ~(OPOST | ONLCR);
     t->c_cflag |= INPCK | PARENB | CS8 | CLOCAL | CREAD;
 
+    /* Reads never block in the driver, serial_read_timeout() polls */
     t->c_cc[VMIN] = 0;
-    t->c_cc[VTIME] = 5;
+    t->c_cc[VTIME] = 0;
 }
 
 /* 
-    Init the serial port 
+    Open a termios tty in raw mode at opts->baud_rate 
 */
-int serial_init(struct serial_port_options *opts)
+static int tty_open(struct serial_port_options *opts, const char *path)
 {
 	struct termios tio;
 	
     /* Open the serial port */
-	opts->fd = open(opts->device, O_RDWR | O_NOCTTY);
+	opts->fd = open(path, O_RDWR | O_NOCTTY);
 	if (opts->fd == -1) {
 		/* Could not open the port. */
-		LOG("open_port: Unable to open %s", opts->device);
-		return opts->fd;
+		LOG("open_port: Unable to open %s", path);
+		return -1;
 	}
     
     /* We have a file descriptor so set the serial options and baud rate */
     serial_tio_init(&tio);
     tcflush(opts->fd, TCIFLUSH);
-    cfsetospeed(&tio, opts->baud_rate);
-	cfsetispeed(&tio, opts->baud_rate);
+    if (!(opts->baud_rate & SERIAL_BAUD_CUSTOM)) {
+        cfsetospeed(&tio, opts->baud_rate);
+        cfsetispeed(&tio, opts->baud_rate);
+    }
 	tcsetattr(opts->fd, TCSANOW, &tio);
+    if (opts->baud_rate & SERIAL_BAUD_CUSTOM) {
+        opts->transport->set_baud(opts, opts->baud_rate);
+    }
+
+    return 0;
+}
+
+static void fd_close(struct serial_port_options *opts)
+{
+	if(opts->fd > 0) {
+		close(opts->fd);
+	}
+}
+
+static ssize_t fd_readv(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    return readv(opts->fd, iov, iovcnt);
+}
+
+static ssize_t fd_writev(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    return writev(opts->fd, iov, iovcnt);
+}
+
+static int fd_wait(struct serial_port_options *opts, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = opts->fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout_ms);
+}
+
+/* 
+    Rates from the BaudTable go through termios, anything else through 
+    termios2/BOTHER. 
+*/
+static int tty_set_baud(struct serial_port_options *opts, uint32_t baud_key)
+{
+	struct termios tio;
+
+    if(baud_key & SERIAL_BAUD_CUSTOM) {
+        if(serial_set_custom_speed(opts->fd, baud_key & ~SERIAL_BAUD_CUSTOM) != 0) {
+            LOG("%s: custom speed failed", __func__);
+            return 1;
+        }
+    } else {
+        if(tcgetattr(opts->fd, &tio) != 0) {
+            return 1;
+        }
+        cfsetospeed(&tio, baud_key);
+        cfsetispeed(&tio, baud_key);
+        if(tcsetattr(opts->fd, TCSADRAIN, &tio) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void tty_flush(struct serial_port_options *opts)
+{
+    tcflush(opts->fd, TCIOFLUSH);
+}
+
+static unsigned long tty_wire_us(struct serial_port_options *opts, size_t n)
+{
+    return serial_baud_wire_us(opts->baud_rate, n);
+}
+
+const struct serial_transport serial_termios_transport = {
+    .name = "tty",
+    .open = tty_open,
+    .close = fd_close,
+    .readv = fd_readv,
+    .writev = fd_writev,
+    .wait = fd_wait,
+    .set_baud = tty_set_baud,
+    .flush = tty_flush,
+    .wire_us = tty_wire_us,
+};
+
+/* 
+    A pty has no line speed. The rate is only kept for the timeouts, so 
+    custom rates work against the emulator without termios2. 
+*/
+static int pty_set_baud(struct serial_port_options *opts, uint32_t baud_key)
+{
+    return 0;
+}
+
+const struct serial_transport serial_pty_transport = {
+    .name = "pty",
+    .open = tty_open,
+    .close = fd_close,
+    .readv = fd_readv,
+    .writev = fd_writev,
+    .wait = fd_wait,
+    .set_baud = pty_set_baud,
+    .flush = tty_flush,
+    .wire_us = tty_wire_us,
+};
 
-    return opts->fd;
+static const struct serial_transport *serial_tp(struct serial_port_options *opts)
+{
+    return opts->transport ? opts->transport : &serial_termios_transport;
+}
+
+/* 
+    Pick the transport for opts->device and open it. Returns the fd, 0 
+    for transports without one, or -1 if the port didn't open. 
+*/
+int serial_init(struct serial_port_options *opts)
+{
+    const char *path = opts->device;
+
+    if(!strncmp(path, "tcp:", 4)) {
+        opts->transport = &serial_tcp_transport;
+        path += 4;
+    } else if(!strncmp(path, "loop:", 5)) {
+        opts->transport = &serial_loop_transport;
+        path += 5;
+    } else if(!strncmp(path, "pty:", 4)) {
+        opts->transport = &serial_pty_transport;
+        path += 4;
+    } else if(!strncmp(path, "/dev/pts/", 9)) {
+        opts->transport = &serial_pty_transport;
+    } else {
+        opts->transport = &serial_termios_transport;
+    }
+    LOG("%s: %s over %s", __func__, path, opts->transport->name);
+
+    opts->fd = -1;
+    opts->priv = NULL;
+    opts->rx.head = opts->rx.tail = 0;
+    if(opts->transport->open(opts, path) != 0) {
+        opts->fd = -1;
+        return -1;
+    }
+
+    return opts->fd < 0 ? 0 : opts->fd;
+}
+
+/* 
+    Change the baud rate of an open port 
+*/
+int serial_set_baud(struct serial_port_options *opts, uint32_t baud_key)
+{
+	LOG("%s: %s", __func__, serial_baud_key_to_str(baud_key));
+    if(serial_tp(opts)->set_baud(opts, baud_key) != 0) {
+        return 1;
+    }
+
+    opts->baud_rate = baud_key;
+    serial_flush(opts);
+
+    return 0;
+}
+
+/* 
+    Throw away anything sitting in the receive and transmit queues, 
+    including what we already pulled into the receive ring 
+*/
+void serial_flush(struct serial_port_options *opts)
+{
+    serial_tp(opts)->flush(opts);
+    opts->rx.head = opts->rx.tail = 0;
 }
 
 /* 
@@ -109,55 +279,203 @@ int serial_init(struct serial_port_options *opts)
 */
 void serial_deinit(struct serial_port_options *opts)
 {
-	if(opts->fd) {
-		close(opts->fd);
-	}
+    serial_tp(opts)->close(opts);
 
     opts->fd = 0;
+    opts->priv = NULL;
+}
+
+/* 
+    How long n bytes take on the link, for read deadlines 
+*/
+unsigned long serial_wire_us(struct serial_port_options *opts, size_t n)
+{
+    return serial_tp(opts)->wire_us(opts, n);
+}
+
+/* 
+    n bytes at 10 bits each at the rate of baud_key, 9600 if it is unknown 
+*/
+unsigned long serial_baud_wire_us(uint32_t baud_key, size_t n)
+{
+    uint32_t speed = serial_baud_key_to_speed(baud_key);
+
+    if(speed == 0) {
+        speed = 9600;
+    }
+
+    return (n * 10ULL * 1000000) / speed;
+}
+
+/* 
+    Milliseconds left until deadline, never less than 0 
+*/
+static int serial_ms_left(const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + 
+        (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+/* 
+    Copy up to n buffered bytes out of the receive ring. Returns how many 
+    were copied. 
+*/
+static size_t serial_rx_take(struct serial_port_options *opts, uint8_t *dst, 
+        size_t n)
+{
+    struct serial_rx_ring *rx = &opts->rx;
+    size_t avail = rx->head - rx->tail;
+    size_t off, first;
+
+    if (n > avail) {
+        n = avail;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    off = rx->tail & SERIAL_RX_RING_MASK;
+    first = SERIAL_RX_RING_SIZE - off;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(dst, &rx->buf[off], first);
+    memcpy(dst + first, rx->buf, n - first);
+    rx->tail += n;
+
+    return n;
+}
+
+/* 
+    Drain whatever the transport has into the free part of the receive ring with 
+    a single readv(). Returns what read() returns. 
+*/
+static ssize_t serial_rx_fill(struct serial_port_options *opts)
+{
+    struct serial_rx_ring *rx = &opts->rx;
+    size_t space = SERIAL_RX_RING_SIZE - (rx->head - rx->tail);
+    size_t off = rx->head & SERIAL_RX_RING_MASK;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t r;
+
+    iov[0].iov_base = &rx->buf[off];
+    iov[0].iov_len = SERIAL_RX_RING_SIZE - off;
+    if (iov[0].iov_len >= space) {
+        iov[0].iov_len = space;
+    } else {
+        iov[1].iov_base = rx->buf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    r = serial_tp(opts)->readv(opts, iov, iovcnt);
+    opts->stats.reads++;
+    if (r > 0) {
+        rx->head += r;
+        opts->stats.bytes_in += r;
+    }
+    LOG("%s: %d bytes", __func__, (int)r);
+
+    return r;
 }
 
 /* 
     Sometimes not all the data is available. This loops until we get the number 
-    of bytes we expect. The number of bytes is based on the STM32 bootloader 
-    protocol. 
+    of bytes we expect or the deadline, timeout_ms from now, passes. We wait 
+    in the transport's wait() so a reply is picked up as soon as it arrives. Bytes come out 
+    of the receive ring first, so an ACK that arrived with the previous 
+    reply costs no system call. The number of bytes is based on the STM32 
+    bootloader protocol. Returns the number of bytes read, which is short on 
+    a timeout, or -1 on error. 
 */
-static int serial_read_all(int sfd, void *buf, size_t nbyte)
+int serial_read_timeout(struct serial_port_options *opts, void *buf, 
+        size_t nbyte, int timeout_ms)
 {
+    const struct serial_transport *tp = serial_tp(opts);
+    struct timespec deadline;
    	ssize_t r;
 	uint8_t *pos = (uint8_t *)buf;
-    int b_read = nbyte;
+    size_t b_read;
+    int ms = timeout_ms;
 
-	LOG("%s: reading %d bytes", __func__, nbyte);
-	while (b_read) {
-		r = read(sfd, pos, b_read);
-        /* incomplete read */
-		if (r <= 0)
-			return b_read;
+    b_read = serial_rx_take(opts, pos, nbyte);
+    if (b_read == nbyte) {
+        opts->stats.ring_hits++;
+        return b_read;
+    }
+    pos += b_read;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+	LOG("%s: reading %d bytes, %d ms", __func__, nbyte, timeout_ms);
+	while (b_read < nbyte) {
+        r = tp->wait(opts, ms);
+        opts->stats.polls++;
+        if (r < 0) {
+            if (errno == EINTR) {
+                ms = serial_ms_left(&deadline);
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            LOG("%s: timeout, got %d of %d", __func__, b_read, nbyte);
+            break;
+        }
 
-		b_read -= r;
+		r = serial_rx_fill(opts);
+		if (r < 0 && errno != EAGAIN && errno != EINTR) {
+			return -1;
+        }
+		r = serial_rx_take(opts, pos, nbyte - b_read);
+		b_read += r;
 		pos += r;
+
+        ms = serial_ms_left(&deadline);
+        if (ms == 0 && b_read < nbyte) {
+            break;
+        }
 	}
     
-    /* we got here so b_read == nbyte, all good*/
-	return nbyte; 
+	return b_read; 
 }
 
 /* 
-    Reads data from the serial port. If nbyte is 0 this is a regular read. If 
-    we are talking to the STM32 bootloader we expect a certain number of bytes on
-    each read. In that case call local serial_read_all() 
+    Reads data from the serial port. If nbyte is 0 this is a regular read of 
+    whatever turns up. If we are talking to the STM32 bootloader we expect a 
+    certain number of bytes on each read. Either way we give up after 
+    SERIAL_READ_TIMEOUT_MS, callers that know better use serial_read_timeout() 
 */
 int serial_read(struct serial_port_options *opts, void *buf, size_t nbyte)
 {
-    int b_read;
-
     if(nbyte > 0) {
-        b_read = serial_read_all(opts->fd, buf, nbyte);
-    } else {
-        b_read = read(opts->fd, buf, SERIAL_BUF_MAX);
+        return serial_read_timeout(opts, buf, nbyte, SERIAL_READ_TIMEOUT_MS);
+    }
+
+    if(opts->rx.head == opts->rx.tail) {
+        opts->stats.polls++;
+        if(serial_tp(opts)->wait(opts, SERIAL_READ_TIMEOUT_MS) <= 0) {
+            return 0;
+        }
+        if(serial_rx_fill(opts) < 0) {
+            return -1;
+        }
     }
 
-    return b_read;
+    return serial_rx_take(opts, buf, SERIAL_BUF_MAX);
 }
 
 /* 
@@ -165,14 +483,38 @@ int serial_read(struct serial_port_options *opts, void *buf, size_t nbyte)
 */
 int serial_write(struct serial_port_options *opts, void *buf, size_t nbyte)
 {
+	struct iovec iov = { .iov_base = buf, .iov_len = nbyte };
 	ssize_t r;
 	
 	LOG("%s: writing %d bytes", __func__, nbyte);
-	r = write(opts->fd, buf, nbyte);
+	r = serial_tp(opts)->writev(opts, &iov, 1);
+	opts->stats.writes++;
+	if (r > 0) {
+		opts->stats.bytes_out += r;
+	}
 	
 	return r;
 }
 
+/* 
+    Write a frame gathered from several buffers with one system call, so 
+    the pieces don't have to be copied together first 
+*/
+int serial_writev(struct serial_port_options *opts, const struct iovec *iov, 
+        int iovcnt)
+{
+	ssize_t r;
+
+	r = serial_tp(opts)->writev(opts, iov, iovcnt);
+	opts->stats.writes++;
+	if (r > 0) {
+		opts->stats.bytes_out += r;
+	}
+	LOG("%s: wrote %d bytes", __func__, (int)r);
+
+	return r;
+}
+
 /* 
     Helper function to convert baud rate to readable string 
 */
@@ -189,7 +531,11 @@ const char *serial_baud_key_to_str(uint32_t baud_key)
         }
     }
 
-    if (x >= NELEM(BaudTable))
+    if (baud_key & SERIAL_BAUD_CUSTOM)
+    {
+        sprintf(buffer, "%ubps", baud_key & ~SERIAL_BAUD_CUSTOM);
+    }
+    else if (x >= NELEM(BaudTable))
     {
         sprintf(buffer, "{Unknown<%06oo>}", baud_key);
     }
@@ -232,7 +578,18 @@ uint32_t serial_baud_str_to_key(const char *baud_str)
 
     if (x >= NELEM(BaudTable))
     {
-        LOG("Warning: Unknown baud rate '%s'. Defaulting to %s", baud_str, serial_baud_key_to_str(baud_key));
+        /* Not in the table, if it is a plain number use BOTHER */
+        unsigned long speed = strtoul(baud_buf, &bp, 10);
+
+        if (*baud_buf != '\0' && *bp == '\0' && speed > 0 && 
+            speed < SERIAL_BAUD_CUSTOM)
+        {
+            baud_key = SERIAL_BAUD_CUSTOM | speed;
+        }
+        else
+        {
+            LOG("Warning: Unknown baud rate '%s'. Defaulting to %s", baud_str, serial_baud_key_to_str(baud_key));
+        }
     }
 
     if (baud_buf != NULL)
@@ -243,3 +600,41 @@ uint32_t serial_baud_str_to_key(const char *baud_str)
 
     return baud_key;
 }
+
+/* 
+    Helper function to convert a baud key to bits per second, 0 if the key 
+    is unknown 
+*/
+uint32_t serial_baud_key_to_speed(uint32_t baud_key)
+{
+    int x;
+
+    if (baud_key & SERIAL_BAUD_CUSTOM)
+    {
+        return baud_key & ~SERIAL_BAUD_CUSTOM;
+    }
+
+    for (x = 0; x < NELEM(BaudTable); x++)
+    {
+        if (BaudTable[x].key == baud_key)
+        {
+            return BaudTable[x].speed;
+        }
+    }
+
+    return 0;
+}
+
+/* 
+    Copy out the system call counters 
+*/
+void serial_get_stats(struct serial_port_options *opts, 
+        struct serial_stats *st)
+{
+    *st = opts->stats;
+}
+
+void serial_reset_stats(struct serial_port_options *opts)
+{
+    memset(&opts->stats, 0, sizeof(opts->stats));
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+
+#include "serial.h"
+
+/* 
+    termios2 lives in the kernel headers, which clash with <termios.h>, so 
+    this is kept in its own file. We can't pull in <sys/ioctl.h> either. 
+*/
+int ioctl(int fd, unsigned long request, ...);
+
+/* 
+    Set a baud rate that has no Bxxx constant. BOTHER tells the driver to 
+    use the speed in c_ispeed/c_ospeed as is. 
+*/
+int serial_set_custom_speed(int fd, uint32_t speed)
+{
+	struct termios2 tio;
+
+	if(ioctl(fd, TCGETS2, &tio) != 0) {
+		return -1;
+	}
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = speed;
+	tio.c_ospeed = speed;
+
+	return ioctl(fd, TCSETS2, &tio);
+}
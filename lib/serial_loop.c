@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "serial.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/* 
+    In-memory loopback, no system calls and no wire time, so what is 
+    left when the protocol code runs over it is its own CPU cost. Bytes 
+    for the host wait in a queue of their own, filled by the peer from 
+    inside writev. Nothing arrives on its own, so a wait on an empty 
+    queue times out at once. 
+*/
+#define LOOP_QUEUE_SIZE 8192
+#define LOOP_QUEUE_MASK (LOOP_QUEUE_SIZE - 1)
+
+struct serial_loop {
+    uint8_t buf[LOOP_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    serial_loop_peer_t peer;
+    void *arg;
+};
+
+static int loop_open(struct serial_port_options *opts, const char *path)
+{
+    opts->priv = calloc(1, sizeof(struct serial_loop));
+    if(!opts->priv) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void loop_close(struct serial_port_options *opts)
+{
+    free(opts->priv);
+    opts->priv = NULL;
+}
+
+void serial_loop_set_peer(struct serial_port_options *opts, 
+        serial_loop_peer_t peer, void *arg)
+{
+    struct serial_loop *lp = opts->priv;
+
+    lp->peer = peer;
+    lp->arg = arg;
+}
+
+/* 
+    Queue bytes for the host to read, returns 1 if they don't fit 
+*/
+int serial_loop_put(struct serial_port_options *opts, const void *buf, 
+        size_t n)
+{
+    struct serial_loop *lp = opts->priv;
+    const uint8_t *p = buf;
+
+    if(n > LOOP_QUEUE_SIZE - (lp->head - lp->tail)) {
+        LOG("%s: queue full", __func__);
+        return 1;
+    }
+    while(n--) {
+        lp->buf[lp->head++ & LOOP_QUEUE_MASK] = *p++;
+    }
+
+    return 0;
+}
+
+static ssize_t loop_readv(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    struct serial_loop *lp = opts->priv;
+    ssize_t total = 0;
+    size_t n;
+    int i;
+
+    if(lp->head == lp->tail) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt && lp->head != lp->tail; i++) {
+        uint8_t *dst = iov[i].iov_base;
+
+        for(n = 0; n < iov[i].iov_len && lp->head != lp->tail; n++) {
+            dst[n] = lp->buf[lp->tail++ & LOOP_QUEUE_MASK];
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+static ssize_t loop_writev(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    struct serial_loop *lp = opts->priv;
+    ssize_t total = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; i++) {
+        if(lp->peer) {
+            lp->peer(opts, iov[i].iov_base, iov[i].iov_len, lp->arg);
+        } else if(serial_loop_put(opts, iov[i].iov_base, 
+                    iov[i].iov_len) != 0) {
+            errno = ENOBUFS;
+            return total ? total : -1;
+        }
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+static int loop_wait(struct serial_port_options *opts, int timeout_ms)
+{
+    struct serial_loop *lp = opts->priv;
+
+    return lp->head != lp->tail;
+}
+
+static int loop_set_baud(struct serial_port_options *opts, uint32_t baud_key)
+{
+    return 0;
+}
+
+static void loop_flush(struct serial_port_options *opts)
+{
+    struct serial_loop *lp = opts->priv;
+
+    lp->tail = lp->head;
+}
+
+static unsigned long loop_wire_us(struct serial_port_options *opts, size_t n)
+{
+    return 0;
+}
+
+const struct serial_transport serial_loop_transport = {
+    .name = "loop",
+    .open = loop_open,
+    .close = loop_close,
+    .readv = loop_readv,
+    .writev = loop_writev,
+    .wait = loop_wait,
+    .set_baud = loop_set_baud,
+    .flush = loop_flush,
+    .wire_us = loop_wire_us,
+};
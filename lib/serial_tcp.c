@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "serial.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/* 
+    Raw byte stream over TCP, host:port, to a ser2net style bridge or a 
+    local stand-in like the emulator's -T. The bridge owns the UART, so 
+    a baud change is only kept for the timeouts. 
+*/
+static int tcp_open(struct serial_port_options *opts, const char *path)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[128];
+    const char *colon = strrchr(path, ':');
+    size_t len;
+    int one = 1;
+
+    if(!colon || (len = colon - path) >= sizeof(host)) {
+        LOG("%s: want host:port, got %s", __func__, path);
+        return -1;
+    }
+    memcpy(host, path, len);
+    host[len] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        LOG("%s: can't resolve %s", __func__, path);
+        return -1;
+    }
+
+    for(ai = res; ai; ai = ai->ai_next) {
+        opts->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(opts->fd < 0) {
+            continue;
+        }
+        if(connect(opts->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(opts->fd);
+        opts->fd = -1;
+    }
+    freeaddrinfo(res);
+    if(opts->fd < 0) {
+        LOG("%s: can't connect to %s", __func__, path);
+        return -1;
+    }
+
+    /* Commands are a few bytes and wait for an ACK, don't let Nagle sit on them */
+    setsockopt(opts->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return 0;
+}
+
+static void tcp_close(struct serial_port_options *opts)
+{
+    if(opts->fd > 0) {
+        close(opts->fd);
+    }
+}
+
+static ssize_t tcp_readv(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+    ssize_t r = recvmsg(opts->fd, &msg, MSG_DONTWAIT);
+
+    /* The far end went away, report it as an error instead of no data */
+    if(r == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    return r;
+}
+
+static ssize_t tcp_writev(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+    return writev(opts->fd, iov, iovcnt);
+}
+
+static int tcp_wait(struct serial_port_options *opts, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = opts->fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static int tcp_set_baud(struct serial_port_options *opts, uint32_t baud_key)
+{
+    return 0;
+}
+
+/* 
+    Nothing to flush on the way out, drop whatever already came in 
+*/
+static void tcp_flush(struct serial_port_options *opts)
+{
+    uint8_t buf[SERIAL_BUF_MAX];
+
+    while(recv(opts->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+/* 
+    The far side of the bridge is still a UART at the set rate 
+*/
+static unsigned long tcp_wire_us(struct serial_port_options *opts, size_t n)
+{
+    return serial_baud_wire_us(opts->baud_rate, n);
+}
+
+const struct serial_transport serial_tcp_transport = {
+    .name = "tcp",
+    .open = tcp_open,
+    .close = tcp_close,
+    .readv = tcp_readv,
+    .writev = tcp_writev,
+    .wait = tcp_wait,
+    .set_baud = tcp_set_baud,
+    .flush = tcp_flush,
+    .wire_us = tcp_wire_us,
+};
@@ -5,8 +5,11 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <errno.h>
+#include <termios.h>
+#include <time.h>
 
 #include "stm32.h"
+#include "trace.h"
 
 /* Uncomment for full debugging */
 //#define DEBUG
@@ -17,38 +20,205 @@
 #endif
 
 /* 
-    STM32 sends an ACK on each successful command 
+    Rates we step through when negotiating, fastest first 
 */
-stm32_err_t stm_get_ack(struct serial_port_options *opts)
+static const uint32_t baud_ladder[] = {
+	B1000000, B921600, B460800, B230400, B115200, B57600, B38400, B19200, 
+	B9600,
+};
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+/* 
+    STM32F3 family members, from AN2606 and the reference manuals 
+*/
+static const struct stm32_dev_info dev_table[] = {
+	{ 0x422, "STM32F302xB/C, F303xB/C, F358", 
+		0x00040000, 0x800, 0x8000, 0x20001400, STM_QUIRK_CCM_RAM },
+	{ 0x432, "STM32F373xx, F378xx", 
+		0x00040000, 0x800, 0x4000, 0x20001400, 0 },
+	{ 0x438, "STM32F303x4/6/8, F334, F328", 
+		0x00010000, 0x800, 0x3000, 0x20001800, STM_QUIRK_CCM_RAM },
+	{ 0x439, "STM32F301x6/8, F302x6/8, F318", 
+		0x00010000, 0x800, 0x4000, 0x20001800, 0 },
+	{ 0x446, "STM32F302xD/E, F303xD/E, F398", 
+		0x00080000, 0x800, 0x10000, 0x20001800, STM_QUIRK_CCM_RAM },
+};
+
+static struct stm_link_stats link_stats;
+static struct stm_entry_stats entry_stats;
+
+/* 
+    Send-ahead mode, see stm_set_send_ahead(). fell_back is set when a 
+    send-ahead command failed and we are back in lock-step with the 
+    bootloader in sync. 
+*/
+static int send_ahead;
+static int fell_back;
+
+static unsigned long stm_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* 
+    Latency metrics, see stm_set_metrics(). Commands and phases are also 
+    traced as spans when the tracer is on. With both off stm_mark() 
+    returns without reading the clock and nothing is recorded. 
+*/
+static int metrics_on;
+static struct stm_metrics metrics;
+
+static const char *metric_cmd_names[STM_M_CMDS] = {
+	"INIT", "GET", "GET_ID", "READ", "WRITE", "ERASE", "GO",
+};
+
+static const char *metric_phase_names[STM_P_PHASES] = {
+	"TX", "ACK", "RX",
+};
+
+static unsigned long stm_mark(void)
+{
+	return metrics_on || trace_on() ? stm_now_us() : 0;
+}
+
+static void stm_metric_phase(stm_metric_phase_t phase, unsigned long start)
+{
+	if(metrics_on) {
+		hist_add(&metrics.phase[phase], stm_now_us() - start);
+	}
+	trace_end("link", metric_phase_names[phase], start, 0);
+}
+
+/* 
+    Record a command that started at start, passes its result through 
+*/
+static int stm_metric_cmd(stm_metric_cmd_t cmd, unsigned long start, int r)
+{
+	if(metrics_on) {
+		hist_add(&metrics.cmd[cmd], stm_now_us() - start);
+		if(r != 0) {
+			metrics.failed[cmd]++;
+		}
+	}
+	trace_end("stm", metric_cmd_names[cmd], start, r);
+
+	return r;
+}
+
+/* 
+    Every frame the commands send goes through these so the time spent 
+    handing bytes to the port shows up as the TX phase 
+*/
+static ssize_t stm_tx(struct serial_port_options *opts, void *buf, 
+        size_t n)
 {
-	uint8_t byte;
+	unsigned long start = stm_mark();
+	ssize_t r;
+
+	r = serial_write(opts, buf, n);
+	stm_metric_phase(STM_P_TX, start);
+
+	return r;
+}
+
+static ssize_t stm_txv(struct serial_port_options *opts, 
+        const struct iovec *iov, int iovcnt)
+{
+	unsigned long start = stm_mark();
+	ssize_t r;
+
+	r = serial_writev(opts, iov, iovcnt);
+	stm_metric_phase(STM_P_TX, start);
+
+	return r;
+}
+
+/* 
+    STM32 sends an ACK on each successful command. Waits up to timeout_ms 
+    for it, a missing byte is a timeout and anything else is garbage. 
+*/
+stm32_err_t stm_wait_ack(struct serial_port_options *opts, int timeout_ms)
+{
+	unsigned long start = stm_mark();
+	uint8_t byte = 0;
+	ssize_t r;
 	
-	serial_read(opts, &byte, 1);
+	r = serial_read_timeout(opts, &byte, 1, timeout_ms);
+	stm_metric_phase(STM_P_ACK, start);
+	if(r != 1) {
+		LOG("%s: no reply in %d ms", __func__, timeout_ms);
+		link_stats.timeouts++;
+		metrics.timeouts++;
+		return STM32_ERR_TIMEOUT;
+	}
 	
 	LOG("read 0x%02X", byte);
 
 	if(byte == STM_ACK) {
+		link_stats.acks++;
 		return STM32_ERR_OK;
 	}
 	
 	if(byte == STM_NACK) {
+		link_stats.nacks++;
+		metrics.nacks++;
 		return STM32_ERR_NACK;
 	}
 
+	link_stats.garbage++;
 	return STM32_ERR_UNKNOWN;
 }
 
+stm32_err_t stm_get_ack(struct serial_port_options *opts)
+{
+	return stm_wait_ack(opts, STM_ACK_TIMEOUT_MS);
+}
+
+/* 
+    Deadline for n bytes of reply: the ACK timeout plus twice the time the 
+    bytes take on the link 
+*/
+static int stm_read_timeout(struct serial_port_options *opts, unsigned int n)
+{
+	return STM_ACK_TIMEOUT_MS + (int)(serial_wire_us(opts, n) * 2 / 1000);
+}
+
+/* 
+    Read exactly n bytes of a reply, anything short is an error 
+*/
+static int stm_read_bytes(struct serial_port_options *opts, void *buf, 
+        unsigned int n)
+{
+	unsigned long start = stm_mark();
+	ssize_t r;
+
+	r = serial_read_timeout(opts, buf, n, stm_read_timeout(opts, n));
+	stm_metric_phase(STM_P_RX, start);
+	if(r != (ssize_t)n) {
+		LOG("%s: got %d of %d bytes", __func__, (int)r, n);
+		link_stats.timeouts++;
+		metrics.timeouts++;
+		return 1;
+	}
+
+	return 0;
+}
+
 /* 
     Send the STM32 an init byte. This sets up the STM32 to accept 
     commands 
 */
-int stm_init_seq(struct serial_port_options *opts)
+static int stm_init_seq_cmd(struct serial_port_options *opts)
 {
 	uint8_t cmd = STM_INIT;
 	ssize_t r;
 	
 	LOG("%s: writing 0x%X to stm",__func__, cmd);
-	r = serial_write(opts, &cmd, 1);
+	r = stm_tx(opts, &cmd, 1);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -62,20 +232,88 @@ int stm_init_seq(struct serial_port_options *opts)
 	return 0;
 }
 
+int stm_init_seq(struct serial_port_options *opts)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_INIT, start, stm_init_seq_cmd(opts));
+}
+
+/* 
+    Get in sync with a bootloader that may still be starting up. Instead of 
+    sleeping long enough for the slowest part we send the init byte every 
+    STM_SYNC_PROBE_MS until something answers. ACK is the bootloader 
+    locking on to our rate. NACK means it was already in sync and took the 
+    byte as a command, which is just as good. 
+*/
+static int stm_sync_cmd(struct serial_port_options *opts, 
+        unsigned int timeout_ms)
+{
+	unsigned long start = stm_now_us();
+	unsigned long deadline = start + timeout_ms * 1000UL;
+	unsigned int garbage = 0;
+	uint8_t cmd = STM_INIT;
+	stm32_err_t r;
+
+	entry_stats.probes = 0;
+	entry_stats.was_synced = 0;
+
+	while(stm_now_us() < deadline) {
+		serial_flush(opts);
+		entry_stats.probes++;
+		if(stm_tx(opts, &cmd, 1) != 1) {
+			LOG("%s: write failed!", __func__);
+			return 1;
+		}
+
+		r = stm_wait_ack(opts, STM_SYNC_PROBE_MS);
+		if(r == STM32_ERR_OK || r == STM32_ERR_NACK) {
+			entry_stats.was_synced = (r == STM32_ERR_NACK);
+			entry_stats.sync_us = stm_now_us() - start;
+			LOG("%s: %s after %d probes", __func__, 
+                r == STM32_ERR_OK ? "ACK" : "NACK", entry_stats.probes);
+			return 0;
+		}
+		if(r == STM32_ERR_UNKNOWN && ++garbage >= STM_SYNC_GARBAGE_MAX) {
+			LOG("%s: garbage, wrong rate?", __func__);
+			break;
+		}
+	}
+
+	entry_stats.sync_us = stm_now_us() - start;
+
+	return 1;
+}
+
+int stm_sync(struct serial_port_options *opts, unsigned int timeout_ms)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_INIT, start, 
+            stm_sync_cmd(opts, timeout_ms));
+}
+
+void stm_get_entry_stats(struct stm_entry_stats *st)
+{
+	*st = entry_stats;
+}
+
 /* 
-    Ask the STM32 what commands it supports 
+    Ask the STM32 what commands it supports. The reply is a byte count, the 
+    bootloader version and then the command codes. 
 */
-int stm_get_cmds(struct serial_port_options *opts)
+static int stm_get_cmds_cmd(struct serial_port_options *opts, 
+        struct stm32_dev *dev)
 {
-	uint8_t cmd[2], buf[32];
+	uint8_t cmd[2], buf[STM_MAX_CMDS + 1];
 	ssize_t r;
-	int i;
+	unsigned int i, n;
 	
 	cmd[0] = STM_CMD_GET;
 	cmd[1] = STM_CMD_GET ^ 0xFF;
 	
 	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -86,26 +324,45 @@ int stm_get_cmds(struct serial_port_options *opts)
 	}
 	
 	LOG("%s: getting byte count",__func__);
-	serial_read(opts, buf, 1);
+	if(stm_read_bytes(opts, buf, 1) != 0) {
+		return 1;
+	}
+	n = buf[0] + 1;
+	if(n > sizeof(buf)) {
+		LOG("%s: too many commands %d",__func__, n);
+		return 1;
+	}
 	LOG("%s: getting comamnds %d",__func__, buf[0]);
-	serial_read(opts, buf, buf[0] + 1);
+	if(stm_read_bytes(opts, buf, n) != 0) {
+		return 1;
+	}
 	
 	if( stm_get_ack(opts) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
 		return 1;
 	}
 	
-	for(i = 0; i < 12; i++) {
-		LOG("%s: cmd 0x%02X",__func__, buf[i]);
+	dev->bl_version = buf[0];
+	dev->ncmds = n - 1;
+	for(i = 0; i < dev->ncmds; i++) {
+		dev->cmds[i] = buf[i + 1];
+		LOG("%s: cmd 0x%02X",__func__, dev->cmds[i]);
 	}
 	
 	return 0;
 }
 
+int stm_get_cmds(struct serial_port_options *opts, struct stm32_dev *dev)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_GET, start, stm_get_cmds_cmd(opts, dev));
+}
+
 /* 
     This is a full erase of the STM32 
 */
-int stm_erase_mem(struct serial_port_options *opts)
+static int stm_erase_mem_cmd(struct serial_port_options *opts)
 {
 	uint8_t cmd[2];
 	uint8_t buf[3];
@@ -119,7 +376,7 @@ int stm_erase_mem(struct serial_port_options *opts)
 	buf[2] = 0x00;
 	
 	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -131,12 +388,12 @@ int stm_erase_mem(struct serial_port_options *opts)
 	
 	LOG("%s: writing 0x%02X%02X to stm",__func__, buf[0], buf[1]);
 	//r = write(fd_tty, &buf, 3);
-	r = serial_write(opts, &buf, 3);
+	r = stm_tx(opts, &buf, 3);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
-	if( stm_get_ack(opts) != STM32_ERR_OK) {
+	if( stm_wait_ack(opts, STM_MASS_ERASE_TIMEOUT_MS) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
 		return 1;
 	}
@@ -144,27 +401,44 @@ int stm_erase_mem(struct serial_port_options *opts)
 	return 0;
 }
 
+int stm_erase_mem(struct serial_port_options *opts)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_ERASE, start, stm_erase_mem_cmd(opts));
+}
+
 /* 
-    Read a chunk of memory from the STM32 
+    Erase a list of pages with the extended erase command. The frame is the 
+    page count minus one followed by each page number, all 16 bit MSB first, 
+    and an XOR checksum over every byte. 
 */
-int stm_read_mem(struct serial_port_options *opts, uint32_t address, 
-        uint8_t *data, unsigned int len )
+static int stm_erase_page_list_cmd(struct serial_port_options *opts, 
+        uint16_t first, unsigned int count)
 {
 	uint8_t cmd[2];
-	uint8_t buf[5];
+	uint8_t buf[2 + 2 * STM_ERASE_PAGES_MAX + 1];
+	unsigned int i, n = 0;
+	int timeout;
+	uint8_t cs = 0;
 	ssize_t r;
-	
-	cmd[0] = STM_CMD_READ_MEM;
-	cmd[1] = STM_CMD_READ_MEM ^ 0xFF;
-	
-	buf[0] = address >> 24;
-	buf[1] = (address >> 16) & 0xFF;
-	buf[2] = (address >> 8) & 0xFF;
-	buf[3] = address & 0xFF;
-	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	
+
+	cmd[0] = STM_CMD_ERASE_MEM_EXT;
+	cmd[1] = STM_CMD_ERASE_MEM_EXT ^ 0xFF;
+
+	buf[n++] = (count - 1) >> 8;
+	buf[n++] = (count - 1) & 0xFF;
+	for(i = 0; i < count; i++) {
+		buf[n++] = (first + i) >> 8;
+		buf[n++] = (first + i) & 0xFF;
+	}
+	for(i = 0; i < n; i++) {
+		cs ^= buf[i];
+	}
+	buf[n++] = cs;
+
 	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -173,109 +447,380 @@ int stm_read_mem(struct serial_port_options *opts, uint32_t address,
 		LOG("%s: No ACK!", __func__);
 		return 1;
 	}
-	
-	LOG("%s: writing address 0x%08X to stm",__func__, address);
-	r = serial_write(opts, &buf, 5);
+
+	LOG("%s: erasing pages %d-%d",__func__, first, first + count - 1);
+	r = stm_tx(opts, &buf, n);
+	if(r < 1) {
+		LOG("%s: write failed!", __func__);
+		return 1;
+	}
+	timeout = STM_ACK_TIMEOUT_MS + count * STM_PAGE_ERASE_TIMEOUT_MS;
+	if( stm_wait_ack(opts, timeout) != STM32_ERR_OK) {
+		LOG("%s: No ACK!", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int stm_erase_page_list(struct serial_port_options *opts, 
+        uint16_t first, unsigned int count)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_ERASE, start, 
+            stm_erase_page_list_cmd(opts, first, count));
+}
+
+/* 
+    Erase count pages starting at page first. Page 0 is at STM_FLASH_BASE. 
+    The pages go out in batches of STM_ERASE_PAGES_MAX, the most one frame 
+    can hold. 
+*/
+int stm_erase_pages(struct serial_port_options *opts, uint16_t first, 
+        unsigned int count)
+{
+	unsigned int n;
+
+	while(count > 0) {
+		n = count < STM_ERASE_PAGES_MAX ? count : STM_ERASE_PAGES_MAX;
+		if(stm_erase_page_list(opts, first, n) != 0) {
+			return 1;
+		}
+		first += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* 
+    Throw away everything the bootloader sends until it has been quiet 
+    for an ACK timeout 
+*/
+static void stm_drain(struct serial_port_options *opts)
+{
+	uint8_t buf[64];
+
+	while(serial_read_timeout(opts, buf, sizeof(buf), STM_ACK_TIMEOUT_MS) > 0) {
+		LOG("%s: dropped reply bytes", __func__);
+	}
+	serial_flush(opts);
+}
+
+/* 
+    Get back in step with the bootloader after frames it rejected part way. 
+    It reads commands in pairs and may be left holding half of one, so if 
+    GET_ID doesn't answer we send one byte that can't complete a command 
+    and try again. 
+*/
+static int stm_resync(struct serial_port_options *opts)
+{
+	uint8_t filler = STM_INIT;
+
+	stm_drain(opts);
+	if(stm_get_id(opts, NULL) == 0) {
+		return 0;
+	}
+
+	stm_drain(opts);
+	if(stm_tx(opts, &filler, 1) < 1) {
+		return 1;
+	}
+	stm_drain(opts);
+
+	return stm_get_id(opts, NULL);
+}
+
+/* 
+    A command failed in send-ahead mode, drop back to lock-step for the 
+    rest of the session. If the bootloader comes back in sync 
+    stm_send_ahead_fell_back() says so and the command can be tried again 
+    straight away. 
+*/
+static void stm_send_ahead_drop(struct serial_port_options *opts)
+{
+	if(!send_ahead) {
+		return;
+	}
+
+	send_ahead = 0;
+	link_stats.fallbacks++;
+	if(stm_resync(opts) == 0) {
+		fell_back = 1;
+	}
+}
+
+/* 
+    Send-ahead. The frames go out in one writev() and the ACKs, one per 
+    frame, are checked in order after. Anything but a clean run of ACKs 
+    and we drop back to lock-step. 
+*/
+static int stm_send_ahead_frames(struct serial_port_options *opts, 
+        struct iovec *iov, int iovcnt, const int *ack_ms, int nacks)
+{
+	stm32_err_t err = STM32_ERR_OK;
+	int i;
+
+	LOG("%s: %d frames, %d ACKs", __func__, iovcnt, nacks);
+	if(stm_txv(opts, iov, iovcnt) < 1) {
+		LOG("%s: write failed!", __func__);
+		return 1;
+	}
+
+	for(i = 0; i < nacks && err == STM32_ERR_OK; i++) {
+		err = stm_wait_ack(opts, ack_ms[i]);
+	}
+	if(err == STM32_ERR_OK) {
+		return 0;
+	}
+
+	LOG("%s: ACK %d of %d failed, back to lock-step", __func__, i, nacks);
+	stm_send_ahead_drop(opts);
+
+	return 1;
+}
+
+/* 
+    Send a command and its address frame, and wait for both ACKs. In 
+    send-ahead mode the two go out in one writev(). Nothing past the 
+    address goes ahead. A bootloader that rejected a frame goes back to 
+    reading commands, and would take a length or data frame sent behind 
+    it as command pairs, where 0x92 0x6D is Readout Unprotect and mass 
+    erases the part. For the same reason we stay in lock-step when a 
+    dropped byte would line up two bytes of the frames into a command 
+    and its complement. 
+*/
+static int stm_send_cmd_addr(struct serial_port_options *opts, 
+        uint8_t cmd[2], uint8_t addr[5])
+{
+	static const int ack_ms[2] = { STM_ACK_TIMEOUT_MS, STM_ACK_TIMEOUT_MS };
+	uint8_t all[7];
+	ssize_t r;
+	int i, safe = 1;
+
+	memcpy(all, cmd, 2);
+	memcpy(all + 2, addr, 5);
+	for(i = 1; i < 6; i++) {
+		if((all[i] ^ all[i + 1]) == 0xFF) {
+			safe = 0;
+		}
+	}
+
+	if(send_ahead && safe) {
+		struct iovec iov[1] = { { all, 7 } };
+
+		return stm_send_ahead_frames(opts, iov, 1, ack_ms, 2);
+	}
+
+	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
+	r = stm_tx(opts, cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
 	if( stm_get_ack(opts) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
+		stm_send_ahead_drop(opts);
 		return 1;
 	}
-	
-	cmd[0] = len - 1;
-	cmd[1] = (len - 1) ^ 0xFF;
-	LOG("%s: writing len %d to stm",__func__, len);
-	r = serial_write(opts, &cmd, 2);
+
+	LOG("%s: writing address 0x%02X%02X%02X%02X to stm",__func__, 
+        addr[0], addr[1], addr[2], addr[3]);
+	r = stm_tx(opts, addr, 5);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
 	if( stm_get_ack(opts) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
+		stm_send_ahead_drop(opts);
 		return 1;
 	}
-	
-	serial_read(opts, data, len);
 
 	return 0;
 }
 
 /* 
-    Write a chunk of memory to the STM32 
+    Read a chunk of memory from the STM32 
 */
-int stm_write_mem(struct serial_port_options *opts, uint32_t address, 
-        uint8_t data[], unsigned int len)
+static int stm_read_mem_cmd(struct serial_port_options *opts, 
+        uint32_t address, uint8_t *data, unsigned int len)
 {
-	uint8_t cs;
 	uint8_t cmd[2];
-	uint8_t buf[256 + 2];
+	uint8_t buf[5];
 	ssize_t r;
-	unsigned int i, aligned_len;
-
-	cmd[0] = STM_CMD_WRITE_MEM;
-	cmd[1] = STM_CMD_WRITE_MEM ^ 0xFF;
-
+	
+	cmd[0] = STM_CMD_READ_MEM;
+	cmd[1] = STM_CMD_READ_MEM ^ 0xFF;
+	
 	buf[0] = address >> 24;
 	buf[1] = (address >> 16) & 0xFF;
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
 
-	LOG("%s: writing cmd 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
-	if(r < 1) {
-		LOG("%s: write failed!", __func__);
-		return 1;
-	}
-	if( stm_get_ack(opts) != STM32_ERR_OK) {
-		LOG("%s: No ACK!", __func__);
+	/* The length is a valid command pair for some lengths, it waits */
+	if(stm_send_cmd_addr(opts, cmd, buf) != 0) {
 		return 1;
 	}
-
-	LOG("%s: writing address 0x%08X to stm",__func__, address);
-	r = serial_write(opts, &buf, 5);
+	
+	cmd[0] = len - 1;
+	cmd[1] = (len - 1) ^ 0xFF;
+	LOG("%s: writing len %d to stm",__func__, len);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
 	if( stm_get_ack(opts) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
+		stm_send_ahead_drop(opts);
 		return 1;
 	}
 	
-	aligned_len = (len + 3) & ~3;
-	LOG("%s: aligned len %d", __func__, aligned_len);
-	
-	buf[0] = len -1;
-	cs = buf[0];
-	for(i = 0; i < len; i++) {
-		cs ^= data[i];
-		buf[i + 1] = data[i];
+	if(stm_read_bytes(opts, data, len) != 0) {
+		stm_send_ahead_drop(opts);
+		return 1;
+	}
+
+	return 0;
+}
+
+int stm_read_mem(struct serial_port_options *opts, uint32_t address, 
+        uint8_t *data, unsigned int len)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_READ, start, 
+            stm_read_mem_cmd(opts, address, data, len));
+}
+
+/* 
+    XOR of every byte of data into cs. The bulk goes a native word at a 
+    time, four words per pass, and the word is folded down to a byte at 
+    the end. 
+*/
+static uint8_t stm_xor_sum(uint8_t cs, const uint8_t *data, unsigned int len)
+{
+	unsigned long acc = 0, w[4];
+	unsigned int i;
+
+	while(len >= sizeof(w)) {
+		memcpy(w, data, sizeof(w));
+		acc ^= w[0] ^ w[1] ^ w[2] ^ w[3];
+		data += sizeof(w);
+		len -= sizeof(w);
+	}
+	while(len >= sizeof(w[0])) {
+		memcpy(w, data, sizeof(w[0]));
+		acc ^= w[0];
+		data += sizeof(w[0]);
+		len -= sizeof(w[0]);
+	}
+
+	for(i = sizeof(acc) * 8 / 2; i >= 8; i /= 2) {
+		acc ^= acc >> i;
+	}
+	cs ^= acc & 0xFF;
+
+	while(len--) {
+		cs ^= *data++;
+	}
+
+	return cs;
+}
+
+/* 
+    Build a write of len bytes. Only the address frame, the length byte 
+    and the checksum are filled in, the data is sent from where it is. 
+*/
+void stm_write_frame_encode(struct stm_write_frame *f, uint32_t address, 
+        const uint8_t *data, unsigned int len)
+{
+	f->addr = address;
+	f->len = len;
+	f->data = data;
+
+	f->addr_frame[0] = address >> 24;
+	f->addr_frame[1] = (address >> 16) & 0xFF;
+	f->addr_frame[2] = (address >> 8) & 0xFF;
+	f->addr_frame[3] = address & 0xFF;
+	f->addr_frame[4] = f->addr_frame[0] ^ f->addr_frame[1] ^ 
+		f->addr_frame[2] ^ f->addr_frame[3];
+
+	f->len_byte = len - 1;
+	f->cs = stm_xor_sum(f->len_byte, data, len);
+}
+
+/* 
+    Send a write built by stm_write_frame_encode(). The data frame goes out 
+    with one writev() straight from the caller's buffer. 
+*/
+static int stm_write_frame_send_cmd(struct serial_port_options *opts, 
+        struct stm_write_frame *f)
+{
+	uint8_t cmd[2];
+	struct iovec iov[3];
+	ssize_t r;
+
+	cmd[0] = STM_CMD_WRITE_MEM;
+	cmd[1] = STM_CMD_WRITE_MEM ^ 0xFF;
+
+	/* The data only goes out once the address is ACKed */
+	if(stm_send_cmd_addr(opts, cmd, f->addr_frame) != 0) {
+		return 1;
 	}
 	
-	buf[len + 1] = cs;
+	iov[0].iov_base = &f->len_byte;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)f->data;
+	iov[1].iov_len = f->len;
+	iov[2].iov_base = &f->cs;
+	iov[2].iov_len = 1;
+
 	LOG("%s: writing data to stm",__func__);
-	r = serial_write(opts, &buf, len + 2);
+	r = stm_txv(opts, iov, 3);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
 
-	if( stm_get_ack(opts) != STM32_ERR_OK) {
+	if( stm_wait_ack(opts, STM_WRITE_TIMEOUT_MS) != STM32_ERR_OK) {
 		LOG("%s: No ACK!", __func__);
+		stm_send_ahead_drop(opts);
 		return 1;
 	}
 
 	return 0;
 }
 
+int stm_write_frame_send(struct serial_port_options *opts, 
+        struct stm_write_frame *f)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_WRITE, start, stm_write_frame_send_cmd(opts, f));
+}
+
 /* 
-    Read the STM32 ID 
+    Write a chunk of memory to the STM32 
 */
-int stm_get_id(struct serial_port_options *opts)
+int stm_write_mem(struct serial_port_options *opts, uint32_t address, 
+        uint8_t data[], unsigned int len)
+{
+	struct stm_write_frame f;
+
+	stm_write_frame_encode(&f, address, data, len);
+
+	return stm_write_frame_send(opts, &f);
+}
+
+/* 
+    Read the STM32 product ID. pid can be NULL if we only care that the 
+    bootloader answers 
+*/
+static int stm_get_id_cmd(struct serial_port_options *opts, uint16_t *pid)
 {
 	uint8_t ver[32];
 	uint8_t cmd[2];
@@ -285,7 +830,7 @@ int stm_get_id(struct serial_port_options *opts)
 	cmd[1] = STM_CMD_GET_ID ^ 0xFF;
 	
 	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -296,7 +841,9 @@ int stm_get_id(struct serial_port_options *opts)
 		return 1;
 	}
 
-	serial_read(opts, &ver,3);
+	if(stm_read_bytes(opts, ver, 3) != 0) {
+		return 1;
+	}
 	LOG("%s: ID 0x%02X%02X",__func__, ver[1], ver[2]);
 
 	if( stm_get_ack(opts) != STM32_ERR_OK) {
@@ -304,6 +851,30 @@ int stm_get_id(struct serial_port_options *opts)
 		return 1;
 	}
 
+	if(pid) {
+		*pid = ver[1] << 8 | ver[2];
+	}
+
+	return 0;
+}
+
+int stm_get_id(struct serial_port_options *opts, uint16_t *pid)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_GET_ID, start, stm_get_id_cmd(opts, pid));
+}
+
+/* 
+    Read the 96 bit unique device ID from system memory 
+*/
+int stm_get_uid(struct serial_port_options *opts, uint8_t uid[STM_UID_SIZE])
+{
+	if(stm_read_mem(opts, STM_UID_ADDR, uid, STM_UID_SIZE) != 0) {
+		LOG("%s: UID read failed!", __func__);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -311,7 +882,7 @@ int stm_get_id(struct serial_port_options *opts)
     Jump to an address and start executing. The address is usually the 
     base address of flash 
 */
-int stm_go(struct serial_port_options *opts, uint32_t address)
+static int stm_go_cmd(struct serial_port_options *opts, uint32_t address)
 {
 	uint8_t cmd[2];
 	uint8_t buf[5];
@@ -327,7 +898,7 @@ int stm_go(struct serial_port_options *opts, uint32_t address)
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
 	
 	LOG("%s: writing 0x%02X to stm",__func__, cmd[0]);
-	r = serial_write(opts, &cmd, 2);
+	r = stm_tx(opts, &cmd, 2);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
@@ -338,11 +909,329 @@ int stm_go(struct serial_port_options *opts, uint32_t address)
 	}
 
 	LOG("%s: writing address 0x%08X to stm",__func__, address);
-	r = serial_write(opts, &buf, 5);
+	r = stm_tx(opts, &buf, 5);
 	if(r < 1) {
 		LOG("%s: write failed!", __func__);
 		return 1;
 	}
 
+	/* The bootloader ACKs the address before it jumps */
+	if( stm_get_ack(opts) != STM32_ERR_OK) {
+		LOG("%s: address not ACKed!", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+int stm_go(struct serial_port_options *opts, uint32_t address)
+{
+	unsigned long start = stm_mark();
+
+	return stm_metric_cmd(STM_M_GO, start, stm_go_cmd(opts, address));
+}
+
+/* 
+    Check if a block only holds STM_ERASED_BYTE, which is what flash reads 
+    back as after an erase. Writing such a block is a no-op, so callers can 
+    skip it. The scan is done a word at a time, with byte compares only for 
+    the unaligned head and tail. 
+*/
+int stm_block_erased(const uint8_t *data, unsigned int len)
+{
+	const uint8_t *end = data + len;
+	unsigned long w, acc;
+
+	while(data < end && ((uintptr_t)data & (sizeof(w) - 1))) {
+		if(*data++ != STM_ERASED_BYTE) {
+			return 0;
+		}
+	}
+
+	/* AND four words together so we only branch once per group */
+	while(end - data >= 4 * sizeof(w)) {
+		acc = ~0UL;
+		memcpy(&w, data, sizeof(w));
+		acc &= w;
+		memcpy(&w, data + sizeof(w), sizeof(w));
+		acc &= w;
+		memcpy(&w, data + 2 * sizeof(w), sizeof(w));
+		acc &= w;
+		memcpy(&w, data + 3 * sizeof(w), sizeof(w));
+		acc &= w;
+		if(acc != ~0UL) {
+			return 0;
+		}
+		data += 4 * sizeof(w);
+	}
+
+	while(end - data >= sizeof(w)) {
+		memcpy(&w, data, sizeof(w));
+		if(w != ~0UL) {
+			return 0;
+		}
+		data += sizeof(w);
+	}
+
+	while(data < end) {
+		if(*data++ != STM_ERASED_BYTE) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* 
+    Link health counters, these cover every ACK we waited for since the 
+    last reset 
+*/
+void stm_get_link_stats(struct stm_link_stats *st)
+{
+	*st = link_stats;
+}
+
+void stm_reset_link_stats(void)
+{
+	memset(&link_stats, 0, sizeof(link_stats));
+}
+
+/* 
+    Turn the latency metrics on or off. They are off to start with, and 
+    while off a command costs one flag test per frame and no clock reads. 
+*/
+void stm_set_metrics(int on)
+{
+	metrics_on = on;
+}
+
+const struct stm_metrics *stm_get_metrics(void)
+{
+	return &metrics;
+}
+
+void stm_reset_metrics(void)
+{
+	memset(&metrics, 0, sizeof(metrics));
+}
+
+/* 
+    A command failed and is about to be sent again. The retrying is done 
+    above us, in the flash layer, so it tells us. 
+*/
+void stm_metrics_retry(void)
+{
+	metrics.retries++;
+}
+
+const char *stm_metric_cmd_name(stm_metric_cmd_t cmd)
+{
+	return cmd < STM_M_CMDS ? metric_cmd_names[cmd] : "?";
+}
+
+const char *stm_metric_phase_name(stm_metric_phase_t phase)
+{
+	return phase < STM_P_PHASES ? metric_phase_names[phase] : "?";
+}
+
+/* 
+    Turn send-ahead on or off. With it on, reads and writes send the 
+    command and the address together instead of waiting for an ACK in 
+    between, data still waits for the address ACK. It turns itself off 
+    if the bootloader rejects a frame. 
+*/
+void stm_set_send_ahead(int on)
+{
+	send_ahead = on;
+	fell_back = 0;
+}
+
+int stm_get_send_ahead(void)
+{
+	return send_ahead;
+}
+
+/* 
+    Did the last failed command drop us out of send-ahead with the link 
+    still in sync. Clears the flag. 
+*/
+int stm_send_ahead_fell_back(void)
+{
+	int r = fell_back;
+
+	fell_back = 0;
+
+	return r;
+}
+
+/* 
+    Has the error rate crossed the point where we should slow down 
+*/
+int stm_link_degraded(void)
+{
+	unsigned long errs = link_stats.nacks + link_stats.timeouts + 
+	        link_stats.garbage;
+	unsigned long total = errs + link_stats.acks;
+
+	return errs >= STM_LINK_ERR_MIN && errs * 100 >= total * STM_LINK_ERR_PCT;
+}
+
+/* 
+    Next rate down the ladder from baud_key, 0 when there is nothing slower 
+*/
+uint32_t stm_baud_step_down(uint32_t baud_key)
+{
+	uint32_t speed = serial_baud_key_to_speed(baud_key);
+	unsigned int i;
+
+	for(i = 0; i < NELEM(baud_ladder); i++) {
+		if(serial_baud_key_to_speed(baud_ladder[i]) < speed) {
+			return baud_ladder[i];
+		}
+	}
+
+	return 0;
+}
+
+/* 
+    (Re)establish the bootloader link at baud_key. The bootloader locks on 
+    to the rate of the first 0x7F it sees after reset, so to change rate, or 
+    to get back in sync after an error, the STM32 has to be reset. We check 
+    the link with a GET_ID round trip as well as the init byte. 
+*/
+int stm_relink(struct serial_port_options *opts, uint32_t baud_key, 
+        stm_reset_fn reset, void *arg)
+{
+	unsigned long start;
+
+	LOG("%s: trying %s", __func__, serial_baud_key_to_str(baud_key));
+
+	if(serial_set_baud(opts, baud_key) != 0) {
+		return 1;
+	}
+
+	entry_stats.reset_us = 0;
+	if(reset) {
+		start = stm_now_us();
+		reset(arg);
+		entry_stats.reset_us = stm_now_us() - start;
+	}
+
+	if(stm_sync(opts, STM_SYNC_TIMEOUT_MS) != 0 || 
+            stm_get_id(opts, NULL) != 0) {
+		LOG("%s: no link at %s", __func__, serial_baud_key_to_str(baud_key));
+		return 1;
+	}
+
+	stm_reset_link_stats();
+
+	return 0;
+}
+
+/* 
+    Find the fastest rate, starting at max_key, that the bootloader syncs 
+    to. On failure we step down the ladder. Without a reset function we only 
+    get one try, the bootloader won't listen to a second init byte. 
+*/
+int stm_autobaud(struct serial_port_options *opts, uint32_t max_key, 
+        stm_reset_fn reset, void *arg)
+{
+	uint32_t key = max_key;
+
+	while(key) {
+		if(stm_relink(opts, key, reset, arg) == 0) {
+			LOG("%s: link up at %s", __func__, serial_baud_key_to_str(key));
+			return 0;
+		}
+		if(reset == NULL) {
+			break;
+		}
+		key = stm_baud_step_down(key);
+	}
+
+	return 1;
+}
+
+/* 
+    Geometry to use when the part can't be identified, this is what the 
+    code always assumed before 
+*/
+void stm_dev_default(struct stm32_dev *dev)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->flash_base = STM_FLASH_BASE;
+	dev->flash_size = STM_FLASH_SIZE;
+	dev->page_size = STM_PAGE_SIZE;
+	dev->pages = STM_FLASH_SIZE / STM_PAGE_SIZE;
+	dev->sram_base = STM_SRAM_BASE;
+}
+
+/* 
+    Does the bootloader support cmd, going by the GET reply 
+*/
+int stm_dev_has_cmd(const struct stm32_dev *dev, uint8_t cmd)
+{
+	unsigned int i;
+
+	for(i = 0; i < dev->ncmds; i++) {
+		if(dev->cmds[i] == cmd) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* 
+    Work out what we are talking to. GET gives the bootloader version and 
+    commands, GET_ID the product ID which we look up in dev_table. The flash 
+    size register then tells us how much flash this particular part has. 
+    An unknown PID keeps the defaults but is not an error. 
+*/
+int stm_probe(struct serial_port_options *opts, struct stm32_dev *dev)
+{
+	const struct stm32_dev_info *info = NULL;
+	uint8_t fsize[2];
+	uint32_t size;
+	unsigned int i;
+
+	stm_dev_default(dev);
+
+	if(stm_get_cmds(opts, dev) != 0 || stm_get_id(opts, &dev->pid) != 0) {
+		return 1;
+	}
+
+	for(i = 0; i < NELEM(dev_table); i++) {
+		if(dev_table[i].pid == dev->pid) {
+			info = &dev_table[i];
+			break;
+		}
+	}
+
+	if(info == NULL) {
+		LOG("%s: unknown PID 0x%03X, using defaults", __func__, dev->pid);
+		return 0;
+	}
+
+	dev->info = info;
+	dev->flash_size = info->flash_size;
+	dev->page_size = info->page_size;
+	dev->sram_size = info->sram_size;
+	dev->bl_ram_end = info->bl_ram_end;
+	dev->quirks = info->quirks;
+
+	if(!(dev->quirks & STM_QUIRK_NO_FSIZE) &&
+            stm_read_mem(opts, STM_FLASH_SIZE_REG, fsize, 2) == 0) {
+		/* Size in KB, little endian */
+		size = (fsize[1] << 8 | fsize[0]) * 1024;
+		if(size > 0 && size <= info->flash_size) {
+			dev->flash_size = size;
+		}
+	}
+	dev->pages = dev->flash_size / dev->page_size;
+
+	LOG("%s: %s, bl 0x%02X, %d KB flash, %d pages", __func__, info->name, 
+            dev->bl_version, dev->flash_size / 1024, dev->pages);
+
 	return 0;
 }
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "crc32.h"
+#include "stub.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static unsigned long stub_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+    Build a frame into buf, returns its length
+*/
+static unsigned int stub_encode(uint8_t *buf, uint8_t type, uint8_t seq,
+        const uint8_t *payload, unsigned int len)
+{
+	buf[0] = STUB_SOF;
+	buf[1] = type;
+	buf[2] = seq;
+	put_le16(&buf[3], len);
+	memcpy(&buf[STUB_HDR_SIZE], payload, len);
+	put_le32(&buf[STUB_HDR_SIZE + len],
+		crc32_update(0, &buf[1], STUB_HDR_SIZE - 1 + len));
+
+	return STUB_FRAME_MAX(len);
+}
+
+/*
+    Read one frame from the stub within timeout_ms. Anything before the
+    start of frame byte is skipped. payload has to hold STUB_PAYLOAD_MAX
+    bytes. Returns 1 on a timeout or a frame that fails its CRC.
+*/
+static int stub_read_frame(struct serial_port_options *opts, uint8_t *type,
+        uint8_t *seq, uint8_t *payload, unsigned int *len, int timeout_ms)
+{
+	unsigned long deadline = stub_now_ms() + timeout_ms;
+	uint8_t hdr[STUB_HDR_SIZE], crc[STUB_CRC_SIZE];
+	unsigned int n;
+	long left;
+
+	hdr[0] = 0;
+	while(hdr[0] != STUB_SOF) {
+		left = deadline - stub_now_ms();
+		if(left <= 0 || serial_read_timeout(opts, hdr, 1, left) != 1) {
+			return 1;
+		}
+	}
+
+	left = deadline - stub_now_ms();
+	if(left <= 0 || serial_read_timeout(opts, &hdr[1], STUB_HDR_SIZE - 1,
+                left) != STUB_HDR_SIZE - 1) {
+		return 1;
+	}
+	n = hdr[3] | hdr[4] << 8;
+	if(n > STUB_PAYLOAD_MAX) {
+		LOG("%s: frame too long %d", __func__, n);
+		return 1;
+	}
+
+	left = deadline - stub_now_ms();
+	if(left <= 0 || serial_read_timeout(opts, payload, n, left) != n ||
+            serial_read_timeout(opts, crc, STUB_CRC_SIZE,
+                left) != STUB_CRC_SIZE) {
+		return 1;
+	}
+
+	if(crc32_update(crc32_update(0, &hdr[1], STUB_HDR_SIZE - 1),
+                payload, n) != get_le32(crc)) {
+		LOG("%s: bad CRC", __func__);
+		return 1;
+	}
+
+	*type = hdr[1];
+	*seq = hdr[2];
+	*len = n;
+
+	return 0;
+}
+
+static struct stub_slot *stub_slot(struct stub_session *s, unsigned int i)
+{
+	return &s->slots[(s->first + i) % s->window];
+}
+
+static int stub_send(struct stub_session *s, struct stub_slot *slot)
+{
+	s->stats.frames++;
+	if(serial_write(s->opts, slot->frame, slot->len) != slot->len) {
+		LOG("%s: write failed!", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+    Go back N, send every frame still in flight again
+*/
+static int stub_resend(struct stub_session *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->inflight; i++) {
+		s->stats.resent++;
+		if(stub_send(s, stub_slot(s, i)) != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    Drop the first n frames in flight, the stub is done with them
+*/
+static void stub_retire(struct stub_session *s, unsigned int n)
+{
+	s->first = (s->first + n) % s->window;
+	s->inflight -= n;
+}
+
+/*
+    Wait for the next answer from the stub and deal with it. An ACK, or a
+    CRC reply, retires every frame up to the one it is for. A NAK retires
+    the frames before the one the stub wants and sends the rest again, so
+    does a timeout. reply gets the payload of a CRC reply for the oldest
+    frame. Gives up after STUB_MAX_RETRIES rounds without progress.
+*/
+static int stub_wait(struct stub_session *s, int timeout_ms, uint8_t *reply,
+        unsigned int *reply_len, unsigned int *retries)
+{
+	uint8_t payload[STUB_PAYLOAD_MAX];
+	uint8_t type, seq, first_seq = stub_slot(s, 0)->seq;
+	unsigned int len, d;
+
+	if(stub_read_frame(s->opts, &type, &seq, payload, &len,
+                timeout_ms) != 0) {
+		s->stats.timeouts++;
+		LOG("%s: no answer, resending %d", __func__, s->inflight);
+		goto resend;
+	}
+
+	d = (uint8_t)(seq - first_seq);
+	switch(type) {
+		case STUB_ACK:
+		case STUB_CRC:
+			if(d >= s->inflight) {
+				LOG("%s: stale answer for seq %d", __func__, seq);
+				return 0;
+			}
+			if(type == STUB_ACK && len > 0 && payload[0] != STUB_OK) {
+				LOG("%s: seq %d failed with %d", __func__, seq, payload[0]);
+				return 1;
+			}
+			if(type == STUB_CRC && reply && d == 0) {
+				memcpy(reply, payload, len);
+				*reply_len = len;
+			}
+			stub_retire(s, d + 1);
+			*retries = 0;
+			return 0;
+		case STUB_NAK:
+			s->stats.naks++;
+			if(len == 0 || payload[0] == STUB_ERR_ADDR ||
+                    payload[0] == STUB_ERR_FLASH ||
+                    payload[0] == STUB_ERR_LEN) {
+				LOG("%s: NAK %d for seq %d", __func__,
+                    len ? payload[0] : -1, seq);
+				return 1;
+			}
+			if(d <= s->inflight) {
+				stub_retire(s, d);
+			}
+			LOG("%s: NAK, stub wants seq %d", __func__, seq);
+			goto resend;
+		default:
+			LOG("%s: unexpected frame 0x%02X", __func__, type);
+			return 0;
+	}
+
+resend:
+	if(++(*retries) > STUB_MAX_RETRIES) {
+		return 1;
+	}
+
+	return stub_resend(s);
+}
+
+/*
+    Put a frame on the wire, waiting for room in the window first
+*/
+static int stub_queue(struct stub_session *s, uint8_t type,
+        const uint8_t *payload, unsigned int len, int timeout_ms)
+{
+	struct stub_slot *slot;
+	unsigned int retries = 0;
+
+	while(s->inflight == s->window) {
+		if(stub_wait(s, timeout_ms, NULL, NULL, &retries) != 0) {
+			return 1;
+		}
+	}
+
+	slot = stub_slot(s, s->inflight);
+	slot->seq = s->seq++;
+	slot->len = stub_encode(slot->frame, type, slot->seq, payload, len);
+	s->inflight++;
+
+	return stub_send(s, slot);
+}
+
+/*
+    Wait until every frame in flight has been ACKed
+*/
+int stub_flush(struct stub_session *s)
+{
+	unsigned int retries = 0;
+
+	while(s->inflight) {
+		if(stub_wait(s, STUB_ACK_TIMEOUT_MS, NULL, NULL, &retries) != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    A command on its own, everything before it is finished first. reply
+    can be NULL when an ACK is all we expect.
+*/
+static int stub_transact(struct stub_session *s, uint8_t type,
+        const uint8_t *payload, unsigned int len, uint8_t *reply,
+        unsigned int *reply_len, int timeout_ms)
+{
+	unsigned int retries = 0;
+
+	if(stub_flush(s) != 0 ||
+            stub_queue(s, type, payload, len, timeout_ms) != 0) {
+		return 1;
+	}
+
+	while(s->inflight) {
+		if(stub_wait(s, timeout_ms, reply, reply_len, &retries) != 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    Upload the stub in path to STUB_LOAD_ADDR through the ROM bootloader,
+    check it landed, start it and wait for its HELLO.
+*/
+int stub_load(struct serial_port_options *opts, const struct stm32_dev *dev,
+        const char *path, struct stub_session *s)
+{
+	uint8_t payload[STUB_PAYLOAD_MAX];
+	uint8_t check[MAX_RW_SIZE];
+	uint8_t *buf = NULL;
+	uint8_t type, seq;
+	unsigned int i, len, chunk;
+	long size;
+	FILE *fp;
+
+	memset(s, 0, sizeof(*s));
+	s->opts = opts;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL) {
+		LOG("%s: no stub '%s'", __func__, path);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	if(size <= 0 || (dev->bl_ram_end && STUB_LOAD_ADDR < dev->bl_ram_end) ||
+            STUB_LOAD_ADDR + size > dev->sram_base + dev->sram_size) {
+		LOG("%s: stub doesn't fit, %ld bytes", __func__, size);
+		fclose(fp);
+		return 1;
+	}
+
+	/* Whole words, the bootloader is happier with those */
+	len = (size + 3) & ~3;
+	buf = malloc(len);
+	if(buf == NULL || fread(buf, 1, size, fp) != size) {
+		fclose(fp);
+		free(buf);
+		return 1;
+	}
+	fclose(fp);
+	memset(buf + size, 0, len - size);
+
+	for(i = 0; i < len; i += chunk) {
+		chunk = len - i < MAX_RW_SIZE ? len - i : MAX_RW_SIZE;
+		if(stm_write_mem(opts, STUB_LOAD_ADDR + i, buf + i, chunk) != 0 ||
+                stm_read_mem(opts, STUB_LOAD_ADDR + i, check, chunk) != 0 ||
+                memcmp(check, buf + i, chunk) != 0) {
+			LOG("%s: upload failed at 0x%08X", __func__, STUB_LOAD_ADDR + i);
+			free(buf);
+			return 1;
+		}
+	}
+	free(buf);
+
+	if(stm_go(opts, STUB_LOAD_ADDR) != 0) {
+		return 1;
+	}
+
+	if(stub_read_frame(opts, &type, &seq, payload, &len,
+                STUB_HELLO_TIMEOUT_MS) != 0 || type != STUB_HELLO ||
+            len < 4 || payload[0] != STUB_VERSION) {
+		LOG("%s: no HELLO from the stub", __func__);
+		return 1;
+	}
+
+	s->window = payload[1];
+	if(s->window > STUB_WINDOW_MAX) {
+		s->window = STUB_WINDOW_MAX;
+	}
+	s->max_payload = payload[2] | payload[3] << 8;
+	if(s->max_payload > STUB_PAYLOAD_MAX) {
+		s->max_payload = STUB_PAYLOAD_MAX;
+	}
+	if(s->window == 0 || s->max_payload <= 12) {
+		LOG("%s: bad HELLO", __func__);
+		return 1;
+	}
+
+	for(i = 0; i < s->window; i++) {
+		s->slots[i].frame = malloc(STUB_FRAME_MAX(s->max_payload));
+		if(s->slots[i].frame == NULL) {
+			stub_close(s);
+			return 1;
+		}
+	}
+	LOG("%s: stub up, window %d, %d byte frames", __func__, s->window,
+        s->max_payload);
+
+	return 0;
+}
+
+void stub_close(struct stub_session *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < STUB_WINDOW_MAX; i++) {
+		free(s->slots[i].frame);
+		s->slots[i].frame = NULL;
+	}
+	s->window = 0;
+}
+
+int stub_ping(struct stub_session *s)
+{
+	return stub_transact(s, STUB_PING, NULL, 0, NULL, NULL,
+		STUB_ACK_TIMEOUT_MS);
+}
+
+/*
+    Move the link to a new rate. The ACK comes back at the old rate, then
+    both ends switch and a PING makes sure we still hear each other.
+*/
+int stub_set_baud(struct stub_session *s, uint32_t baud_key)
+{
+	uint8_t payload[8];
+
+	put_le32(&payload[0], serial_baud_key_to_speed(baud_key));
+	put_le32(&payload[4], serial_baud_key_to_speed(s->opts->baud_rate));
+	if(stub_transact(s, STUB_BAUD, payload, sizeof(payload), NULL, NULL,
+                STUB_ACK_TIMEOUT_MS) != 0) {
+		return 1;
+	}
+
+	if(serial_set_baud(s->opts, baud_key) != 0) {
+		return 1;
+	}
+
+	return stub_ping(s);
+}
+
+int stub_erase(struct stub_session *s, uint16_t first, unsigned int count)
+{
+	uint8_t payload[4];
+
+	put_le16(&payload[0], first);
+	put_le16(&payload[2], count);
+
+	return stub_transact(s, STUB_ERASE, payload, sizeof(payload), NULL,
+		NULL, STUB_ACK_TIMEOUT_MS + count * STM_PAGE_ERASE_TIMEOUT_MS);
+}
+
+/*
+    Queue len bytes for flash at addr. They go out in frames as large as
+    the stub takes and only the window limits how many are in flight.
+    Call stub_flush() to wait for the last of them.
+*/
+int stub_write(struct stub_session *s, uint32_t addr, const uint8_t *data,
+        unsigned int len)
+{
+	uint8_t payload[STUB_PAYLOAD_MAX];
+	unsigned int chunk, max = s->max_payload - 4;
+
+	while(len) {
+		chunk = len < max ? len : max;
+		put_le32(payload, addr);
+		memcpy(&payload[4], data, chunk);
+		if(stub_queue(s, STUB_WRITE, payload, chunk + 4,
+                    STUB_ACK_TIMEOUT_MS) != 0) {
+			return 1;
+		}
+		s->stats.bytes += chunk;
+		addr += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+    CRC32 of each chunk byte piece of [addr, addr + len), worked out on the
+    target. The last piece may be short. crcs has to hold one per piece.
+*/
+int stub_crc(struct stub_session *s, uint32_t addr, uint32_t len,
+        uint32_t chunk, uint32_t *crcs)
+{
+	uint8_t payload[12], reply[STUB_PAYLOAD_MAX];
+	uint32_t n, i, batch = (s->max_payload / 4) * chunk;
+	unsigned int reply_len;
+
+	while(len) {
+		n = len < batch ? len : batch;
+		put_le32(&payload[0], addr);
+		put_le32(&payload[4], n);
+		put_le32(&payload[8], chunk);
+		reply_len = 0;
+		if(stub_transact(s, STUB_CRC, payload, sizeof(payload), reply,
+                    &reply_len, STUB_ACK_TIMEOUT_MS) != 0) {
+			return 1;
+		}
+		if(reply_len != (n + chunk - 1) / chunk * 4) {
+			LOG("%s: short reply %d", __func__, reply_len);
+			return 1;
+		}
+		for(i = 0; i < reply_len / 4; i++) {
+			*crcs++ = get_le32(&reply[i * 4]);
+		}
+		addr += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int stub_go(struct stub_session *s, uint32_t addr)
+{
+	uint8_t payload[4];
+
+	put_le32(payload, addr);
+
+	return stub_transact(s, STUB_GO, payload, sizeof(payload), NULL, NULL,
+		STUB_ACK_TIMEOUT_MS);
+}
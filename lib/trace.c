@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+struct trace_event {
+	const char *cat;
+	const char *name;
+	unsigned long start_us;
+	uint32_t dur_us;
+	int32_t arg;
+	int tid;
+	unsigned long seq;				/* claim number + 1 once filled in */
+};
+
+/* 
+    The ring. head only ever goes up, a span claims its slot with an 
+    atomic add so the file reader thread can record spans too. A claimed 
+    slot isn't filled in yet, seq says when it is. The dump can run on 
+    one thread while the other records, so it only takes slots whose seq 
+    is the one it expects, before and after it copies them. 
+*/
+static struct trace_event *ring;
+static unsigned int ring_size;
+static unsigned long head;
+static unsigned long epoch_us;
+static char *dump_path;
+static volatile sig_atomic_t dump_pending;
+
+static __thread int trace_tid;
+
+static unsigned long trace_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* 
+    Start tracing into a ring of nevents spans, 0 for the default. path 
+    is where trace_dump() writes to. 
+*/
+int trace_open(const char *path, unsigned int nevents)
+{
+	if(nevents == 0) {
+		nevents = TRACE_EVENTS_DEFAULT;
+	}
+
+	ring = calloc(nevents, sizeof(*ring));
+	dump_path = strdup(path);
+	if(ring == NULL || dump_path == NULL) {
+		free(ring);
+		free(dump_path);
+		ring = NULL;
+		dump_path = NULL;
+		return 1;
+	}
+
+	ring_size = nevents;
+	head = 0;
+	epoch_us = trace_now_us();
+
+	return 0;
+}
+
+/* 
+    Dump what is left and stop tracing 
+*/
+void trace_close(void)
+{
+	if(ring == NULL) {
+		return;
+	}
+
+	trace_dump();
+	free(ring);
+	free(dump_path);
+	ring = NULL;
+	dump_path = NULL;
+}
+
+int trace_on(void)
+{
+	return ring != NULL;
+}
+
+/* 
+    Start of a span, 0 when not tracing so nothing reads the clock 
+*/
+unsigned long trace_begin(void)
+{
+	return ring ? trace_now_us() : 0;
+}
+
+/* 
+    Record a span that started at start, as returned by trace_begin(). arg 
+    shows up in the span's args, a length, an address or a result. 
+*/
+void trace_end(const char *cat, const char *name, unsigned long start, 
+        long arg)
+{
+	struct trace_event *ev;
+	unsigned long n, now;
+
+	if(ring == NULL || start == 0) {
+		return;
+	}
+
+	now = trace_now_us();
+	if(trace_tid == 0) {
+		trace_tid = syscall(SYS_gettid);
+	}
+
+	n = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	ev = &ring[n % ring_size];
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->cat = cat;
+	ev->name = name;
+	ev->start_us = start;
+	ev->dur_us = now - start;
+	ev->arg = arg;
+	ev->tid = trace_tid;
+	__atomic_store_n(&ev->seq, n + 1, __ATOMIC_RELEASE);
+
+	if(dump_pending) {
+		trace_poll();
+	}
+}
+
+/* 
+    Write the ring out, oldest span first. Times are in microseconds from 
+    trace_open(), as the format wants. 
+*/
+int trace_dump(void)
+{
+	unsigned long i, seq, first, last;
+	struct trace_event ev;
+	int pid = getpid(), n = 0;
+	FILE *fp;
+
+	if(ring == NULL) {
+		return 1;
+	}
+
+	fp = fopen(dump_path, "w");
+	if(fp == NULL) {
+		LOG("%s: can't open '%s'", __func__, dump_path);
+		return 1;
+	}
+
+	last = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	first = last > ring_size ? last - ring_size : 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(i = first; i < last; i++) {
+		/* Not filled in yet, or taken over by a newer span while we copied */
+		seq = __atomic_load_n(&ring[i % ring_size].seq, __ATOMIC_ACQUIRE);
+		ev = ring[i % ring_size];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(seq != i + 1 || 
+                __atomic_load_n(&ring[i % ring_size].seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%lu,\"dur\":%u,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"arg\":%d}}\n", n++ ? "," : "",
+			ev.name, ev.cat, ev.start_us - epoch_us, ev.dur_us, pid, 
+			ev.tid, ev.arg);
+	}
+	fprintf(fp, "]}\n");
+
+	return fclose(fp) != 0;
+}
+
+/* 
+    Ask for a dump from a signal handler. It is written by the next span 
+    or trace_poll(), out of signal context. 
+*/
+void trace_request_dump(void)
+{
+	dump_pending = 1;
+}
+
+/* 
+    Write the dump if one was asked for. Only one caller gets it when the 
+    reader thread and the main thread both look. 
+*/
+void trace_poll(void)
+{
+	if(__atomic_exchange_n(&dump_pending, 0, __ATOMIC_ACQ_REL)) {
+		trace_dump();
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* 
+    Shared bits of the benchmarks. Results go to stdout one JSON object 
+    per line, so a run can be kept and compared with the last one: 
+
+        {"tier":"loop","name":"write","blocks":512,"bytes":131072,
+         "bytes_per_s":..,"p50_us":..,"p90_us":..,"p99_us":..,
+         "max_us":..,"syscalls_per_block":..}
+
+    Tiers are micro for single functions, loop for the protocol code 
+    over the in-memory transport, link for the protocol code over the 
+    emulator's pty and e2e for isp against the emulator. 
+*/
+
+#define BENCH_EMU		"../test/stm32_emu"
+#define BENCH_ISP		"../prog/isp"
+
+/* Per block, or per operation, times */
+struct bench_samples {
+	unsigned long long *ns;
+	unsigned int n;
+	unsigned int max;
+};
+
+struct bench_result {
+	const char *tier;
+	const char *name;
+	unsigned long blocks;
+	unsigned long long bytes;
+	unsigned long long total_ns;
+	struct bench_samples *lat;
+	double syscalls_per_block;
+	const char *extra;				/* more "key":value pairs, or NULL */
+};
+
+unsigned long long bench_now_ns(void);
+int bench_samples_init(struct bench_samples *s, unsigned int max);
+void bench_samples_add(struct bench_samples *s, unsigned long long ns);
+void bench_samples_free(struct bench_samples *s);
+void bench_report(const struct bench_result *r);
+pid_t bench_emu_start(const char *emu, const char *const args[], char *pty, 
+        size_t len);
+void bench_emu_stop(pid_t pid);
+int bench_random_file(char *path, size_t size);
+
+#endif // _BENCH_H
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+/* 
+    isp -w end to end against the emulator, paced as a UART at a few 
+    rates with F3 erase and program times. isp prints a line for every 
+    block it writes, the time between lines is the block latency. The 
+    syscall count comes from the serial: line isp prints with --timing. 
+*/
+
+#define BENCH_IMAGE_SIZE	(16 * 1024)
+#define BENCH_ERASE_US		"20000"
+#define BENCH_PROGRAM_US	"50"
+#define BENCH_LINES_MAX		4096
+
+static const char *const rates[] = { "115200", "460800", "921600" };
+
+/* 
+    Run isp and time its output, 1 if it didn't finish cleanly 
+*/
+static int bench_isp(const char *isp, const char *pty, const char *rate, 
+        const char *image)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "e2e", .lat = &lat };
+	unsigned long long t, last = 0, start;
+	unsigned long syscalls = 0;
+	char line[256], name[32], extra[64];
+	int fds[2], status;
+	FILE *fp;
+	pid_t pid;
+
+	if(bench_samples_init(&lat, BENCH_LINES_MAX) != 0 || pipe(fds) != 0) {
+		return 1;
+	}
+
+	start = bench_now_ns();
+	pid = fork();
+	if(pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		execl(isp, isp, "-s", "-t", pty, "-b", rate, "-w", image,
+			"--ready", "delay", "--ready-ms", "0", "--timing", (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	fp = fdopen(fds[0], "r");
+	while(fp && fgets(line, sizeof(line), fp)) {
+		t = bench_now_ns();
+		if(line[0] >= '0' && line[0] <= '9') {
+			/* One block down, the first one is timed from the last line */
+			if(last) {
+				bench_samples_add(&lat, t - last);
+			}
+			r.blocks++;
+		} else {
+			sscanf(line, "serial: %lu syscalls", &syscalls);
+		}
+		last = t;
+	}
+	if(fp) {
+		fclose(fp);
+	}
+	waitpid(pid, &status, 0);
+	r.total_ns = bench_now_ns() - start;
+
+	/* A failed run has no numbers worth keeping */
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || r.blocks == 0) {
+		bench_samples_free(&lat);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), "isp_write_%s", rate);
+	snprintf(extra, sizeof(extra), "\"baud\":%s", rate);
+	r.name = name;
+	r.extra = extra;
+	r.bytes = BENCH_IMAGE_SIZE;
+	r.syscalls_per_block = (double)syscalls / r.blocks;
+	bench_report(&r);
+	bench_samples_free(&lat);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *emu = argc > 1 ? argv[1] : BENCH_EMU;
+	const char *isp = argc > 2 ? argv[2] : BENCH_ISP;
+	char image[64], pty[64];
+	unsigned int i;
+	int ret = 0;
+	pid_t pid;
+
+	if(bench_random_file(image, BENCH_IMAGE_SIZE) != 0) {
+		return 1;
+	}
+
+	for(i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		const char *args[] = { "-B", rates[i], "-E", BENCH_ERASE_US, 
+			"-W", BENCH_PROGRAM_US, NULL };
+
+		pid = bench_emu_start(emu, args, pty, sizeof(pty));
+		if(pid < 0) {
+			ret = 1;
+			break;
+		}
+		if(bench_isp(isp, pty, rates[i], image) != 0) {
+			fprintf(stderr, "isp failed at %s\n", rates[i]);
+			ret = 1;
+		}
+		bench_emu_stop(pid);
+	}
+	unlink(image);
+
+	return ret;
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "bench.h"
+
+/* 
+    Microbenchmark for building and sending write frames. The legacy path 
+    is the old stm_write_mem() body: copy the data into a local frame 
+    buffer while XOR-ing the checksum a byte at a time, then write() it. 
+    The new path is stm_write_frame_encode() and the writev() in 
+    stm_write_frame_send(). Frames go to /dev/null so only the host side 
+    cost is measured, one micro tier result per path. 
+*/
+
+#define BENCH_SAMPLES	1000
+#define BENCH_BATCH		200
+
+static const char *const names[] = {
+	"frame_encode_legacy", "frame_encode", "frame_send_legacy", "frame_send",
+};
+
+static uint8_t sink;
+
+static void legacy_encode(uint8_t *buf, const uint8_t *data, unsigned int len)
+{
+	uint8_t cs;
+	unsigned int i;
+
+	buf[0] = len - 1;
+	cs = buf[0];
+	for(i = 0; i < len; i++) {
+		cs ^= data[i];
+		buf[i + 1] = data[i];
+	}
+	buf[len + 1] = cs;
+}
+
+static void legacy_send(struct serial_port_options *opts, uint8_t *buf, 
+        const uint8_t *data, unsigned int len)
+{
+	legacy_encode(buf, data, len);
+	serial_write(opts, buf, len + 2);
+}
+
+static void new_send(struct serial_port_options *opts, 
+        struct stm_write_frame *f, const uint8_t *data, unsigned int len)
+{
+	struct iovec iov[3];
+
+	stm_write_frame_encode(f, STM_FLASH_BASE, data, len);
+	iov[0].iov_base = &f->len_byte;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)f->data;
+	iov[1].iov_len = f->len;
+	iov[2].iov_base = &f->cs;
+	iov[2].iov_len = 1;
+	serial_writev(opts, iov, 3);
+}
+
+/* 
+    Time one of the four paths in batches of frames, each sample is the 
+    mean of a batch 
+*/
+static int run(int which, struct serial_port_options *opts, 
+        uint8_t *data, unsigned int len)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "micro", .name = names[which], 
+		.lat = &lat };
+	struct serial_stats st;
+	uint8_t buf[MAX_RW_SIZE + 2];
+	struct stm_write_frame f;
+	unsigned long long t, start;
+	unsigned int i, j, n = 0;
+
+	if(bench_samples_init(&lat, BENCH_SAMPLES) != 0) {
+		return 1;
+	}
+
+	serial_reset_stats(opts);
+	start = bench_now_ns();
+	for(i = 0; i < BENCH_SAMPLES; i++) {
+		t = bench_now_ns();
+		for(j = 0; j < BENCH_BATCH; j++, n++) {
+			/* new data each frame so nothing can be hoisted */
+			data[n % len] = n;
+			switch(which) {
+				case 0:
+					legacy_encode(buf, data, len);
+					sink ^= buf[len + 1];
+					break;
+				case 1:
+					stm_write_frame_encode(&f, STM_FLASH_BASE, data, len);
+					sink ^= f.cs;
+					break;
+				case 2:
+					legacy_send(opts, buf, data, len);
+					break;
+				case 3:
+					new_send(opts, &f, data, len);
+					break;
+			}
+		}
+		bench_samples_add(&lat, (bench_now_ns() - t) / BENCH_BATCH);
+	}
+	r.total_ns = bench_now_ns() - start;
+
+	serial_get_stats(opts, &st);
+	r.blocks = n;
+	r.bytes = (unsigned long long)n * len;
+	r.syscalls_per_block = (double)(st.reads + st.writes + st.polls) / n;
+	bench_report(&r);
+	bench_samples_free(&lat);
+
+	return 0;
+}
+
+/* 
+    The word-wide checksum has to agree with the byte loop for every 
+    length and alignment 
+*/
+static int check(const uint8_t *data)
+{
+	uint8_t buf[MAX_RW_SIZE + 2];
+	struct stm_write_frame f;
+	unsigned int len, off;
+
+	for(off = 0; off < 8; off++) {
+		for(len = 1; len + off <= MAX_RW_SIZE; len++) {
+			legacy_encode(buf, data + off, len);
+			stm_write_frame_encode(&f, STM_FLASH_BASE, data + off, len);
+			if(buf[len + 1] != f.cs || buf[0] != f.len_byte) {
+				fprintf(stderr, "checksum mismatch, len %u offset %u\n", 
+					len, off);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct serial_port_options opts = { .device = "/dev/null" };
+	uint8_t data[MAX_RW_SIZE];
+	unsigned int i;
+	int ret = 0;
+
+	srand(1);
+	for(i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+
+	if(check(data) != 0) {
+		return 1;
+	}
+
+	opts.fd = open(opts.device, O_WRONLY);
+	if(opts.fd < 0) {
+		perror(opts.device);
+		return 1;
+	}
+
+	for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		ret |= run(i, &opts, data, MAX_RW_SIZE);
+	}
+
+	close(opts.fd);
+
+	return ret || sink == 0x100;
+}
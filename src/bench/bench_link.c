@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "bench.h"
+
+/* 
+    Latency saved by send-ahead. Writes and reads blocks against the pty 
+    bootloader stand-in from src/test with a range of reply latencies, 
+    first in lock-step and then with send-ahead. One link tier result per 
+    run, the reply latency is in latency_us. 
+*/
+
+#define BENCH_BLOCKS	64
+
+static const unsigned long latencies_us[] = { 0, 500, 2000 };
+
+/* 
+    Write, or read when reading is set, BENCH_BLOCKS blocks timing each 
+*/
+static int run(struct serial_port_options *opts, unsigned long latency_us,
+        int ahead, int reading)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "link", .lat = &lat };
+	struct serial_stats st;
+	uint8_t data[MAX_RW_SIZE];
+	unsigned long long t, start;
+	char name[32], extra[32];
+	uint32_t addr;
+	unsigned int i;
+	int ret = 0;
+
+	memset(data, 0x5A, sizeof(data));
+	if(!reading && stm_erase_pages(opts, 0, 
+            BENCH_BLOCKS * MAX_RW_SIZE / STM_PAGE_SIZE) != 0) {
+		return 1;
+	}
+	if(bench_samples_init(&lat, BENCH_BLOCKS) != 0) {
+		return 1;
+	}
+
+	stm_set_send_ahead(ahead);
+	serial_reset_stats(opts);
+	start = bench_now_ns();
+	for(i = 0; i < BENCH_BLOCKS; i++) {
+		addr = STM_FLASH_BASE + i * MAX_RW_SIZE;
+		t = bench_now_ns();
+		if(reading ? stm_read_mem(opts, addr, data, MAX_RW_SIZE) :
+                stm_write_mem(opts, addr, data, MAX_RW_SIZE)) {
+			ret = 1;
+			break;
+		}
+		bench_samples_add(&lat, bench_now_ns() - t);
+	}
+	r.total_ns = bench_now_ns() - start;
+	stm_set_send_ahead(0);
+
+	serial_get_stats(opts, &st);
+	snprintf(name, sizeof(name), "%s%s", reading ? "read" : "write",
+		ahead ? "_ahead" : "");
+	snprintf(extra, sizeof(extra), "\"latency_us\":%lu", latency_us);
+	r.name = name;
+	r.extra = extra;
+	r.blocks = i;
+	r.bytes = (unsigned long long)i * MAX_RW_SIZE;
+	r.syscalls_per_block = i ? 
+		(double)(st.reads + st.writes + st.polls) / i : 0;
+	if(ret == 0) {
+		bench_report(&r);
+	}
+	bench_samples_free(&lat);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *emu = argc > 1 ? argv[1] : BENCH_EMU;
+	struct serial_port_options opts = { .baud_rate = B115200 };
+	char pty[64], lat[32];
+	const char *args[] = { "-l", lat, NULL };
+	unsigned int i;
+	int ret;
+	pid_t pid;
+
+	for(i = 0; i < sizeof(latencies_us) / sizeof(latencies_us[0]); i++) {
+		snprintf(lat, sizeof(lat), "%lu", latencies_us[i]);
+		pid = bench_emu_start(emu, args, pty, sizeof(pty));
+		if(pid < 0) {
+			return 1;
+		}
+		opts.device = pty;
+		if(serial_init(&opts) < 0 || stm_init_seq(&opts) != 0) {
+			fprintf(stderr, "no bootloader on %s\n", pty);
+			bench_emu_stop(pid);
+			return 1;
+		}
+
+		ret = run(&opts, latencies_us[i], 0, 0);
+		ret |= run(&opts, latencies_us[i], 1, 0);
+		ret |= run(&opts, latencies_us[i], 0, 1);
+		ret |= run(&opts, latencies_us[i], 1, 1);
+
+		serial_deinit(&opts);
+		bench_emu_stop(pid);
+
+		if(ret) {
+			fprintf(stderr, "protocol error at %lu us\n", latencies_us[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <termios.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "bench.h"
+
+/* 
+    The protocol code on its own. stm32.c runs over the loop: transport 
+    against a bootloader answered from inside the write, so there is no 
+    UART, no pty and no system call, only what the host code costs per 
+    block. The bootloader here trusts the host and only counts bytes, 
+    src/test/stm32_emu is the one that checks them. 
+*/
+
+#define BENCH_BLOCKS		512
+#define BENCH_FLASH_SIZE	(BENCH_BLOCKS * MAX_RW_SIZE)
+
+typedef enum {
+	BL_SYNC,
+	BL_CMD,
+	BL_CMD_CS,
+	BL_ADDR,
+	BL_READ_LEN,
+	BL_WRITE_LEN,
+	BL_WRITE_DATA,
+	BL_ERASE_COUNT,
+	BL_ERASE_LIST,
+} bl_state_t;
+
+static struct {
+	bl_state_t state;
+	uint8_t cmd;
+	uint8_t in[MAX_RW_SIZE + 8];
+	unsigned int have;
+	unsigned int need;
+	uint32_t addr;
+	uint8_t flash[BENCH_FLASH_SIZE];
+} bl;
+
+static void bl_collect(bl_state_t state, unsigned int need)
+{
+	bl.state = state;
+	bl.have = 0;
+	bl.need = need;
+}
+
+static void bl_reply(struct serial_port_options *opts, const void *buf, 
+        size_t n)
+{
+	serial_loop_put(opts, buf, n);
+}
+
+static void bl_ack(struct serial_port_options *opts)
+{
+	uint8_t ack = STM_ACK;
+
+	bl_reply(opts, &ack, 1);
+}
+
+static void bl_byte(struct serial_port_options *opts, uint8_t b)
+{
+	unsigned int n;
+
+	switch(bl.state) {
+		case BL_SYNC:
+			if(b == STM_INIT) {
+				bl_ack(opts);
+				bl.state = BL_CMD;
+			}
+			return;
+		case BL_CMD:
+			bl.cmd = b;
+			bl.state = BL_CMD_CS;
+			return;
+		case BL_CMD_CS:
+			bl_ack(opts);
+			if(bl.cmd == STM_CMD_ERASE_MEM_EXT) {
+				bl_collect(BL_ERASE_COUNT, 2);
+			} else {
+				bl_collect(BL_ADDR, 5);
+			}
+			return;
+		default:
+			break;
+	}
+
+	bl.in[bl.have++] = b;
+	if(bl.have < bl.need) {
+		return;
+	}
+
+	switch(bl.state) {
+		case BL_ADDR:
+			bl.addr = (bl.in[0] << 24 | bl.in[1] << 16 | bl.in[2] << 8 | 
+				bl.in[3]) - STM_FLASH_BASE;
+			bl_ack(opts);
+			if(bl.cmd == STM_CMD_READ_MEM) {
+				bl_collect(BL_READ_LEN, 2);
+			} else {
+				bl_collect(BL_WRITE_LEN, 1);
+			}
+			break;
+		case BL_READ_LEN:
+			n = bl.in[0] + 1;
+			bl_ack(opts);
+			bl_reply(opts, &bl.flash[bl.addr % (BENCH_FLASH_SIZE - n + 1)], n);
+			bl.state = BL_CMD;
+			break;
+		case BL_WRITE_LEN:
+			bl.need = 1 + bl.in[0] + 1 + 1;
+			bl.state = BL_WRITE_DATA;
+			break;
+		case BL_WRITE_DATA:
+			n = bl.in[0] + 1;
+			memcpy(&bl.flash[bl.addr % (BENCH_FLASH_SIZE - n + 1)], 
+				&bl.in[1], n);
+			bl_ack(opts);
+			bl.state = BL_CMD;
+			break;
+		case BL_ERASE_COUNT:
+			n = bl.in[0] << 8 | bl.in[1];
+			bl.need = n >= 0xFFF0 ? 3 : 2 + 2 * (n + 1) + 1;
+			bl.state = BL_ERASE_LIST;
+			break;
+		case BL_ERASE_LIST:
+			bl_ack(opts);
+			bl.state = BL_CMD;
+			break;
+		default:
+			break;
+	}
+}
+
+static void bl_peer(struct serial_port_options *opts, const uint8_t *buf, 
+        size_t n, void *arg)
+{
+	while(n--) {
+		bl_byte(opts, *buf++);
+	}
+}
+
+/* 
+    Write or read every block once, timing each 
+*/
+static int bench_blocks(struct serial_port_options *opts, const char *name,
+        int reading, int ahead)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "loop", .name = name, .lat = &lat };
+	struct serial_stats st;
+	uint8_t data[MAX_RW_SIZE];
+	unsigned long long t, start;
+	unsigned int i;
+	uint32_t addr;
+	int ret = 0;
+
+	if(bench_samples_init(&lat, BENCH_BLOCKS) != 0) {
+		return 1;
+	}
+	memset(data, 0x5A, sizeof(data));
+
+	stm_set_send_ahead(ahead);
+	serial_reset_stats(opts);
+	start = bench_now_ns();
+	for(i = 0; i < BENCH_BLOCKS; i++) {
+		addr = STM_FLASH_BASE + i * MAX_RW_SIZE;
+		t = bench_now_ns();
+		if(reading ? stm_read_mem(opts, addr, data, MAX_RW_SIZE) :
+                stm_write_mem(opts, addr, data, MAX_RW_SIZE)) {
+			fprintf(stderr, "%s: block %u failed\n", name, i);
+			ret = 1;
+			break;
+		}
+		bench_samples_add(&lat, bench_now_ns() - t);
+	}
+	r.total_ns = bench_now_ns() - start;
+	stm_set_send_ahead(0);
+
+	serial_get_stats(opts, &st);
+	r.blocks = i;
+	r.bytes = (unsigned long long)i * MAX_RW_SIZE;
+	r.syscalls_per_block = i ? 
+		(double)(st.reads + st.writes + st.polls) / i : 0;
+	if(ret == 0) {
+		bench_report(&r);
+	}
+	bench_samples_free(&lat);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct serial_port_options opts = { .device = "loop:", 
+		.baud_rate = B115200 };
+	int ret = 0;
+
+	if(serial_init(&opts) < 0) {
+		fprintf(stderr, "no loopback transport\n");
+		return 1;
+	}
+	serial_loop_set_peer(&opts, bl_peer, NULL);
+
+	if(stm_init_seq(&opts) != 0 || 
+            stm_erase_pages(&opts, 0, BENCH_FLASH_SIZE / STM_PAGE_SIZE) != 0) {
+		fprintf(stderr, "loopback bootloader didn't answer\n");
+		serial_deinit(&opts);
+		return 1;
+	}
+
+	ret |= bench_blocks(&opts, "write", 0, 0);
+	ret |= bench_blocks(&opts, "write_ahead", 0, 1);
+	ret |= bench_blocks(&opts, "read", 1, 0);
+	ret |= bench_blocks(&opts, "read_ahead", 1, 1);
+
+	serial_deinit(&opts);
+
+	return ret;
+}
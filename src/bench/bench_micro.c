@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "serial.h"
+#include "stm32.h"
+#include "flash.h"
+#include "crc32.h"
+#include "bench.h"
+
+/* 
+    Microbenchmarks, the host side code a flash spends its CPU in: the 
+    CRC32 the stub and the journal use, baud rate string lookups and 
+    reading an image file a page at a time. The write frame encode is in 
+    bench_frame. Each sample is the mean of a batch of calls, the 
+    percentiles are over the batches. 
+*/
+
+#define BENCH_SAMPLES		1000
+#define BENCH_BATCH			200
+#define BENCH_IMAGE_SIZE	(128 * 1024)
+
+static volatile uint32_t sink;
+
+static const char *const baud_strs[] = {
+	"9600", "57600", "115200", "460800", "921600", "4000000", "1000001",
+};
+
+static void run_crc32(uint8_t *data, unsigned int i)
+{
+	data[i % MAX_RW_SIZE] = i;
+	sink ^= crc32_update(0, data, MAX_RW_SIZE);
+}
+
+static void run_baud(uint8_t *data, unsigned int i)
+{
+	sink ^= serial_baud_str_to_key(baud_strs[i % 
+		(sizeof(baud_strs) / sizeof(baud_strs[0]))]);
+}
+
+/* 
+    Time fn in batches, bytes is what one call handles 
+*/
+static void bench_fn(const char *name, void (*fn)(uint8_t *, unsigned int),
+        uint8_t *data, unsigned int bytes)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "micro", .name = name, .lat = &lat };
+	unsigned long long t, start;
+	unsigned int i, j, n = 0;
+
+	if(bench_samples_init(&lat, BENCH_SAMPLES) != 0) {
+		return;
+	}
+
+	start = bench_now_ns();
+	for(i = 0; i < BENCH_SAMPLES; i++) {
+		t = bench_now_ns();
+		for(j = 0; j < BENCH_BATCH; j++) {
+			fn(data, n++);
+		}
+		bench_samples_add(&lat, (bench_now_ns() - t) / BENCH_BATCH);
+	}
+	r.total_ns = bench_now_ns() - start;
+	r.blocks = n;
+	r.bytes = (unsigned long long)n * bytes;
+
+	bench_report(&r);
+	bench_samples_free(&lat);
+}
+
+/* 
+    Open the image and read every page, as flash_update() does, once 
+    per sample 
+*/
+static int bench_image(void)
+{
+	struct bench_samples lat;
+	struct bench_result r = { .tier = "micro", .name = "image_load", 
+		.lat = &lat };
+	struct stm32_dev dev;
+	struct flash_image img;
+	uint8_t page[STM_PAGE_SIZE];
+	char path[64];
+	unsigned long long t, start;
+	unsigned int i, p;
+
+	stm_dev_default(&dev);
+	if(bench_random_file(path, BENCH_IMAGE_SIZE) != 0 ||
+            bench_samples_init(&lat, BENCH_SAMPLES / 10) != 0) {
+		return 1;
+	}
+
+	start = bench_now_ns();
+	for(i = 0; i < BENCH_SAMPLES / 10; i++) {
+		t = bench_now_ns();
+		if(flash_image_open(&img, path, &dev) != 0) {
+			unlink(path);
+			return 1;
+		}
+		for(p = 0; p < img.pages; p++) {
+			flash_image_read_page(&img, p, page);
+			sink ^= page[0];
+		}
+		flash_image_close(&img);
+		bench_samples_add(&lat, bench_now_ns() - t);
+		r.blocks++;
+		r.bytes += BENCH_IMAGE_SIZE;
+	}
+	r.total_ns = bench_now_ns() - start;
+	unlink(path);
+
+	bench_report(&r);
+	bench_samples_free(&lat);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t data[MAX_RW_SIZE];
+	unsigned int i;
+
+	srand(1);
+	for(i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+
+	bench_fn("crc32", run_crc32, data, MAX_RW_SIZE);
+	bench_fn("baud_lookup", run_baud, data, 0);
+
+	return bench_image();
+}
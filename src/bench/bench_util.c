@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define BENCH_EMU_ARGS_MAX	16
+
+unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int bench_samples_init(struct bench_samples *s, unsigned int max)
+{
+	s->ns = calloc(max, sizeof(*s->ns));
+	s->n = 0;
+	s->max = max;
+
+	return s->ns == NULL;
+}
+
+void bench_samples_add(struct bench_samples *s, unsigned long long ns)
+{
+	if(s->n < s->max) {
+		s->ns[s->n++] = ns;
+	}
+}
+
+void bench_samples_free(struct bench_samples *s)
+{
+	free(s->ns);
+	s->ns = NULL;
+	s->n = s->max = 0;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 
+    Nearest rank percentile, the samples have to be sorted 
+*/
+static double bench_pct_us(const struct bench_samples *s, unsigned int pct)
+{
+	unsigned int i;
+
+	if(s->n == 0) {
+		return 0;
+	}
+	i = (s->n * pct + 99) / 100;
+
+	return s->ns[i ? i - 1 : 0] / 1000.0;
+}
+
+void bench_report(const struct bench_result *r)
+{
+	struct bench_samples *s = r->lat;
+
+	fprintf(stdout, "{\"tier\":\"%s\",\"name\":\"%s\",\"blocks\":%lu,"
+		"\"bytes\":%llu,\"bytes_per_s\":%.0f", r->tier, r->name, r->blocks,
+		r->bytes, r->total_ns ? r->bytes * 1e9 / r->total_ns : 0.0);
+	if(s && s->n) {
+		qsort(s->ns, s->n, sizeof(*s->ns), bench_cmp);
+		fprintf(stdout, ",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+			"\"max_us\":%.3f", bench_pct_us(s, 50), bench_pct_us(s, 90),
+			bench_pct_us(s, 99), bench_pct_us(s, 100));
+	}
+	fprintf(stdout, ",\"syscalls_per_block\":%.2f%s%s}\n", 
+		r->syscalls_per_block, r->extra ? "," : "", r->extra ? r->extra : "");
+	fflush(stdout);
+}
+
+/* 
+    Start the emulator with args, NULL terminated, and read back the name 
+    of its pty 
+*/
+pid_t bench_emu_start(const char *emu, const char *const args[], char *pty, 
+        size_t len)
+{
+	const char *argv[BENCH_EMU_ARGS_MAX + 2];
+	unsigned int n = 0;
+	int fds[2];
+	FILE *fp;
+	pid_t pid;
+
+	argv[n++] = emu;
+	while(args && *args && n <= BENCH_EMU_ARGS_MAX) {
+		argv[n++] = *args++;
+	}
+	argv[n] = NULL;
+
+	if(pipe(fds) != 0) {
+		return -1;
+	}
+
+	pid = fork();
+	if(pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		/* The emulator's own stats would get in the way of the results */
+		if(freopen("/dev/null", "w", stderr) == NULL) {
+			_exit(127);
+		}
+		execv(emu, (char *const *)argv);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	fp = fdopen(fds[0], "r");
+	if(pid < 0 || fp == NULL || fgets(pty, len, fp) == NULL) {
+		fprintf(stderr, "could not start %s\n", emu);
+		if(fp) {
+			fclose(fp);
+		}
+		return -1;
+	}
+	pty[strcspn(pty, "\n")] = '\0';
+	fclose(fp);
+
+	return pid;
+}
+
+void bench_emu_stop(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/* 
+    Temporary file of size random bytes, path gets its name 
+*/
+int bench_random_file(char *path, size_t size)
+{
+	FILE *fp;
+	int fd;
+
+	strcpy(path, "/tmp/bench_XXXXXX");
+	fd = mkstemp(path);
+	if(fd < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+		perror(path);
+		return 1;
+	}
+	srand(1);
+	while(size--) {
+		fputc(rand() & 0xFF, fp);
+	}
+	fclose(fp);
+
+	return 0;
+}
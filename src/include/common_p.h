@@ -51,4 +51,12 @@ typedef enum {
     CMD_UNKNOWN,
 } cmd_action;
 
+/* How isp tells the application is up after GO */
+typedef enum {
+	READY_ANY = 0,		/* the first byte it sends */
+	READY_BANNER,		/* a given string */
+	READY_BYTE,			/* a given handshake byte */
+	READY_DELAY,		/* no check, just wait */
+} ready_check_t;
+
 #endif // _COMMON_H
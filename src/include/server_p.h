@@ -17,6 +17,7 @@
 
 #define	ISPD_DEFAULT_PORT 7890
 #define ISPD_UNIX_SOCKET "/tmp/tioSocket"
+#define ISPD_MIRROR_DIR "/home/root/.ispd"
 
 #define MAX(A,B) ((A) > (B) ? (A) : (B))
 
@@ -46,4 +47,13 @@ int ispd_socket_accept(int sfd, int addr_family);
 int ispd_socket_read(int sfd, char *msg, size_t buf_size);
 void ispd_socket_write(int sfd, const char *msg);
 
+int ispd_metrics_start(unsigned short port);
+void ispd_metrics_stop(void);
+void ispd_metrics_session(void);
+void ispd_metrics_update_begin(void);
+void ispd_metrics_update_progress(unsigned long bytes);
+void ispd_metrics_update_end(int ok);
+void ispd_metrics_entry(unsigned long us);
+void ispd_metrics_nacks(unsigned long nacks);
+
 #endif // _SERVER_H
@@ -6,11 +6,16 @@
 #include <unistd.h>
 #include <signal.h>
 #include <termios.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "common_p.h"
 #include "serial.h"
 #include "gpio.h"
 #include "stm32.h"
+#include "flash.h"
+#include "stub.h"
+#include "trace.h"
 
 /* Uncomment for full debugging */
 //#define DEBUG
@@ -21,6 +26,8 @@
 #endif
 
 static void reset_micro(pin_state s);
+static int start_stub(void);
+static int parse_ready(const char *arg);
 static int update_firmware(char *path);
 static int start(void);
 static void read_action(void);
@@ -28,6 +35,7 @@ static void write_action(void);
 static void query_action(void);
 static void go_action(void);
 static void run_task(void);
+static unsigned long now_us(void);
 
 /* 
     Structure to hold options and state 
@@ -37,17 +45,51 @@ struct {
 	task_state_t task_state;
 	stm32_state_t micro_state;
 	uint8_t reset;
+	uint8_t sparse;
+	uint8_t delta;
+	uint8_t verify;
+	uint8_t holes;
+	uint8_t timing;
+	const char *trace_path;
 	char filename[128];
 	uint32_t addr;
+	uint32_t read_addr;
+	uint32_t read_len;
+	uint32_t autobaud;
+	unsigned int reset_pulse_us;
+	const char *stub_path;
+	uint32_t stub_baud;
+	const char *journal;
+	ready_check_t ready;
+	char ready_banner[64];
+	uint8_t ready_byte;
+	unsigned int ready_ms;		/* give up, or the delay for READY_DELAY */
 	version_check ver_check;
 	struct serial_port_options sport;
+	struct stm32_dev dev;
+	struct stub_session stub;
 } work = {
 	.task = FLASH_NONE,
 	.task_state = TASK_IDLE,
 	.micro_state = STM32_IDLE,
 	.reset = 1,
+	.sparse = 0,
+	.delta = 0,
+	.verify = 0,
+	.holes = 0,
+	.timing = 0,
+	.trace_path = NULL,
 	.filename = "/home/root/main.bin",
 	.addr = USER_DATA_OFFSET,
+	.read_addr = 0,
+	.read_len = 0,
+	.autobaud = 0,
+	.reset_pulse_us = GPIO_RESET_PULSE_US,
+	.stub_path = NULL,
+	.stub_baud = 0,
+	.journal = NULL,
+	.ready = READY_ANY,
+	.ready_ms = 5000,
 	.ver_check = UNCHECKED,
 	.sport = {
         .fd = 0,
@@ -56,47 +98,120 @@ struct {
 	},
 };
 
+/* 
+    Where the time of a run went, for --timing. Erase is what the erase 
+    commands took, write is the rest of the write pass. Go runs from the 
+    GO command until the app is up. The entry, serial and ready numbers 
+    are kept for the same report, stdout is the progress count otherwise. 
+*/
+static struct {
+	unsigned long reset_us;
+	unsigned long init_us;		/* serial setup, sync and probe */
+	unsigned long erase_us;
+	unsigned long write_us;
+	unsigned long verify_us;
+	unsigned long go_us;
+	struct stm_entry_stats entry;
+	unsigned long gpio_writes;
+	struct serial_stats serial;	/* of the read or write pass */
+	unsigned long acks;
+	int have_serial;
+	unsigned long ready_ms;
+	int ready;					/* 0 not looked for, 1 up, -1 no sign */
+} timing;
+
 /* 
     Reset the STM32. To put the STM32 in reset pull the boot pin high, 
     and toggle the reset pin. This will bring the STM32 up in bootloader mode.
     To return the STM32 to normal, pull the boot pin low and toggle the reset pin.
+    We don't wait for the bootloader here, stm_sync() probes until it answers.
 */
 static void reset_micro(pin_state s)
 {
+	unsigned long start = trace_begin();
+
 	LOG("%s: ", __func__);
 
-	gpio_toggle_boot(s);
-	sleep(1);
-	gpio_toggle_reset(LOW);
-	sleep(1);
-	gpio_toggle_reset(HIGH);
-	sleep(1);
+	gpio_reset_pulse(s, GPIO_BOOT_SETUP_US, work.reset_pulse_us);
+	trace_end("gpio", s == HIGH ? "reset to bootloader" : "reset to app", 
+        start, s);
+}
+
+/* 
+    Reset callback for the link code, bring the STM32 up in the bootloader 
+*/
+static void reset_bootloader(void *arg)
+{
+	reset_micro(HIGH);
 }
 
 /* 
     Set up the STM32 in bootloader mode. Here we init the serial port, 
-    GPIO port and send the STM32 an init byte. 
+    GPIO port and send the STM32 init bytes until it answers. With autobaud 
+    set we look for the fastest rate the bootloader syncs to, starting at 
+    work.autobaud. How long the reset and the sync took is reported.
 */
 static void micro_init(void)
 {
+	unsigned long start = now_us();
+	struct stm_entry_stats entry;
+	struct gpio_stats gpio;
+
+	serial_init(&(work).sport);
    	if(work.reset) {
 		LOG("performing reset!");
+		/* The modem lines backend drives the port opened above */
+		gpio_modem_set_fd(work.sport.fd);
 		if(gpio_init() != 0) {
 			LOG("gpio init failed!");
 			work.micro_state = STM32_FAILED;
 		}
-		reset_micro(HIGH);
-	} else {
-		sleep(1);
 	}
-	serial_init(&(work).sport);
-	if(stm_init_seq(&(work).sport) != 0) {
+
+	if(work.autobaud) {
+		if(stm_autobaud(&(work).sport, work.autobaud, 
+                    work.reset ? reset_bootloader : NULL, NULL) != 0) {
+			work.micro_state = STM32_FAILED;
+		}
+		fprintf(stdout, "baud: %s\n", 
+            serial_baud_key_to_str(work.sport.baud_rate));
+	} else if(stm_relink(&(work).sport, work.sport.baud_rate, 
+                work.reset ? reset_bootloader : NULL, NULL) != 0) {
 		work.micro_state = STM32_FAILED;
 	}
 
+	stm_get_entry_stats(&entry);
+	gpio_get_last_sequence(&gpio);
+	timing.entry = entry;
+	timing.gpio_writes = work.reset ? gpio.writes : 0;
+
+	/* Find out what we are talking to, fall back to the old defaults */
+	if(stm_probe(&(work).sport, &(work).dev) != 0) {
+		LOG("probe failed, using default geometry");
+		stm_dev_default(&(work).dev);
+	}
+
+	timing.reset_us = entry.reset_us;
+	timing.init_us = now_us() - start - entry.reset_us;
 	work.micro_state = STM32_READY;
 }
 
+/* 
+    With the mock backend there are no pins to look at, so print every 
+    write instead. 
+*/
+static void print_gpio_mock(void)
+{
+	const struct gpio_mock_write *log;
+	unsigned int i, n = gpio_mock_log(&log);
+
+	fprintf(stdout, "gpio: %u writes,", n);
+	for(i = 0; i < n; i++) {
+		fprintf(stdout, " 0x%02X@%luus", log[i].val, log[i].us);
+	}
+	fprintf(stdout, "\n");
+}
+
 /* 
     Reset the STM32 to normal running state, reset the GPIO and serial 
     port.
@@ -106,6 +221,9 @@ static void micro_deinit(void)
    if(work.reset) {
 		reset_micro(LOW);
 		gpio_deinit();
+		if(gpio_get_backend() == &gpio_mock_backend) {
+			print_gpio_mock();
+		}
 	}
 	serial_deinit(&(work).sport);
 }
@@ -124,60 +242,186 @@ static void sig_handler(int sig, siginfo_t *siginfo, void *context)
 	serial_deinit(&(work).sport);
 }
 
+/* 
+    SIGUSR1, ask for the trace to be written out 
+*/
+static void trace_sig_handler(int sig, siginfo_t *siginfo, void *context)
+{
+	trace_request_dump();
+}
+
+/* 
+    Progress callback for the flash engine, the count goes down by one 
+    for every 256 byte block. 
+*/
+static void update_progress(void *arg, int remaining)
+{
+    unsigned long start = trace_begin();
+
+    /* Write progress to stdout, as it happens even into a pipe */
+    fprintf(stdout,"%d\n", remaining);
+    fflush(stdout);
+    trace_end("notify", "progress", start, remaining);
+}
+
+/* 
+    Mismatch callback for the verify pass, print each range of flash that 
+    does not match the file. 
+*/
+static void verify_mismatch(void *arg, uint32_t addr, unsigned int len)
+{
+    fprintf(stdout, "mismatch: 0x%08X, %u bytes\n", addr, len);
+}
+
+/* 
+    Keep the system calls the serial port made since the counters were 
+    last reset for --timing. acks is how many protocol steps the 
+    bootloader answered in that time. 
+*/
+static void save_serial_stats(unsigned long acks)
+{
+	serial_get_stats(&(work).sport, &(timing).serial);
+	timing.acks = acks;
+	timing.have_serial = 1;
+}
+
+/* 
+    Upload the flash loader stub and start it. It takes over from the ROM 
+    bootloader until go_action() hands control to the application. With 
+    --stub-baud the link moves to a faster rate once the stub is up.
+*/
+static int start_stub(void)
+{
+	if(stub_load(&(work).sport, &(work).dev, work.stub_path, 
+                &(work).stub) != 0) {
+		fprintf(stdout, "stub: failed to start %s\n", work.stub_path);
+		return 1;
+	}
+
+	if(work.stub_baud && stub_set_baud(&(work).stub, work.stub_baud) != 0) {
+		fprintf(stdout, "stub: no link at %s\n", 
+            serial_baud_key_to_str(work.stub_baud));
+		return 1;
+	}
+
+	return 0;
+}
+
 /* 
     Update the firmware on the STM32. This reads a file from the filesystem 
     and writes it to the STM32. The STM32 accepts 256 bytes for each write so
     we divide the file size by 256 to give us an ops count and use this to 
-    notify the client of progress.
+    notify the client of progress. In sparse mode blocks that are all 0xFF 
+    are skipped, the erase already left them that way. In delta mode only 
+    the pages that differ from what is on the micro are rewritten. With 
+    verify set the flash is read back and checked against the file, and 
+    the time taken is reported next to the write pass. With a journal an 
+    update that was cut off carries on from where it stopped. With a stub 
+    the data goes through it instead of the ROM bootloader.
 */
 static int update_firmware(char *path)
 {
-	FILE *fp;
-	ssize_t r;
-	long size;
-	uint8_t tmp[MAX_RW_SIZE];
-	uint32_t addr = STM_FLASH_BASE;
-	unsigned int i, num_ops;
-    int ret;
-
-	fp = fopen(path, "rb");
-	if(fp == NULL) {
-		LOG("File '%s' not found!", path);
-		return 1;
+	struct flash_job job = {
+		.path = path,
+		.dev = &(work).dev,
+		.mode = work.delta ? FLASH_MODE_DELTA : FLASH_MODE_FULL,
+		.sparse = work.sparse,
+		.verify = work.verify,
+		.progress = update_progress,
+		.mismatch = verify_mismatch,
+		.link = {
+			.reset = work.reset ? reset_bootloader : NULL,
+		},
+	};
+	struct stm_link_stats before, after;
+	uint8_t uid[STM_UID_SIZE];
+	int ret;
+
+	/* 
+	    The journal is only good for the board it was written for, without 
+	    the UID another board could resume from it 
+	*/
+	if(work.journal) {
+		if(stm_get_uid(&(work).sport, uid) == 0) {
+			job.journal_path = work.journal;
+			job.uid = uid;
+		} else {
+			fprintf(stdout, "journal: can't read the UID, resume is off\n");
+		}
 	}
 
-	fseek (fp , 0 , SEEK_END);
-	size = ftell (fp);
-	rewind (fp);
+	serial_reset_stats(&(work).sport);
+	stm_get_link_stats(&before);
+	if(work.stub_path) {
+		if(start_stub() != 0) {
+			return 1;
+		}
+		job.stub = &(work).stub;
+	}
+	ret = flash_update(&(work).sport, &job);
+	stm_get_link_stats(&after);
 
-    /* How many 256 byte chunks we have */
-    num_ops = size / MAX_RW_SIZE;
+	if(job.stub) {
+		fprintf(stdout, "stub: %lu frames, %lu resent, %lu NAKs, "
+			"%lu timeouts, window %u x %u bytes, %s\n",
+			work.stub.stats.frames, work.stub.stats.resent,
+			work.stub.stats.naks, work.stub.stats.timeouts,
+			work.stub.window, work.stub.max_payload,
+			serial_baud_key_to_str(work.sport.baud_rate));
+	}
 
-	LOG("%s: file size is %ld; ops = %d, fw = %s\n", __func__,
-            size, num_ops, path);
+	if(job.stats.pages_resumed) {
+		fprintf(stdout, "resumed: %u pages done by the last update\n",
+			job.stats.pages_resumed);
+	}
 
-	r = fread (tmp,1,MAX_RW_SIZE,fp);
-	while (r > 0) {
-        /* We need to pad reads that are smaller than 256 bytes */
-		if(r < MAX_RW_SIZE) {
-			LOG("\n%s: padding buffer, read %d", __func__, r);
-			for(i = r; i < MAX_RW_SIZE; i++) {
-				tmp[i] = 0xFF;
-			}
-		}
-		LOG("\n%s: writing %d bytes to flash", __func__, MAX_RW_SIZE);
-		ret = stm_write_mem(&(work).sport, addr,tmp,MAX_RW_SIZE);
-		addr += r;
+	if(work.delta) {
+		fprintf(stdout, "pages: %u total, %u skipped, %u erased, %u written\n",
+			job.stats.pages, job.stats.pages_skipped,
+			job.stats.pages_erased, job.stats.pages_written);
+	}
 
-        /* Write progress to stdout */
-        fprintf(stdout,"%d\n", num_ops--);
+	if(job.stats.pipe_stalls) {
+		fprintf(stdout, "pipeline: link waited on the file %u times\n",
+			job.stats.pipe_stalls);
+	}
 
-		r = fread (tmp,1,MAX_RW_SIZE,fp);
+	if(after.fallbacks > before.fallbacks) {
+		fprintf(stdout, "send-ahead: rejected, fell back to lock-step\n");
 	}
 
-	fclose (fp);
-	
-	return 0;
+	if(job.link.relinks) {
+		fprintf(stdout, "link: %u relinks, %u downshifts, now %s\n",
+			job.link.relinks, job.link.downshifts,
+			serial_baud_key_to_str(work.sport.baud_rate));
+	}
+
+	if(work.verify && ret != 0 && !job.stats.verify_bytes && 
+            !job.stats.verify_bad_pages) {
+		fprintf(stdout, "verify: skipped, the write failed\n");
+	} else if(work.verify) {
+		fprintf(stdout, "verify: %s, %lu bytes in %lu ms (%lu B/s), "
+			"write pass %lu ms, %s\n",
+			job.stats.verify_bad_pages ? "FAILED" : "OK",
+			job.stats.verify_bytes, job.stats.verify_ms,
+			job.stats.verify_ms ? 
+				job.stats.verify_bytes * 1000 / job.stats.verify_ms : 0,
+			job.stats.write_ms, 
+			serial_baud_key_to_str(work.sport.baud_rate));
+	}
+
+	save_serial_stats(after.acks - before.acks);
+
+	/* The stub pipelines its erases with the writes, no split there */
+	if(!job.stub) {
+		timing.erase_us = stm_get_metrics()->cmd[STM_M_ERASE].sum;
+	}
+	timing.write_us = job.stats.write_ms * 1000;
+	timing.write_us -= timing.erase_us < timing.write_us ? 
+        timing.erase_us : timing.write_us;
+	timing.verify_us = job.stats.verify_ms * 1000;
+
+	return ret;
 }
 
 /* 
@@ -201,14 +445,49 @@ static void display_help(char *prog_name)
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "  -b baud_rate          Set baud rate (default:%s)\n", 
         serial_baud_key_to_str(work.sport.baud_rate));
+    fprintf(stdout, "  -a max_baud_rate      Negotiate the fastest baud rate up to max_baud_rate\n");
     fprintf(stdout, "  -t tty_device         Set serial dev (default:%s)\n", 
         work.sport.device);
+    fprintf(stdout, "                        or tcp:host:port, pty:path, loop:\n");
     fprintf(stdout, "  -w filename           Write flash from file (default:%s)\n", 
         work.filename);
     fprintf(stdout, "  -r filename           Read flash to file (default:%s)\n", 
         work.filename);
+    fprintf(stdout, "  --addr address        Flash read start (default:flash base)\n");
+    fprintf(stdout, "  --len length          Flash read length (default:rest of flash)\n");
+    fprintf(stdout, "  --holes               Leave erased areas of the read file as holes,\n"
+                    "                        they read back as 0x00 (default:%s)\n", 
+        work.holes ? "Yes" : "No");
+    fprintf(stdout, "  --ready check         How to tell the app is up after GO: any, banner:text,\n"
+                    "                        byte:value or delay (default:any)\n");
+    fprintf(stdout, "  --ready-ms ms         Wait this long for the app, or the delay (default:%u)\n", 
+        work.ready_ms);
+    fprintf(stdout, "  --reset-pulse us      Reset pulse length (default:%u)\n", 
+        work.reset_pulse_us);
+    fprintf(stdout, "  --gpio backend        Reset and boot pins: expander[:i2c_dev],\n"
+                    "                        gpiochip:chip_dev:boot_line,reset_line,\n"
+                    "                        modem[:boot,reset] (rts/dtr, ! inverts) or mock\n"
+                    "                        (default:expander:%s)\n", I2C_DEV);
+    fprintf(stdout, "  --gpio-mock           Same as --gpio mock\n");
     fprintf(stdout, "  -s                    Skip micro reset (default:%s)\n", 
         work.reset ? "No" : "Yes");
+    fprintf(stdout, "  -S                    Sparse write, skip erased blocks (default:%s)\n", 
+        work.sparse ? "Yes" : "No");
+    fprintf(stdout, "  -d                    Delta write, only rewrite pages that differ (default:%s)\n", 
+        work.delta ? "Yes" : "No");
+    fprintf(stdout, "  -V                    Verify flash after writing (default:%s)\n", 
+        work.verify ? "Yes" : "No");
+    fprintf(stdout, "  --send-ahead          Send a command and its address before waiting\n"
+                    "                        for the ACKs\n");
+    fprintf(stdout, "  --journal filename    Record the pages the micro ACKed, resume a cut\n"
+                    "                        off write\n");
+    fprintf(stdout, "  --stub filename       Write through a flash loader stub run from SRAM\n");
+    fprintf(stdout, "  --stub-baud baud_rate Rate to switch to once the stub is up\n");
+    fprintf(stdout, "  --timing              Print where the time went: entry, syscalls,\n"
+                    "                        app start, a phase breakdown and per command\n"
+                    "                        latency\n");
+    fprintf(stdout, "  --trace filename      Write a Chrome trace-event timeline of the run,\n"
+                    "                        SIGUSR1 writes it early\n");
     fprintf(stdout, "  -q                    Query micro version(default:0x%08X)\n", 
         work.addr);
     fprintf(stdout, "  -i                    Run in interactive mode\n");
@@ -222,9 +501,27 @@ static void display_help(char *prog_name)
 */
 static int parse_options(int argc, char *argv[]) 
 {
+	static const struct option long_opts[] = {
+		{ "addr",  required_argument, NULL, 'A' },
+		{ "len",   required_argument, NULL, 'L' },
+		{ "holes", no_argument,       NULL, 'H' },
+		{ "send-ahead", no_argument,  NULL, 'P' },
+		{ "journal", required_argument, NULL, 'J' },
+		{ "reset-pulse", required_argument, NULL, 'R' },
+		{ "gpio", required_argument, NULL, 'g' },
+		{ "gpio-mock", no_argument, NULL, 'G' },
+		{ "ready", required_argument, NULL, 'Y' },
+		{ "ready-ms", required_argument, NULL, 'M' },
+		{ "stub",  required_argument, NULL, 'U' },
+		{ "stub-baud", required_argument, NULL, 'B' },
+		{ "timing", no_argument, NULL, 'T' },
+		{ "trace", required_argument, NULL, 'X' },
+		{ NULL, 0, NULL, 0 },
+	};
 	int c;
 	
-	while ((c = getopt(argc, argv, "ivhw:r:b:t:sq")) != -1) {
+	while ((c = getopt_long(argc, argv, "ivhw:r:b:a:t:sSdVq", long_opts, 
+                    NULL)) != -1) {
 		switch(c) {
 			case 'h':
 				if(work.task != FLASH_NONE) {
@@ -263,15 +560,77 @@ static int parse_options(int argc, char *argv[])
                 strncpy(work.filename, optarg, sizeof(work.filename));
 				work.task = FLASH_READ;
 				break;
+			case 'A':
+				work.read_addr = strtoul(optarg, NULL, 0);
+				break;
+			case 'L':
+				work.read_len = strtoul(optarg, NULL, 0);
+				break;
+			case 'H':
+				work.holes = 1;
+				break;
 			case 'b':
 				work.sport.baud_rate = serial_baud_str_to_key(optarg);
 				break;
+			case 'a':
+				work.autobaud = serial_baud_str_to_key(optarg);
+				work.sport.baud_rate = work.autobaud;
+				break;
 			case 't':
 				work.sport.device = strdup(optarg);
 				break;
 			case 's':
 				work.reset = 0;
 				break;
+			case 'S':
+				work.sparse = 1;
+				break;
+			case 'd':
+				work.delta = 1;
+				break;
+			case 'P':
+				stm_set_send_ahead(1);
+				break;
+			case 'Y':
+				if(parse_ready(optarg) != 0) {
+					LOG("bad --ready '%s'", optarg);
+					return 1;
+				}
+				break;
+			case 'M':
+				work.ready_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'g':
+				if(gpio_select(optarg) != 0) {
+					LOG("bad --gpio '%s'", optarg);
+					return 1;
+				}
+				break;
+			case 'G':
+				gpio_select("mock");
+				break;
+			case 'R':
+				work.reset_pulse_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'J':
+				work.journal = strdup(optarg);
+				break;
+			case 'U':
+				work.stub_path = strdup(optarg);
+				break;
+			case 'B':
+				work.stub_baud = serial_baud_str_to_key(optarg);
+				break;
+			case 'V':
+				work.verify = 1;
+				break;
+			case 'T':
+				work.timing = 1;
+				stm_set_metrics(1);
+				break;
+			case 'X':
+				work.trace_path = strdup(optarg);
+				break;
 			case 'q':
 				if(work.task != FLASH_NONE) {
 					LOG("Multiple actions not supported!");
@@ -286,15 +645,15 @@ static int parse_options(int argc, char *argv[])
 }
 
 /* 
-    Write task, we are going to program the STM32 
+    Write task, we are going to program the STM32. Only the pages the 
+    image covers are erased.
 */
 static void write_action(void)
 {
-	if(stm_erase_mem(&(work).sport) != 0) {
+	if(update_firmware(work.filename) != 0) {
 		work.micro_state = STM32_FAILED;
 		goto err;
 	}
-	update_firmware(work.filename);
 	work.task_state = TASK_SUCCESS;
 
 err:
@@ -332,22 +691,198 @@ err:
 }
 
 /*
-    Go task, just to flash base and start executing.
+    Parse --ready, one of any, banner:text, byte:value or delay
+*/
+static int parse_ready(const char *arg)
+{
+	if(strcmp(arg, "any") == 0) {
+		work.ready = READY_ANY;
+	} else if(strncmp(arg, "banner:", 7) == 0 && arg[7] != '\0') {
+		work.ready = READY_BANNER;
+		strncpy(work.ready_banner, arg + 7, sizeof(work.ready_banner) - 1);
+	} else if(strncmp(arg, "byte:", 5) == 0) {
+		work.ready = READY_BYTE;
+		work.ready_byte = strtoul(arg + 5, NULL, 0);
+	} else if(strcmp(arg, "delay") == 0) {
+		work.ready = READY_DELAY;
+	} else {
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static unsigned long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+    Wait for the application to show it is alive after GO, for up to 
+    work.ready_ms. The banner is matched against a sliding window of what 
+    came in, so it can turn up after any amount of other output. Leaves 
+    the time it took in ms. Returns 1 if the application didn't answer.
+*/
+static int wait_ready(unsigned long *ms)
+{
+	unsigned long start = now_ms();
+	unsigned int len = strlen(work.ready_banner), have = 0;
+	char window[sizeof(work.ready_banner)];
+	long left;
+	uint8_t b;
+
+	if(work.ready == READY_DELAY) {
+		usleep(work.ready_ms * 1000UL);
+		*ms = work.ready_ms;
+		return 0;
+	}
+
+	while((left = (long)(start + work.ready_ms) - (long)now_ms()) > 0) {
+		if(serial_read_timeout(&(work).sport, &b, 1, left) != 1) {
+			break;
+		}
+		*ms = now_ms() - start;
+		switch(work.ready) {
+			case READY_ANY:
+				return 0;
+			case READY_BYTE:
+				if(b == work.ready_byte) {
+					return 0;
+				}
+				break;
+			case READY_BANNER:
+				if(have == len) {
+					memmove(window, window + 1, len - 1);
+					have--;
+				}
+				window[have++] = b;
+				if(have == len && memcmp(window, work.ready_banner, len) == 0) {
+					return 0;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	*ms = now_ms() - start;
+
+	return 1;
+}
+
+/*
+    Go task, just to flash base and start executing. If the stub is 
+    running it makes the jump, the ROM bootloader is gone by then. We 
+    return as soon as the application is up and report how long that took.
 */
 static void go_action(void)
 {
-	if(stm_go(&(work).sport, STM_FLASH_BASE) != 0) {
+	unsigned long start = now_us();
+	unsigned long ms = 0;
+	int ret;
+
+	if(work.stub.window) {
+		ret = stub_go(&(work).stub, work.dev.flash_base);
+		stub_close(&(work).stub);
+	} else {
+		ret = stm_go(&(work).sport, work.dev.flash_base);
+	}
+	if(ret != 0) {
 		work.micro_state = STM32_FAILED;
 		goto err;
 	}
 
-	sleep(5);
+	timing.ready = wait_ready(&ms) != 0 ? -1 : 1;
+	timing.ready_ms = ms;
 	work.task_state = TASK_SUCCESS;
 
 err:
+	timing.go_us = now_us() - start;
 	return;
 }
 
+/*
+    One line per command or phase that was seen: how many, the latency 
+    percentiles and how many of the commands failed, if any.
+*/
+static void print_hist(const char *name, const struct hist *h, 
+        unsigned long failed)
+{
+	if(h->count == 0) {
+		return;
+	}
+
+	fprintf(stdout, "timing: %-6s %6lu x, p50 %u us, p90 %u us, p99 %u us, "
+		"max %u us, mean %u us", name, h->count, hist_percentile(h, 50), 
+		hist_percentile(h, 90), hist_percentile(h, 99), h->max, 
+		hist_mean(h));
+	if(failed) {
+		fprintf(stdout, ", %lu failed", failed);
+	}
+	fprintf(stdout, "\n");
+}
+
+/*
+    Phase breakdown of the run for --timing, then the latency of each 
+    bootloader command and of the steps they are made of
+*/
+static void print_timing(void)
+{
+	const struct stm_metrics *m = stm_get_metrics();
+	const struct serial_stats *st = &(timing).serial;
+	unsigned long calls = st->reads + st->writes + st->polls;
+	unsigned long acks = timing.acks;
+	int i;
+
+	fprintf(stdout, "entry: reset %lu us (%lu gpio writes), sync %lu us, "
+		"%u probes%s\n", timing.entry.reset_us, timing.gpio_writes, 
+		timing.entry.sync_us, timing.entry.probes, 
+		timing.entry.was_synced ? ", was in sync" : "");
+	if(timing.have_serial) {
+		fprintf(stdout, "serial: %lu syscalls (%lu read, %lu write, %lu poll), "
+			"%lu ring hits, %lu.%02lu per step\n",
+			calls, st->reads, st->writes, st->polls, st->ring_hits,
+			acks ? calls / acks : 0, acks ? (calls * 100 / acks) % 100 : 0);
+	}
+	if(timing.ready < 0) {
+		fprintf(stdout, "ready: no sign of the app after %lu ms\n", 
+			timing.ready_ms);
+	} else if(timing.ready > 0) {
+		fprintf(stdout, "ready: app up after %lu ms\n", timing.ready_ms);
+	}
+
+	fprintf(stdout, "timing: reset %lu.%lu ms, init %lu.%lu ms, "
+		"erase %lu.%lu ms, write %lu.%lu ms, verify %lu.%lu ms, "
+		"go %lu.%lu ms\n",
+		timing.reset_us / 1000, timing.reset_us / 100 % 10,
+		timing.init_us / 1000, timing.init_us / 100 % 10,
+		timing.erase_us / 1000, timing.erase_us / 100 % 10,
+		timing.write_us / 1000, timing.write_us / 100 % 10,
+		timing.verify_us / 1000, timing.verify_us / 100 % 10,
+		timing.go_us / 1000, timing.go_us / 100 % 10);
+
+	for(i = 0; i < STM_M_CMDS; i++) {
+		print_hist(stm_metric_cmd_name(i), &m->cmd[i], m->failed[i]);
+	}
+	for(i = 0; i < STM_P_PHASES; i++) {
+		print_hist(stm_metric_phase_name(i), &m->phase[i], 0);
+	}
+
+	fprintf(stdout, "timing: %lu NACKs, %lu timeouts, %lu retries\n",
+		m->nacks, m->timeouts, m->retries);
+}
+
 /*
     In interactive mode read a command from stdin.
 */
@@ -486,12 +1021,42 @@ done:
 }
 
 /* 
-    Read task, we can read the firmware from the STM32 and save to a file.
-    Not implemented.
+    Read task, dump the STM32 flash to a file. By default this is the whole 
+    flash of the part we probed, --addr and --len pick a range. The file is 
+    written through a memory mapping and we report the throughput when done.
 */
 static void read_action(void)
 {
-	LOG("Flash read not implemented");
+	uint32_t addr = work.read_addr ? work.read_addr : work.dev.flash_base;
+	uint32_t end = work.dev.flash_base + work.dev.flash_size;
+	struct flash_dump dump = {
+		.path = work.filename,
+		.dev = &(work).dev,
+		.addr = addr,
+		.len = work.read_len ? work.read_len : 
+			(addr < end ? end - addr : 0),
+		.holes = work.holes,
+		.progress = update_progress,
+		.link = {
+			.reset = work.reset ? reset_bootloader : NULL,
+		},
+	};
+	struct stm_link_stats before, after;
+
+	serial_reset_stats(&(work).sport);
+	stm_get_link_stats(&before);
+	if(flash_dump(&(work).sport, &dump) != 0) {
+		work.micro_state = STM32_FAILED;
+		work.task_state = TASK_FAILED;
+		return;
+	}
+	stm_get_link_stats(&after);
+
+	fprintf(stdout, "read: %u bytes in %lu ms (%lu B/s), %lu bytes of holes, %s\n",
+		dump.len, dump.ms, dump.ms ? dump.len * 1000UL / dump.ms : 0,
+		dump.hole_bytes, serial_baud_key_to_str(work.sport.baud_rate));
+	save_serial_stats(after.acks - before.acks);
+
 	work.task_state = TASK_SUCCESS;
 }
 
@@ -537,26 +1102,15 @@ static int start(void)
     
     work.task_state = TASK_SUCCESS;
 
+	if(work.timing) {
+		print_timing();
+	}
+
 deinit:
     micro_deinit();
 	return work.task_state;
 }
 
-/*
-    Stub for write action.
-*/
-//static void write_file(uint8_t *data, int size)
-//{
-	//FILE *fp;
-	//ssize_t r;
-	
-	//fp = fopen("flash.bin", "w+b");
-	
-	//r = fwrite(data, sizeof(uint8_t), size, fp);
-	
-	//printf("%s: wrote %d bytes \n", __func__, r);
-//}
-
 /* 
     Application entry point 
 */
@@ -582,6 +1136,22 @@ int main(int argc, char **argv)
 	if (parse_options(argc, argv) != 0) {
 		goto close;
 	}
+
+	/* SIGUSR1 dumps the trace so far without stopping the run */
+	if(work.trace_path) {
+		if(trace_open(work.trace_path, 0) != 0) {
+			LOG("can't trace to '%s'", work.trace_path);
+			goto close;
+		}
+		sig_act.sa_sigaction = trace_sig_handler;
+		if (sigaction(SIGUSR1, &sig_act, NULL) < 0) {
+			perror ("sigaction");
+			goto close;
+		}
+	}
+
+	/* Until the micro is probed assume the default geometry */
+	stm_dev_default(&(work).dev);
 	
 	if(work.task == FLASH_HELP || work.task == FLASH_NONE) {
 		display_help(argv[0]);
@@ -601,6 +1171,7 @@ int main(int argc, char **argv)
 	ret = start();
 
 close:
+	trace_close();
 
 	return ret;
 }
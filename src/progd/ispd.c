@@ -6,7 +6,9 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <termios.h>
 
 #include "common_p.h"
 #include "server_p.h"
@@ -14,6 +16,9 @@
 #include "serial.h"
 #include "gpio.h"
 #include "stm32.h"
+#include "flash.h"
+#include "stub.h"
+#include "trace.h"
 
 /* Uncomment for full debugging */
 //#define DEBUG
@@ -42,6 +47,8 @@ struct socket_status {
     int addr_family;
     int port;
     char *socket_path;
+    unsigned short metrics_port;    /* 0 for no metrics socket */
+    char *trace_path;               /* NULL for no tracing */
 };
 
 /*
@@ -50,6 +57,12 @@ struct socket_status {
 struct micro_status {
     stm32_state_t micro_state;
     char *fw_path;
+    int sparse;
+    int delta;
+    int verify;
+    char *mirror_dir;
+    char *stub_path;
+    uint32_t stub_baud;
     int ver_major;
     int ver_minor;
     int ver_patch;
@@ -60,26 +73,39 @@ struct micro_status {
 */
 static struct isp_status{
     int running;
+    uint32_t autobaud;
+    unsigned int reset_pulse_us;
     struct socket_status sock_status;
     struct serial_port_options sport_opts;
+    struct stm32_dev dev;
     struct micro_status m_status;
 } isp_status = {
     .running        = 0,
+    .autobaud       = 0,
+    .reset_pulse_us = GPIO_RESET_PULSE_US,
     .sock_status = {
         .server_fd      = 0,
         .client_fd      = 0,
         .addr_family    = 0,
         .port           = 0,
         .socket_path    = ISPD_UNIX_SOCKET, 
+        .metrics_port   = 0,
+        .trace_path     = NULL,
     },
     .sport_opts = {
         .fd         = 0,
         .device     = TTY_DEV,
-        .baud_rate  = 57600,
+        .baud_rate  = B57600,
     },
     .m_status = {
         .micro_state    = STM32_IDLE,
         .fw_path        = "/home/root/main.bin",
+        .sparse         = 1,
+        .delta          = 0,
+        .verify         = 0,
+        .mirror_dir     = ISPD_MIRROR_DIR,
+        .stub_path      = NULL,
+        .stub_baud      = 0,
         .ver_major      = 0,
         .ver_minor      = 0,
         .ver_patch      = 0,
@@ -134,6 +160,7 @@ static void process_cmd(char *buf)
     }
 
     handle_cmd(cmd);
+    ispd_metrics_nacks(stm_get_metrics()->nacks);
 }
 
 /*
@@ -150,7 +177,8 @@ static void handle_cmd(ispd_cmd_t cmd)
             cmd_version();
             break;
         case MU:
-            cmd_update();
+            ispd_metrics_update_begin();
+            ispd_metrics_update_end(cmd_update() == 0);
             break;
         case MQ:
             cmd_quit();
@@ -164,34 +192,66 @@ static void handle_cmd(ispd_cmd_t cmd)
     Reset the STM32. To put the STM32 in reset pull the boot pin high, 
     and toggle the reset pin. This will bring the STM32 up in bootloader mode.
     To return the STM32 to normal, pull the boot pin low and toggle the reset pin.
+    The bootloader isn't waited for here, stm_sync() probes until it answers.
 */
 static void reset_micro(pin_state s)
 {
+    unsigned long start = trace_begin();
+
     LOG("%s %d", __func__, s);
-	gpio_toggle_boot(s);
-	sleep(1);
-	gpio_toggle_reset(LOW);
-	sleep(1);
-	gpio_toggle_reset(HIGH);
-	sleep(1);
+    gpio_reset_pulse(s, GPIO_BOOT_SETUP_US, isp_status.reset_pulse_us);
+    trace_end("gpio", s == HIGH ? "reset to bootloader" : "reset to app",
+        start, s);
+}
+
+/*
+    Reset callback for the link code, bring the STM32 up in the bootloader
+*/
+static void reset_bootloader(void *arg)
+{
+    reset_micro(HIGH);
 }
 
 /* 
     Set up the STM32 in bootloader mode. Here we init the GPIO port 
-    and send the STM32 an init byte. 
+    and send the STM32 init bytes until it answers. With autobaud set we 
+    look for the fastest rate the bootloader syncs to.
 */
 static void micro_init(void)
 {
+    struct stm_entry_stats entry;
+
     LOG("%s", __func__);
 	if(gpio_init() != 0) {
 	    LOG("gpio init failed!");
 	}
-	reset_micro(HIGH);
 
-	if(stm_init_seq(&(isp_status.sport_opts)) != 0) {
+    if(isp_status.autobaud) {
+        if(stm_autobaud(&(isp_status.sport_opts), isp_status.autobaud,
+                    reset_bootloader, NULL) != 0) {
+            isp_status.m_status.micro_state = STM32_FAILED;
+        }
+        fprintf(stdout, "[ISPD] baud %s\n",
+            serial_baud_key_to_str(isp_status.sport_opts.baud_rate));
+    } else if(stm_relink(&(isp_status.sport_opts),
+                isp_status.sport_opts.baud_rate, reset_bootloader, NULL) != 0) {
         isp_status.m_status.micro_state = STM32_FAILED;
     }
 
+    stm_get_entry_stats(&entry);
+    fprintf(stdout, "[ISPD] entry: reset %lu us, sync %lu us, %u probes\n",
+        entry.reset_us, entry.sync_us, entry.probes);
+    ispd_metrics_entry(entry.reset_us + entry.sync_us);
+
+    /* Find out what we are talking to, fall back to the old defaults */
+    if(stm_probe(&(isp_status.sport_opts), &(isp_status.dev)) != 0) {
+        LOG("probe failed, using default geometry");
+        stm_dev_default(&(isp_status.dev));
+    }
+    fprintf(stdout, "[ISPD] %s, %u KB flash, %u byte pages\n",
+        isp_status.dev.info ? isp_status.dev.info->name : "unknown part",
+        isp_status.dev.flash_size / 1024, isp_status.dev.page_size);
+
     LOG("STM32_READY");
     isp_status.m_status.micro_state = STM32_READY;
 }
@@ -257,70 +317,164 @@ err:
     return;
 }
 
+/*
+    Work out where the flash mirror and the update journal for the attached
+    STM32 live. The files are named after the 96 bit unique ID so each
+    board gets its own, path gets the name without an extension.
+*/
+static int board_path(char *path, size_t size, uint8_t uid[STM_UID_SIZE])
+{
+    const char *dir = isp_status.m_status.mirror_dir;
+    int i, n;
+
+    if(dir == NULL) {
+        return 1;
+    }
+
+    if(stm_get_uid(&(isp_status).sport_opts, uid) != 0) {
+        LOG("%s: can't read UID, no mirror", __func__);
+        return 1;
+    }
+
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        LOG("%s: can't create '%s'", __func__, dir);
+        return 1;
+    }
+
+    n = snprintf(path, size, "%s/", dir);
+    for(i = 0; i < STM_UID_SIZE; i++) {
+        n += snprintf(path + n, size - n, "%02x", uid[i]);
+    }
+
+    return 0;
+}
+
+/*
+    Progress callback for the flash engine. Update the Qml status element
+    with the number of 256 byte blocks left, and the metrics with what
+    has been written so far.
+*/
+static void update_progress(void *arg, int remaining)
+{
+    struct flash_job *job = arg;
+    char msg[32];
+
+    sprintf(msg,"txtStatus.text=%d\n", remaining);
+    ispd_socket_write(isp_status.sock_status.client_fd, msg);
+
+    ispd_metrics_update_progress(job->stats.blocks_written * MAX_RW_SIZE);
+    ispd_metrics_nacks(stm_get_metrics()->nacks);
+}
+
 /* 
     Update command, update the firmware on the STM32. This reads a file 
     from the filesystem and writes it to the STM32. The STM32 accepts 
     256 bytes for each write so we divide the file size by 256 to give 
-    us an ops count and use this to notify Qml of the progress.
+    us an ops count and use this to notify Qml of the progress. We always 
+    erase the pages the image covers first, so with sparse set blocks that 
+    are all 0xFF are skipped. In delta mode pages that already match the
+    image are not touched. An update that is cut off is picked up where it
+    stopped next time, from a journal of the pages the board ACKed. We 
+    keep a mirror of what we wrote to each board, when it is still good 
+    only the pages that changed since are written.
+    With verify set the flash is read back after writing and the mirror
+    is only kept when it matches. With a stub configured the update goes
+    through it and the micro is reset back into the ROM bootloader after.
 */
 static int cmd_update(void)
 {
-	FILE *fp;
-	ssize_t r;
-	long size;
-	uint8_t tmp[MAX_RW_SIZE];
-	uint32_t addr = STM_FLASH_BASE;
-	unsigned int i;
-    unsigned int num_ops;
+    struct micro_status *micro = &(isp_status).m_status;
+    struct flash_job job = {
+        .path = micro->fw_path,
+        .dev = &(isp_status).dev,
+        .mode = micro->delta ? FLASH_MODE_DELTA : FLASH_MODE_FULL,
+        .sparse = micro->sparse,
+        .verify = micro->verify,
+        .progress = update_progress,
+        .link = {
+            .reset = reset_bootloader,
+        },
+    };
+    struct stub_session stub;
+    uint32_t baud = isp_status.sport_opts.baud_rate;
+    uint8_t uid[STM_UID_SIZE];
+    char base[256], path[272], journal[272];
     int ret;
-    char msg[32];
 
     /* Notify Qml we are updating */
     ispd_notify_client(MSG_UPDATING);
-	fp = fopen(isp_status.m_status.fw_path, "rb");
-	if(fp == NULL) {
-		LOG("File '%s' not found!", isp_status.m_status.fw_path);
-		return 1;
-	}
 
-	fseek (fp , 0 , SEEK_END);
-	size = ftell (fp);
-	rewind (fp);
+    if(board_path(base, sizeof(base), uid) == 0) {
+        snprintf(path, sizeof(path), "%s.mirror", base);
+        snprintf(journal, sizeof(journal), "%s.journal", base);
+        job.mirror_path = path;
+        job.journal_path = journal;
+        job.uid = uid;
+    }
 
-    /* How many 256 byte chunks we have */
-    num_ops = size / MAX_RW_SIZE;
-    
-	LOG("%s: file size is %ld; ops = %d. fw = %s\n", __func__,
-            size,
-            num_ops,
-            isp_status.m_status.fw_path);
+    if(micro->stub_path) {
+        if(stub_load(&(isp_status).sport_opts, &(isp_status).dev,
+                    micro->stub_path, &stub) != 0 ||
+                (micro->stub_baud &&
+                    stub_set_baud(&stub, micro->stub_baud) != 0)) {
+            LOG("%s: stub failed", __func__);
+            stub_close(&stub);
+            stm_relink(&(isp_status).sport_opts, baud, reset_bootloader, NULL);
+            return 1;
+        }
+        job.stub = &stub;
+    }
 
-    /* Need to erase before we update */
-	if(stm_erase_mem(&(isp_status).sport_opts) != 0) {
+    job.progress_arg = &job;
+    ret = flash_update(&(isp_status).sport_opts, &job);
+    ispd_metrics_update_progress(job.stats.blocks_written * MAX_RW_SIZE);
+
+    if(job.stub) {
+        fprintf(stdout, "[ISPD] stub: %lu frames, %lu resent, %lu NAKs, "
+            "%lu timeouts\n", stub.stats.frames, stub.stats.resent,
+            stub.stats.naks, stub.stats.timeouts);
+        stub_close(&stub);
+        /* Back to the ROM for the commands that follow */
+        if(stm_relink(&(isp_status).sport_opts, baud, reset_bootloader,
+                    NULL) != 0) {
+            isp_status.m_status.micro_state = STM32_FAILED;
+        }
+    }
+
+    if(ret != 0) {
+        LOG("%s: update failed", __func__);
+        if(job.stats.verify_bad_pages) {
+            fprintf(stdout, "[ISPD] verify failed, %u bad pages\n",
+                job.stats.verify_bad_pages);
+        }
         return 1;
-	}
+    }
 
-	r = fread (tmp,1,MAX_RW_SIZE,fp);
-	while (r > 0) {
-		if(r < MAX_RW_SIZE) {
-			LOG("\n%s: padding buffer, read %d", __func__, r);
-			for(i = r; i < MAX_RW_SIZE; i++) {
-				tmp[i] = 0xFF;
-			}
-		}
-		LOG("\n%s: writing %d bytes to flash", __func__, MAX_RW_SIZE);
-		ret = stm_write_mem(&(isp_status).sport_opts, addr,tmp, MAX_RW_SIZE);
-		addr += r;
-
-        /* Update the Qml status element */
-        sprintf(msg,"txtStatus.text=%d\n", num_ops--);
-        ispd_socket_write(isp_status.sock_status.client_fd, msg);
-
-		r = fread (tmp,1,MAX_RW_SIZE,fp);
-	}
+    if(job.link.relinks) {
+        fprintf(stdout, "[ISPD] link: %u relinks, %u downshifts, now %s\n",
+            job.link.relinks, job.link.downshifts,
+            serial_baud_key_to_str(isp_status.sport_opts.baud_rate));
+    }
+
+    if(job.verify) {
+        fprintf(stdout, "[ISPD] verify: %lu bytes in %lu ms, write pass %lu ms\n",
+            job.stats.verify_bytes, job.stats.verify_ms, job.stats.write_ms);
+    }
+
+    if(job.stats.pipe_stalls) {
+        fprintf(stdout, "[ISPD] pipeline: link waited on the file %u times\n",
+            job.stats.pipe_stalls);
+    }
+
+    if(job.stats.pages_resumed) {
+        fprintf(stdout, "[ISPD] resumed: %u pages done by the last update\n",
+            job.stats.pages_resumed);
+    }
+
+    fprintf(stdout, "[ISPD] update: %u pages, %u skipped, %u erased, %u written%s\n",
+        job.stats.pages, job.stats.pages_skipped, job.stats.pages_erased,
+        job.stats.pages_written, job.stats.mirror_hit ? " (mirror)" : "");
 
-	fclose (fp);
-	
     /* Notify Qml the update is complete */
     ispd_notify_client(MSG_COMPLETE);
 	return 0;
@@ -345,6 +499,121 @@ void ispd_sig_handler(int sig)
     isp_status.running = 0;
 }
 
+/*
+    SIGUSR1, write the trace out. The main loop does it once select()
+    returns, or the next span does if an update is running.
+*/
+void ispd_trace_sig_handler(int sig)
+{
+    trace_request_dump();
+}
+
+/*
+    Show command line options
+*/
+static void display_help(char *prog_name)
+{
+    fprintf(stdout, "Usage: %s [options]\n", prog_name);
+    fprintf(stdout, "  Program external micro on request\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -b baud_rate          Set baud rate (default:%s)\n",
+        serial_baud_key_to_str(isp_status.sport_opts.baud_rate));
+    fprintf(stdout, "  -a max_baud_rate      Negotiate the fastest baud rate up to max_baud_rate\n");
+    fprintf(stdout, "  -t tty_device         Set serial dev (default:%s)\n",
+        isp_status.sport_opts.device);
+    fprintf(stdout, "                        or tcp:host:port, pty:path, loop:\n");
+    fprintf(stdout, "  -f filename           Firmware file (default:%s)\n",
+        isp_status.m_status.fw_path);
+    fprintf(stdout, "  -d                    Delta update, only rewrite pages that differ\n");
+    fprintf(stdout, "  -V                    Verify flash after writing\n");
+    fprintf(stdout, "  -P                    Send a command and its address before waiting for the ACKs\n");
+    fprintf(stdout, "  -R us                 Reset pulse length (default:%u)\n",
+        isp_status.reset_pulse_us);
+    fprintf(stdout, "  -G backend            Reset and boot pins: expander[:i2c_dev],\n"
+                    "                        gpiochip:chip_dev:boot_line,reset_line,\n"
+                    "                        modem[:boot,reset] (rts/dtr, ! inverts) or mock\n"
+                    "                        (default:expander:%s)\n", I2C_DEV);
+    fprintf(stdout, "  -S filename           Update through a flash loader stub run from SRAM\n");
+    fprintf(stdout, "  -B baud_rate          Rate to switch to once the stub is up\n");
+    fprintf(stdout, "  -m directory          Flash mirror directory (default:%s)\n",
+        ISPD_MIRROR_DIR);
+    fprintf(stdout, "  -N                    Don't keep a flash mirror\n");
+    fprintf(stdout, "  -M port               Serve Prometheus metrics over HTTP on port\n");
+    fprintf(stdout, "  -T filename           Trace to a Chrome trace-event file, written on\n"
+                    "                        SIGUSR1 and at exit\n");
+    fprintf(stdout, "  -h                    Display this help and exit\n");
+    fprintf(stdout, "\n");
+}
+
+/*
+    Parse command line args.
+*/
+static int parse_options(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "hdVPb:a:t:f:m:NS:B:R:G:M:T:")) != -1) {
+        switch(c) {
+            case 'b':
+                isp_status.sport_opts.baud_rate = serial_baud_str_to_key(optarg);
+                break;
+            case 'a':
+                isp_status.autobaud = serial_baud_str_to_key(optarg);
+                isp_status.sport_opts.baud_rate = isp_status.autobaud;
+                break;
+            case 't':
+                isp_status.sport_opts.device = strdup(optarg);
+                break;
+            case 'f':
+                isp_status.m_status.fw_path = strdup(optarg);
+                break;
+            case 'd':
+                isp_status.m_status.delta = 1;
+                break;
+            case 'V':
+                isp_status.m_status.verify = 1;
+                break;
+            case 'P':
+                stm_set_send_ahead(1);
+                break;
+            case 'R':
+                isp_status.reset_pulse_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'G':
+                if(gpio_select(optarg) != 0) {
+                    fprintf(stderr, "unknown gpio backend '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                isp_status.m_status.stub_path = strdup(optarg);
+                break;
+            case 'B':
+                isp_status.m_status.stub_baud = serial_baud_str_to_key(optarg);
+                break;
+            case 'm':
+                isp_status.m_status.mirror_dir = strdup(optarg);
+                break;
+            case 'N':
+                isp_status.m_status.mirror_dir = NULL;
+                break;
+            case 'M':
+                isp_status.sock_status.metrics_port = strtoul(optarg, NULL, 0);
+                break;
+            case 'T':
+                isp_status.sock_status.trace_path = strdup(optarg);
+                break;
+            case 'h':
+            default:
+                display_help(argv[0]);
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
 /*
     Application entry point
 */
@@ -358,6 +627,13 @@ int main(int argc, char **argv)
     struct serial_port_options *sport = &(isp_status).sport_opts;
     struct micro_status *micro = &(isp_status).m_status;
 
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+
+    /* Until the micro is probed assume the default geometry */
+    stm_dev_default(&(isp_status.dev));
+
     {
         /* install a signal handler to remove the socket file */
         struct sigaction a;
@@ -369,12 +645,23 @@ int main(int argc, char **argv)
         if (sigaction(SIGTERM, &a, 0) != 0) {
             log_die_with_system_message("[ISPD] sigaction(SIGTERM) failed, ");
         }
+        if(sock->trace_path) {
+            if(trace_open(sock->trace_path, 0) != 0) {
+                log_die_with_system_message("[ISPD] trace open failed");
+            }
+            a.sa_handler = ispd_trace_sig_handler;
+            if (sigaction(SIGUSR1, &a, 0) != 0) {
+                log_die_with_system_message("[ISPD] sigaction(SIGUSR1) failed, ");
+            }
+        }
     }
 
     /* Init the serial port */
-    if((sport->fd = serial_init(sport)) < 0) {
+    if(serial_init(sport) < 0) {
         log_die_with_system_message("serial init failed");
     }
+    /* The modem lines backend drives the port opened above */
+    gpio_modem_set_fd(sport->fd);
 
     /* Expose a server socket for Qml */
     if((sock->server_fd = ispd_socket_init(0, &(sock->addr_family),  
@@ -382,6 +669,11 @@ int main(int argc, char **argv)
         log_die_with_system_message("socket init failed");
     }
 
+    /* Metrics get a socket of their own, served from another thread */
+    if(sock->metrics_port && ispd_metrics_start(sock->metrics_port) != 0) {
+        log_die_with_system_message("metrics socket init failed");
+    }
+
     /* 
         We really don't need a select set but set one up anyway, we may use it 
         down the road. 
@@ -405,7 +697,9 @@ int main(int argc, char **argv)
         if (sel == -1) {
             if (errno == EINTR) {
                 LOG("Select returned EINTR");
-                break;  /* drop out of inner while */
+                /* SIGUSR1 wants the trace, anything else is a stop */
+                trace_poll();
+                continue;
             } else {
                 log_die_with_system_message("select() returned -1");
             }
@@ -424,6 +718,7 @@ int main(int argc, char **argv)
             FD_CLR(sock->server_fd, &cur_fdset);
             FD_SET(sock->client_fd, &cur_fdset);
             nfds = MAX(sock->client_fd, sport->fd);
+            ispd_metrics_session();
             LOG("New connection, say Hello");
             /* Notify Qml we are here and ready to go */
             ispd_notify_client(MSG_READY);
@@ -431,9 +726,10 @@ int main(int argc, char **argv)
 
         /* check for packet received on the client socket */
         if((sock->client_fd >= 0) && (FD_ISSET(sock->client_fd, &read_fdset))) {
-            char msg_buf[CMD_SIZE];
+            /* ispd_socket_read() terminates what it read, leave room */
+            char msg_buf[CMD_SIZE + 1];
             read_count = ispd_socket_read(sock->client_fd, msg_buf,
-                                                    sizeof(msg_buf));
+                                                    sizeof(msg_buf) - 1);
             if (read_count < 0) {
                 LOG("Client closed socket");
                 /* The client is gone. Clear that fd from the select set 
@@ -463,6 +759,9 @@ int main(int argc, char **argv)
         micro_deinit();
     }
 
+    ispd_metrics_stop();
+    trace_close();
+
     if(sock->server_fd) {
         close(sock->server_fd);
     }
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "server_p.h"
+#include "log.h"
+
+/* Uncomment for full debugging */
+//#define DEBUG
+#ifdef DEBUG
+#define LOG(format, ...) printf(format "\n" , ##__VA_ARGS__);
+#else
+#define LOG(format, ...)
+#endif
+
+/*
+    How long the metrics thread sleeps in poll() before it checks if it
+    should stop, and how long a scraper gets to send its request.
+*/
+#define METRICS_POLL_MS     500
+#define METRICS_RECV_MS     1000
+
+/*
+    Counters and gauges for the metrics socket. The main loop updates
+    them as it goes, the metrics thread takes a copy under the lock and
+    formats that, so a scrape never holds up an update.
+*/
+static struct ispd_metrics {
+    unsigned long sessions;
+    unsigned long reconnects;
+    unsigned long updates;
+    unsigned long updates_ok;
+    unsigned long updates_failed;
+    unsigned long long bytes_written;
+    unsigned long long update_ms;       /* all updates, for the average */
+    unsigned long last_update_ms;
+    unsigned long last_update_bytes;
+    unsigned long reset_to_ready_us;
+    unsigned long nacks;
+    int updating;
+    unsigned long update_start_ms;
+    unsigned long update_bytes;         /* written so far by this update */
+} metrics;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t metrics_thread;
+static int metrics_fd = -1;
+static volatile int metrics_running;
+
+static unsigned long metrics_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+    A client connected to the command socket. Every one after the first
+    is a reconnect.
+*/
+void ispd_metrics_session(void)
+{
+    pthread_mutex_lock(&metrics_lock);
+    if(metrics.sessions++) {
+        metrics.reconnects++;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void ispd_metrics_update_begin(void)
+{
+    pthread_mutex_lock(&metrics_lock);
+    metrics.updates++;
+    metrics.updating = 1;
+    metrics.update_start_ms = metrics_now_ms();
+    metrics.update_bytes = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+    Bytes the update in progress has written so far
+*/
+void ispd_metrics_update_progress(unsigned long bytes)
+{
+    pthread_mutex_lock(&metrics_lock);
+    metrics.update_bytes = bytes;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+    The update is over, bytes is what the last progress report said
+*/
+void ispd_metrics_update_end(int ok)
+{
+    unsigned long bytes, ms;
+
+    pthread_mutex_lock(&metrics_lock);
+    ms = metrics_now_ms() - metrics.update_start_ms;
+    bytes = metrics.update_bytes;
+    if(ok) {
+        metrics.updates_ok++;
+    } else {
+        metrics.updates_failed++;
+    }
+    metrics.bytes_written += bytes;
+    metrics.update_ms += ms;
+    metrics.last_update_ms = ms;
+    metrics.last_update_bytes = bytes;
+    metrics.updating = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+    From the reset to the bootloader answering the last time the micro
+    was brought up
+*/
+void ispd_metrics_entry(unsigned long us)
+{
+    pthread_mutex_lock(&metrics_lock);
+    metrics.reset_to_ready_us = us;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+    NACKs from the bootloader since ispd started
+*/
+void ispd_metrics_nacks(unsigned long nacks)
+{
+    pthread_mutex_lock(&metrics_lock);
+    metrics.nacks = nacks;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+    Append one metric with its HELP and TYPE lines. Returns the new
+    length, output that doesn't fit is dropped.
+*/
+static int metrics_add(char *buf, size_t size, int n, const char *name,
+    const char *type, const char *help, const char *fmt, ...)
+{
+    va_list ap;
+    int r, len = n;
+
+    r = snprintf(buf + len, size - len, "# HELP %s %s\n# TYPE %s %s\n%s ",
+        name, help, name, type, name);
+    if(r < 0 || len + r >= (int)size) {
+        goto full;
+    }
+    len += r;
+
+    va_start(ap, fmt);
+    r = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    if(r < 0 || len + r + 1 >= (int)size) {
+        goto full;
+    }
+    len += r;
+    buf[len++] = '\n';
+    buf[len] = '\0';
+
+    return len;
+
+full:
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+    Format a copy of the metrics in the Prometheus text format. Current
+    throughput is that of the update in progress, or of the last one if
+    none is running.
+*/
+static int metrics_format(char *buf, size_t size)
+{
+    unsigned long long avg;
+    unsigned long cur, ms;
+    int n = 0;
+    struct ispd_metrics m;
+
+    pthread_mutex_lock(&metrics_lock);
+    m = metrics;
+    pthread_mutex_unlock(&metrics_lock);
+
+    if(m.updating) {
+        ms = metrics_now_ms() - m.update_start_ms;
+        cur = ms ? m.update_bytes * 1000ULL / ms : 0;
+    } else {
+        cur = m.last_update_ms ?
+            m.last_update_bytes * 1000ULL / m.last_update_ms : 0;
+    }
+    avg = m.update_ms ? m.bytes_written * 1000 / m.update_ms : 0;
+
+    n = metrics_add(buf, size, n, "ispd_sessions_total", "counter",
+        "Client connections accepted.", "%lu", m.sessions);
+    n = metrics_add(buf, size, n, "ispd_client_reconnects_total", "counter",
+        "Client connections after the first.", "%lu", m.reconnects);
+    n = metrics_add(buf, size, n, "ispd_updates_attempted_total", "counter",
+        "Firmware updates started.", "%lu", m.updates);
+    n = metrics_add(buf, size, n, "ispd_updates_succeeded_total", "counter",
+        "Firmware updates that completed.", "%lu", m.updates_ok);
+    n = metrics_add(buf, size, n, "ispd_updates_failed_total", "counter",
+        "Firmware updates that failed.", "%lu", m.updates_failed);
+    n = metrics_add(buf, size, n, "ispd_update_in_progress", "gauge",
+        "1 while an update is running.", "%d", m.updating);
+    n = metrics_add(buf, size, n, "ispd_bytes_written_total", "counter",
+        "Bytes written to flash.", "%llu", m.bytes_written);
+    n = metrics_add(buf, size, n, "ispd_throughput_bytes_per_second",
+        "gauge", "Write rate of the running or the last update.",
+        "%lu", cur);
+    n = metrics_add(buf, size, n, "ispd_throughput_avg_bytes_per_second",
+        "gauge", "Write rate over all updates.", "%llu", avg);
+    n = metrics_add(buf, size, n, "ispd_last_update_duration_seconds",
+        "gauge", "How long the last update took.", "%lu.%03lu",
+        m.last_update_ms / 1000, m.last_update_ms % 1000);
+    n = metrics_add(buf, size, n, "ispd_reset_to_ready_seconds", "gauge",
+        "Reset until the bootloader answered, last time.", "%lu.%06lu",
+        m.reset_to_ready_us / 1000000, m.reset_to_ready_us % 1000000);
+    n = metrics_add(buf, size, n, "ispd_bootloader_nacks_total", "counter",
+        "NACKs from the STM32 bootloader.", "%lu", m.nacks);
+
+    return n;
+}
+
+/*
+    Serve one scrape. Whatever was asked for, plain HTTP or nothing at
+    all from nc, the answer is the metrics.
+*/
+static void metrics_serve(int cfd)
+{
+    struct timeval tv = {
+        .tv_sec = METRICS_RECV_MS / 1000,
+        .tv_usec = METRICS_RECV_MS % 1000 * 1000,
+    };
+    char req[512], body[4096], hdr[128];
+    int n, len;
+
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* Only the request line and headers, we don't look at them */
+    n = recv(cfd, req, sizeof(req), 0);
+    LOG("%s: %d byte request", __func__, n);
+
+    len = metrics_format(body, sizeof(body));
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n\r\n", len);
+
+    if(send(cfd, hdr, n, MSG_NOSIGNAL) == n) {
+        send(cfd, body, len, MSG_NOSIGNAL);
+    }
+}
+
+static void *metrics_main(void *arg)
+{
+    struct pollfd pfd = { .fd = metrics_fd, .events = POLLIN };
+    int cfd;
+
+    while(metrics_running) {
+        if(poll(&pfd, 1, METRICS_POLL_MS) <= 0) {
+            continue;
+        }
+        cfd = accept(metrics_fd, NULL, NULL);
+        if(cfd < 0) {
+            continue;
+        }
+        metrics_serve(cfd);
+        close(cfd);
+    }
+
+    return NULL;
+}
+
+/*
+    Listen for scrapes on a TCP port of its own and serve them from a
+    thread, the command socket and the updates never wait on it.
+*/
+int ispd_metrics_start(unsigned short port)
+{
+    struct addrinfo hints, *info, *p;
+    char service[8];
+    int yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    snprintf(service, sizeof(service), "%u", port);
+    if(getaddrinfo(NULL, service, &hints, &info) != 0) {
+        return 1;
+    }
+
+    for(p = info; p != NULL; p = p->ai_next) {
+        metrics_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if(metrics_fd < 0) {
+            continue;
+        }
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if(bind(metrics_fd, p->ai_addr, p->ai_addrlen) == 0 &&
+                listen(metrics_fd, BACKLOG) == 0) {
+            break;
+        }
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+    freeaddrinfo(info);
+
+    if(metrics_fd < 0) {
+        return 1;
+    }
+
+    metrics_running = 1;
+    if(pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0) {
+        metrics_running = 0;
+        close(metrics_fd);
+        metrics_fd = -1;
+        return 1;
+    }
+
+    log_msg(LOG_INFO, "[ISPD] metrics on port %u\n", port);
+
+    return 0;
+}
+
+void ispd_metrics_stop(void)
+{
+    if(!metrics_running) {
+        return;
+    }
+
+    metrics_running = 0;
+    pthread_join(metrics_thread, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+}
@@ -15,6 +15,7 @@
 
 #include "server_p.h"
 #include "log.h"
+#include "trace.h"
 
 #define DEBUG
 #ifdef DEBUG
@@ -178,10 +179,11 @@ int ispd_socket_read(int sfd, char *msg, size_t buf_size)
 
 void ispd_socket_write(int sfd, const char *msg)
 {
+    unsigned long start = trace_begin();
     int cnt = strlen(msg);
 	
     if (send(sfd, msg, cnt, 0) != cnt) {
         perror("what's messed up?");
     }
-
+    trace_end("socket", "notify", start, cnt);
 }
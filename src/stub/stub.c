@@ -0,0 +1,456 @@
+#include <stdint.h>
+
+#include "stub_proto.h"
+
+/*
+    Flash loader stub for the STM32F3. isp uploads stub.bin to
+    STUB_LOAD_ADDR through the ROM bootloader and starts it with GO. It
+    carries on on the USART the bootloader was using, at the rate the
+    bootloader autobauded to, and speaks stub_proto.h. There is no C
+    library and no startup code beyond what is here, data lives in .bss
+    only and is cleared by hand.
+*/
+
+#define REG(addr)			(*(volatile uint32_t *)(addr))
+
+#define STUB_WINDOW			3
+#define STUB_PAYLOAD		(4 + 512)
+#define STUB_RX_SIZE		2048	/* power of 2, holds a whole window */
+
+#define FLASH_BASE			0x08000000
+#define FLASH_SIZE_REG		0x1FFFF7CC
+#define FLASH_PAGE_SIZE		0x800
+
+/* Flash controller */
+#define FLASH_R				0x40022000
+#define FLASH_KEYR			REG(FLASH_R + 0x04)
+#define FLASH_SR			REG(FLASH_R + 0x0C)
+#define FLASH_CR			REG(FLASH_R + 0x10)
+#define FLASH_AR			REG(FLASH_R + 0x14)
+#define FLASH_KEY1			0x45670123
+#define FLASH_KEY2			0xCDEF89AB
+#define FLASH_SR_BSY		(1 << 0)
+#define FLASH_SR_PGERR		(1 << 2)
+#define FLASH_SR_WRPERR		(1 << 4)
+#define FLASH_SR_EOP		(1 << 5)
+#define FLASH_CR_PG			(1 << 0)
+#define FLASH_CR_PER		(1 << 1)
+#define FLASH_CR_STRT		(1 << 6)
+#define FLASH_CR_LOCK		(1 << 7)
+
+/* USART, the bootloader only listens on USART1 and USART2 */
+#define USART1				0x40013800
+#define USART2				0x40004400
+#define USART_CR1			0x00
+#define USART_BRR			0x0C
+#define USART_ISR			0x1C
+#define USART_ICR			0x20
+#define USART_RDR			0x24
+#define USART_TDR			0x28
+#define USART_CR1_UE		(1 << 0)
+#define USART_CR1_RXNEIE	(1 << 5)
+#define USART_ISR_ORE		(1 << 3)
+#define USART_ISR_RXNE		(1 << 5)
+#define USART_ISR_TC		(1 << 6)
+#define USART_ISR_TXE		(1 << 7)
+#define USART_ICR_ORECF		(1 << 3)
+#define USART1_IRQ			37
+#define USART2_IRQ			38
+
+#define NVIC_ISER(n)		REG(0xE000E100 + 4 * (n))
+#define SCB_VTOR			REG(0xE000ED08)
+
+extern uint32_t _stack_top;
+extern uint32_t _bss_start;
+extern uint32_t _bss_end;
+
+static uint32_t usart;
+static volatile uint8_t rx_buf[STUB_RX_SIZE];
+static volatile uint32_t rx_head;
+static uint32_t rx_tail;
+static uint8_t frame[STUB_FRAME_MAX(STUB_PAYLOAD)];
+static uint8_t reply[STUB_FRAME_MAX(STUB_PAYLOAD)];
+static uint8_t expect;
+static uint8_t nak_sent;
+
+/* Nibble table CRC32, same answer as zlib in 64 bytes of table */
+static const uint32_t crc_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	crc = ~crc;
+	while(len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+	}
+
+	return ~crc;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+static void usart_irq(void)
+{
+	uint32_t isr = REG(usart + USART_ISR);
+
+	if(isr & USART_ISR_ORE) {
+		REG(usart + USART_ICR) = USART_ICR_ORECF;
+	}
+	if(isr & USART_ISR_RXNE) {
+		rx_buf[rx_head & (STUB_RX_SIZE - 1)] = REG(usart + USART_RDR);
+		rx_head++;
+	}
+}
+
+static uint8_t rx_byte(void)
+{
+	uint8_t b;
+
+	while(rx_tail == rx_head) {
+	}
+	b = rx_buf[rx_tail & (STUB_RX_SIZE - 1)];
+	rx_tail++;
+
+	return b;
+}
+
+static void tx(const uint8_t *p, uint32_t len)
+{
+	while(len--) {
+		while(!(REG(usart + USART_ISR) & USART_ISR_TXE)) {
+		}
+		REG(usart + USART_TDR) = *p++;
+	}
+}
+
+static void send(uint8_t type, uint8_t seq, const uint8_t *payload,
+        uint32_t len)
+{
+	uint32_t i;
+
+	reply[0] = STUB_SOF;
+	reply[1] = type;
+	reply[2] = seq;
+	reply[3] = len & 0xFF;
+	reply[4] = len >> 8;
+	for(i = 0; i < len; i++) {
+		reply[STUB_HDR_SIZE + i] = payload[i];
+	}
+	put_le32(&reply[STUB_HDR_SIZE + len],
+		crc32_update(0, &reply[1], STUB_HDR_SIZE - 1 + len));
+	tx(reply, STUB_FRAME_MAX(len));
+}
+
+static void status(uint8_t type, uint8_t seq, uint8_t st)
+{
+	send(type, seq, &st, 1);
+}
+
+/*
+    Flash programming. The controller is unlocked once at start up and
+    left that way until GO.
+*/
+static int flash_wait(void)
+{
+	uint32_t sr;
+
+	while(FLASH_SR & FLASH_SR_BSY) {
+	}
+	sr = FLASH_SR;
+	FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
+
+	return (sr & (FLASH_SR_PGERR | FLASH_SR_WRPERR)) ? 1 : 0;
+}
+
+static uint32_t flash_size(void)
+{
+	return (REG(FLASH_SIZE_REG) & 0xFFFF) * 1024;
+}
+
+static int flash_erase_page(uint32_t page)
+{
+	FLASH_CR |= FLASH_CR_PER;
+	FLASH_AR = FLASH_BASE + page * FLASH_PAGE_SIZE;
+	FLASH_CR |= FLASH_CR_STRT;
+	if(flash_wait() != 0) {
+		FLASH_CR &= ~FLASH_CR_PER;
+		return 1;
+	}
+	FLASH_CR &= ~FLASH_CR_PER;
+
+	return 0;
+}
+
+/*
+    Program by halfwords, an odd length gets an 0xFF pad byte
+*/
+static int flash_program(uint32_t addr, const uint8_t *p, uint32_t len)
+{
+	volatile uint16_t *dst = (volatile uint16_t *)addr;
+	uint16_t hw;
+	uint32_t i;
+
+	FLASH_CR |= FLASH_CR_PG;
+	for(i = 0; i < len; i += 2) {
+		hw = p[i] | (i + 1 < len ? p[i + 1] : 0xFF) << 8;
+		*dst = hw;
+		if(flash_wait() != 0 || *dst != hw) {
+			FLASH_CR &= ~FLASH_CR_PG;
+			return 1;
+		}
+		dst++;
+	}
+	FLASH_CR &= ~FLASH_CR_PG;
+
+	return 0;
+}
+
+static int in_flash(uint32_t addr, uint32_t len)
+{
+	return addr >= FLASH_BASE && len <= flash_size() &&
+		addr - FLASH_BASE <= flash_size() - len;
+}
+
+static void cmd_crc(uint8_t seq, const uint8_t *p, uint32_t len)
+{
+	uint8_t out[STUB_PAYLOAD];
+	uint32_t addr, n, chunk, piece, i = 0;
+
+	if(len != 12) {
+		status(STUB_NAK, seq, STUB_ERR_LEN);
+		return;
+	}
+	addr = get_le32(p);
+	n = get_le32(p + 4);
+	chunk = get_le32(p + 8);
+	if(chunk == 0 || (n + chunk - 1) / chunk * 4 > STUB_PAYLOAD) {
+		status(STUB_NAK, seq, STUB_ERR_LEN);
+		return;
+	}
+	if(!in_flash(addr, n)) {
+		status(STUB_NAK, seq, STUB_ERR_ADDR);
+		return;
+	}
+
+	while(n) {
+		piece = n < chunk ? n : chunk;
+		put_le32(&out[i], crc32_update(0, (const uint8_t *)addr, piece));
+		i += 4;
+		addr += piece;
+		n -= piece;
+	}
+	send(STUB_CRC, seq, out, i);
+}
+
+/*
+    Jump to addr as if it had just come out of reset, its vector table
+    holds the stack pointer and the entry point
+*/
+static void go(uint32_t addr)
+{
+	uint32_t sp = REG(addr), pc = REG(addr + 4);
+
+	while(!(REG(usart + USART_ISR) & USART_ISR_TC)) {
+	}
+	REG(usart + USART_CR1) &= ~USART_CR1_RXNEIE;
+	FLASH_CR |= FLASH_CR_LOCK;
+	SCB_VTOR = addr;
+	__asm__ volatile(
+		"msr msp, %0\n"
+		"bx %1\n"
+		: : "r" (sp), "r" (pc));
+}
+
+static void handle(uint8_t type, uint8_t seq, const uint8_t *p, uint32_t len)
+{
+	uint32_t addr, i, first, count;
+
+	switch(type) {
+		case STUB_PING:
+			break;
+		case STUB_BAUD:
+			if(len != 8 || get_le32(p) == 0) {
+				status(STUB_NAK, seq, STUB_ERR_LEN);
+				return;
+			}
+			/* ACK at the old rate, let it drain, then switch */
+			status(STUB_ACK, seq, STUB_OK);
+			while(!(REG(usart + USART_ISR) & USART_ISR_TC)) {
+			}
+			REG(usart + USART_CR1) &= ~USART_CR1_UE;
+			REG(usart + USART_BRR) = (uint32_t)((uint64_t)
+				REG(usart + USART_BRR) * get_le32(p + 4) / get_le32(p));
+			REG(usart + USART_CR1) |= USART_CR1_UE;
+			return;
+		case STUB_ERASE:
+			first = p[0] | p[1] << 8;
+			count = p[2] | p[3] << 8;
+			if(len != 4 || !in_flash(FLASH_BASE + first * FLASH_PAGE_SIZE,
+                    count * FLASH_PAGE_SIZE)) {
+				status(STUB_NAK, seq, STUB_ERR_ADDR);
+				return;
+			}
+			for(i = 0; i < count; i++) {
+				if(flash_erase_page(first + i) != 0) {
+					status(STUB_NAK, seq, STUB_ERR_FLASH);
+					return;
+				}
+			}
+			break;
+		case STUB_WRITE:
+			addr = get_le32(p);
+			if(len <= 4 || (addr & 1) || !in_flash(addr, len - 4)) {
+				status(STUB_NAK, seq, STUB_ERR_ADDR);
+				return;
+			}
+			if(flash_program(addr, p + 4, len - 4) != 0) {
+				status(STUB_NAK, seq, STUB_ERR_FLASH);
+				return;
+			}
+			break;
+		case STUB_CRC:
+			cmd_crc(seq, p, len);
+			return;
+		case STUB_GO:
+			if(len != 4) {
+				status(STUB_NAK, seq, STUB_ERR_LEN);
+				return;
+			}
+			status(STUB_ACK, seq, STUB_OK);
+			go(get_le32(p));
+			return;
+		default:
+			status(STUB_NAK, seq, STUB_ERR_LEN);
+			return;
+	}
+
+	status(STUB_ACK, seq, STUB_OK);
+}
+
+/*
+    One frame from the host. Frames are handled strictly in order, see
+    stub_proto.h.
+*/
+static void receive(void)
+{
+	uint32_t i, len;
+	uint8_t d;
+
+	while(rx_byte() != STUB_SOF) {
+	}
+	frame[0] = STUB_SOF;
+	for(i = 1; i < STUB_HDR_SIZE; i++) {
+		frame[i] = rx_byte();
+	}
+	len = frame[3] | frame[4] << 8;
+	if(len > STUB_PAYLOAD) {
+		/* Can't trust the header, hunt for the next SOF */
+		return;
+	}
+	for(i = 0; i < len + STUB_CRC_SIZE; i++) {
+		frame[STUB_HDR_SIZE + i] = rx_byte();
+	}
+
+	if(crc32_update(0, &frame[1], STUB_HDR_SIZE - 1 + len) !=
+            get_le32(&frame[STUB_HDR_SIZE + len])) {
+		if(!nak_sent) {
+			nak_sent = 1;
+			status(STUB_NAK, expect, STUB_ERR_CRC);
+		}
+		return;
+	}
+
+	d = frame[2] - expect;
+	if(d >= 0x80) {
+		/* Already done, only the answer went missing */
+		if(frame[1] == STUB_CRC) {
+			cmd_crc(frame[2], &frame[STUB_HDR_SIZE], len);
+		} else {
+			status(STUB_ACK, frame[2], STUB_OK);
+		}
+		return;
+	}
+	if(d != 0) {
+		if(!nak_sent) {
+			nak_sent = 1;
+			status(STUB_NAK, expect, STUB_ERR_SEQ);
+		}
+		return;
+	}
+
+	nak_sent = 0;
+	expect++;
+	handle(frame[1], frame[2], &frame[STUB_HDR_SIZE], len);
+}
+
+void stub_main(void)
+{
+	uint8_t hello[4] = {
+		STUB_VERSION, STUB_WINDOW, STUB_PAYLOAD & 0xFF, STUB_PAYLOAD >> 8,
+	};
+	uint32_t *p;
+
+	for(p = &_bss_start; p < &_bss_end; p++) {
+		*p = 0;
+	}
+
+	/* Whichever USART the bootloader synced on is the one enabled */
+	usart = (REG(USART1 + USART_CR1) & USART_CR1_UE) ? USART1 : USART2;
+
+	SCB_VTOR = STUB_LOAD_ADDR;
+	REG(usart + USART_ICR) = USART_ICR_ORECF;
+	REG(usart + USART_CR1) |= USART_CR1_RXNEIE;
+	if(usart == USART1) {
+		NVIC_ISER(USART1_IRQ / 32) = 1 << (USART1_IRQ % 32);
+	} else {
+		NVIC_ISER(USART2_IRQ / 32) = 1 << (USART2_IRQ % 32);
+	}
+	__asm__ volatile("cpsie i");
+
+	FLASH_KEYR = FLASH_KEY1;
+	FLASH_KEYR = FLASH_KEY2;
+
+	send(STUB_HELLO, 0, hello, sizeof(hello));
+
+	while(1) {
+		receive();
+	}
+}
+
+static void stub_fault(void)
+{
+	while(1) {
+	}
+}
+
+/*
+    The table goes first in the image, the bootloader's GO reads the stack
+    pointer and entry point from STUB_LOAD_ADDR. Only the USART interrupts
+    are ever enabled.
+*/
+__attribute__((section(".vectors"), used))
+static void (* const vectors[16 + USART2_IRQ + 1])(void) = {
+	[0] = (void (*)(void))&_stack_top,
+	[1] = stub_main,
+	[2 ... 15] = stub_fault,
+	[16 ... 16 + USART1_IRQ - 1] = stub_fault,
+	[16 + USART1_IRQ] = usart_irq,
+	[16 + USART2_IRQ] = usart_irq,
+};
@@ -0,0 +1,1122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stm32.h"
+#include "stub_proto.h"
+#include "crc32.h"
+
+/*
+    Stand-in for the STM32 USART bootloader on a pty. The name of the pty
+    goes to stdout, point isp or ispd at it with -t. Bytes are fed through
+    the same state machine the bootloader runs, two byte commands and all,
+    so frames sent out of order or before their ACK is due are rejected
+    like the real part would. -l delays every reply by the given number of
+    microseconds to stand in for USB serial and wakeup latency, replies
+    already in flight are not held up by later ones.
+
+    -B paces bytes both ways as a UART at that rate would, 10 bits each,
+    and -E and -W add page erase and half-word program times during which
+    input isn't looked at, so throughput numbers come out close to a real
+    part. -f and -p set the flash size and product ID the host probes.
+    -n, -d, -x and -s inject a NACK, a lost byte either way or a stall.
+
+    -T puts it on a TCP port on localhost instead, for the tcp: transport.
+    One host at a time, a new connection takes over from the old one.
+
+    Write and readout (un)protect act like they do on the part, they 
+    reset it and Readout Unprotect erases all of flash. A flashing run 
+    should never send one, the exit summary counts them.
+
+    A GO to STUB_LOAD_ADDR with something uploaded there starts the flash
+    loader stub instead, which speaks stub_proto.h until it is sent a GO
+    of its own. -c corrupts a stub frame on the way in to exercise resends.
+*/
+
+#define EMU_PID				0x422
+#define EMU_FLASH_SIZE		0x00040000
+#define EMU_FLASH_MAX		0x00080000
+#define EMU_SRAM_SIZE		0x00008000
+#define EMU_OUT_MAX			4096
+#define EMU_IN_MAX			(2 + 2 * 0x10000 + 1)
+#define EMU_STUB_WINDOW		3
+#define EMU_STUB_PAYLOAD	(4 + 512)
+
+static const uint8_t emu_cmds[] = {
+	STM_CMD_GET, STM_CMD_GET_VER, STM_CMD_GET_ID, STM_CMD_READ_MEM,
+	STM_CMD_GO, STM_CMD_WRITE_MEM, STM_CMD_ERASE_MEM_EXT,
+	STM_CMD_WRITE_PROTECT, STM_CMD_WRITE_UNPROTECT, STM_CMD_READ_PROTECT,
+	STM_CMD_READ_UNPROTECT,
+};
+
+typedef enum {
+	EMU_CMD,
+	EMU_CMD_CS,
+	EMU_ADDR,
+	EMU_READ_LEN,
+	EMU_WRITE_LEN,
+	EMU_WRITE_DATA,
+	EMU_ERASE_COUNT,
+	EMU_ERASE_MASS,
+	EMU_ERASE_LIST,
+	EMU_WP_COUNT,
+	EMU_WP_LIST,
+} emu_state_t;
+
+struct emu_stats {
+	unsigned long cmds;
+	unsigned long rx_bytes;
+	unsigned long tx_bytes;
+	unsigned long dropped;
+	unsigned long long busy_us;		/* erasing and programming */
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long pages_erased;
+	unsigned long nacks;
+	unsigned long injected;
+	unsigned long stub_frames;
+	unsigned long stub_naks;
+	unsigned long protect_cmds;		/* should never happen on a flashing run */
+	unsigned long mass_erases;
+};
+
+static struct {
+	int fd;
+	int verbose;
+	uint16_t pid;
+	uint32_t flash_size;
+	unsigned long latency_us;
+	unsigned long long byte_ns;		/* one byte on the wire, 0 for no pacing */
+	unsigned long erase_us;			/* per page */
+	unsigned long program_us;		/* per half-word */
+	unsigned long long rx_ns;		/* input handled up to here */
+	unsigned long long tx_ns;		/* output on the wire up to here */
+	unsigned long nack_at;			/* NACK this command, 0 for never */
+	unsigned long drop_in_at;		/* lose this byte from the host */
+	unsigned long drop_out_at;		/* lose this reply byte */
+	unsigned long stall_at;			/* go quiet before this command */
+	unsigned long stall_ms;
+	unsigned long corrupt_at;		/* corrupt this stub frame, 0 for never */
+	const char *banner;				/* the application's boot message */
+	int synced;
+	struct {
+		int running;
+		unsigned int window;
+		unsigned int max_payload;
+		uint8_t expect;				/* seq of the next frame to handle */
+		int nak_sent;				/* once per gap */
+		unsigned int have;
+		unsigned int need;
+	} stub;
+	emu_state_t state;
+	uint8_t cmd;
+	uint32_t addr;
+	uint8_t in[EMU_IN_MAX];
+	unsigned int have;
+	unsigned int need;
+	struct {
+		uint8_t byte;
+		unsigned long long due;
+	} out[EMU_OUT_MAX];
+	unsigned int out_head;
+	unsigned int out_tail;
+	uint8_t flash[EMU_FLASH_MAX];
+	uint8_t sram[EMU_SRAM_SIZE];
+	struct emu_stats stats;
+} emu;
+
+static volatile sig_atomic_t running = 1;
+
+static void emu_stub_start(void);
+
+static void emu_signal(int sig)
+{
+	running = 0;
+}
+
+static unsigned long long emu_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+    Queue reply bytes. The reply starts once the input it answers is in
+    and the latency has passed, or when the line is free again, and each
+    byte is due once it is all on the wire.
+*/
+static void emu_send(const uint8_t *buf, unsigned int len)
+{
+	unsigned long long due = emu.rx_ns + emu.latency_us * 1000ULL;
+
+	if(due < emu.tx_ns) {
+		due = emu.tx_ns;
+	}
+	while(len--) {
+		if(emu.out_head - emu.out_tail == EMU_OUT_MAX) {
+			fprintf(stderr, "emu: reply queue full\n");
+			return;
+		}
+		emu.stats.tx_bytes++;
+		due += emu.byte_ns;
+		if(emu.drop_out_at && emu.stats.tx_bytes == emu.drop_out_at) {
+			emu.stats.dropped++;
+			buf++;
+			continue;
+		}
+		emu.out[emu.out_head % EMU_OUT_MAX].byte = *buf++;
+		emu.out[emu.out_head % EMU_OUT_MAX].due = due;
+		emu.out_head++;
+	}
+	emu.tx_ns = due;
+}
+
+/*
+    The part is busy erasing or programming, nothing it has been sent is
+    looked at until it is done
+*/
+static void emu_busy(unsigned long long us)
+{
+	emu.rx_ns += us * 1000;
+	emu.stats.busy_us += us;
+}
+
+static void emu_set_baud(uint32_t speed)
+{
+	emu.byte_ns = speed ? 10 * 1000000000ULL / speed : 0;
+}
+
+static void emu_byte(uint8_t b)
+{
+	emu_send(&b, 1);
+}
+
+static void emu_ack(void)
+{
+	emu_byte(STM_ACK);
+}
+
+static void emu_nack(const char *why)
+{
+	if(emu.verbose) {
+		fprintf(stderr, "emu: NACK cmd 0x%02X, %s\n", emu.cmd, why);
+	}
+	emu.stats.nacks++;
+	emu_byte(STM_NACK);
+	emu.state = EMU_CMD;
+}
+
+static void emu_collect(emu_state_t state, unsigned int need)
+{
+	emu.state = state;
+	emu.have = 0;
+	emu.need = need;
+}
+
+/*
+    Memory the host can see. Returns NULL if [addr, addr + len) isn't all
+    in one region.
+*/
+static uint8_t *emu_mem(uint32_t addr, unsigned int len, int writing)
+{
+	static uint8_t sysmem[16];
+	uint32_t kb = emu.flash_size / 1024;
+	unsigned int i;
+
+	if(addr >= STM_FLASH_BASE &&
+            addr + len <= STM_FLASH_BASE + emu.flash_size) {
+		return &emu.flash[addr - STM_FLASH_BASE];
+	}
+	if(addr >= STM_SRAM_BASE && addr + len <= STM_SRAM_BASE + EMU_SRAM_SIZE) {
+		return &emu.sram[addr - STM_SRAM_BASE];
+	}
+	if(writing) {
+		return NULL;
+	}
+	if(addr >= STM_UID_ADDR && addr + len <= STM_UID_ADDR + STM_UID_SIZE) {
+		for(i = 0; i < STM_UID_SIZE; i++) {
+			sysmem[i] = i + 1;
+		}
+		return &sysmem[addr - STM_UID_ADDR];
+	}
+	if(addr >= STM_FLASH_SIZE_REG && addr + len <= STM_FLASH_SIZE_REG + 2) {
+		sysmem[0] = kb & 0xFF;
+		sysmem[1] = kb >> 8;
+		return &sysmem[addr - STM_FLASH_SIZE_REG];
+	}
+
+	return NULL;
+}
+
+static int emu_has_cmd(uint8_t cmd)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(emu_cmds); i++) {
+		if(emu_cmds[i] == cmd) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+    Write and readout (un)protect are done. The option bytes change and
+    the part resets, the host has to sync with it again.
+*/
+static void emu_protect(void)
+{
+	fprintf(stderr, "emu: %s command 0x%02X, reset%s\n",
+		emu.cmd == STM_CMD_READ_UNPROTECT ? "readout unprotect" : "protect",
+		emu.cmd, emu.cmd == STM_CMD_READ_UNPROTECT ? ", flash erased" : "");
+	emu.stats.protect_cmds++;
+	emu.synced = 0;
+	emu.state = EMU_CMD;
+}
+
+static void emu_write_protect(void)
+{
+	unsigned int i, n = emu.in[0];
+	uint8_t cs = 0;
+
+	for(i = 0; i < n + 2; i++) {
+		cs ^= emu.in[i];
+	}
+	if(cs != emu.in[n + 2]) {
+		emu_nack("write protect checksum");
+		return;
+	}
+
+	emu_ack();
+	emu_protect();
+}
+
+/*
+    Second byte of a command is in, the command itself starts here
+*/
+static void emu_command(void)
+{
+	uint8_t buf[2 + sizeof(emu_cmds)];
+
+	emu.stats.cmds++;
+	if(emu.stall_at && emu.stats.cmds == emu.stall_at) {
+		emu.stats.injected++;
+		emu.rx_ns += emu.stall_ms * 1000000ULL;
+	}
+	if(emu.nack_at && emu.stats.cmds == emu.nack_at) {
+		emu.stats.injected++;
+		emu_nack("injected");
+		return;
+	}
+
+	emu_ack();
+	switch(emu.cmd) {
+		case STM_CMD_GET:
+			buf[0] = sizeof(emu_cmds);
+			buf[1] = 0x31;
+			memcpy(&buf[2], emu_cmds, sizeof(emu_cmds));
+			emu_send(buf, sizeof(buf));
+			emu_ack();
+			emu.state = EMU_CMD;
+			break;
+		case STM_CMD_GET_VER:
+			/* Version and the two option bytes, which are always 0 */
+			buf[0] = 0x31;
+			buf[1] = 0x00;
+			buf[2] = 0x00;
+			emu_send(buf, 3);
+			emu_ack();
+			emu.state = EMU_CMD;
+			break;
+		case STM_CMD_GET_ID:
+			buf[0] = 1;
+			buf[1] = emu.pid >> 8;
+			buf[2] = emu.pid & 0xFF;
+			emu_send(buf, 3);
+			emu_ack();
+			emu.state = EMU_CMD;
+			break;
+		case STM_CMD_READ_MEM:
+		case STM_CMD_WRITE_MEM:
+		case STM_CMD_GO:
+			emu_collect(EMU_ADDR, 5);
+			break;
+		case STM_CMD_ERASE_MEM_EXT:
+			emu_collect(EMU_ERASE_COUNT, 2);
+			break;
+		case STM_CMD_WRITE_PROTECT:
+			emu_collect(EMU_WP_COUNT, 1);
+			break;
+		case STM_CMD_READ_UNPROTECT:
+			/* What a real part does, the whole flash goes */
+			memset(emu.flash, STM_ERASED_BYTE, emu.flash_size);
+			emu.stats.mass_erases++;
+			emu_busy((unsigned long long)emu.flash_size / STM_PAGE_SIZE *
+				emu.erase_us);
+			/* fall through */
+		case STM_CMD_WRITE_UNPROTECT:
+		case STM_CMD_READ_PROTECT:
+			emu_ack();
+			emu_protect();
+			break;
+	}
+}
+
+static void emu_address(void)
+{
+	uint8_t *in = emu.in;
+
+	if((in[0] ^ in[1] ^ in[2] ^ in[3]) != in[4]) {
+		emu_nack("address checksum");
+		return;
+	}
+	emu.addr = in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+	if(emu_mem(emu.addr, 1, emu.cmd == STM_CMD_WRITE_MEM) == NULL) {
+		emu_nack("bad address");
+		return;
+	}
+
+	emu_ack();
+	switch(emu.cmd) {
+		case STM_CMD_READ_MEM:
+			emu_collect(EMU_READ_LEN, 2);
+			break;
+		case STM_CMD_WRITE_MEM:
+			emu_collect(EMU_WRITE_LEN, 1);
+			break;
+		case STM_CMD_GO:
+			fprintf(stderr, "emu: GO 0x%08X\n", emu.addr);
+			emu.synced = 0;
+			emu.state = EMU_CMD;
+			if(emu.addr == STUB_LOAD_ADDR &&
+                    *(uint32_t *)emu_mem(emu.addr, 4, 0) != 0) {
+				emu_stub_start();
+			} else if(emu.banner) {
+				emu_send((const uint8_t *)emu.banner, strlen(emu.banner));
+			}
+			break;
+	}
+}
+
+static void emu_read(void)
+{
+	unsigned int len = emu.in[0] + 1;
+	uint8_t *mem;
+
+	if((emu.in[0] ^ 0xFF) != emu.in[1]) {
+		emu_nack("length checksum");
+		return;
+	}
+	if((mem = emu_mem(emu.addr, len, 0)) == NULL) {
+		emu_nack("read past the end");
+		return;
+	}
+
+	emu_ack();
+	emu_send(mem, len);
+	emu.stats.reads++;
+	emu.state = EMU_CMD;
+}
+
+/*
+    Flash can only be programmed where it is erased. SRAM takes anything.
+*/
+static void emu_write(void)
+{
+	unsigned int i, len = emu.in[0] + 1;
+	uint8_t cs = 0, *mem;
+
+	for(i = 0; i < len + 1; i++) {
+		cs ^= emu.in[i];
+	}
+	if(cs != emu.in[len + 1]) {
+		emu_nack("data checksum");
+		return;
+	}
+	if((mem = emu_mem(emu.addr, len, 1)) == NULL) {
+		emu_nack("write past the end");
+		return;
+	}
+	if(mem >= emu.flash && mem < emu.flash + emu.flash_size) {
+		for(i = 0; i < len; i++) {
+			if(mem[i] != STM_ERASED_BYTE) {
+				emu_nack("flash not erased");
+				return;
+			}
+		}
+		emu_busy((len + 1) / 2 * emu.program_us);
+	}
+
+	memcpy(mem, &emu.in[1], len);
+	emu.stats.writes++;
+	emu_ack();
+	emu.state = EMU_CMD;
+}
+
+static void emu_erase(void)
+{
+	unsigned int i, n = emu.in[0] << 8 | emu.in[1];
+	unsigned int pages = emu.flash_size / STM_PAGE_SIZE;
+	uint8_t cs = 0;
+
+	if(emu.state == EMU_ERASE_MASS) {
+		if(n != 0xFFFF || emu.in[2] != 0x00) {
+			emu_nack("bad special erase");
+			return;
+		}
+		memset(emu.flash, STM_ERASED_BYTE, emu.flash_size);
+		emu.stats.pages_erased += pages;
+		emu_busy((unsigned long long)pages * emu.erase_us);
+		emu_ack();
+		emu.state = EMU_CMD;
+		return;
+	}
+
+	for(i = 0; i < 2 + 2 * (n + 1); i++) {
+		cs ^= emu.in[i];
+	}
+	if(cs != emu.in[i]) {
+		emu_nack("erase checksum");
+		return;
+	}
+	for(i = 0; i <= n; i++) {
+		unsigned int page = emu.in[2 + 2 * i] << 8 | emu.in[3 + 2 * i];
+
+		if(page >= pages) {
+			emu_nack("bad page");
+			return;
+		}
+		memset(&emu.flash[page * STM_PAGE_SIZE], STM_ERASED_BYTE,
+			STM_PAGE_SIZE);
+		emu.stats.pages_erased++;
+		emu_busy(emu.erase_us);
+	}
+
+	emu_ack();
+	emu.state = EMU_CMD;
+}
+
+/*
+    Stub side of stub_proto.h
+*/
+static void emu_stub_reply(uint8_t type, uint8_t seq, const uint8_t *payload,
+        unsigned int len)
+{
+	uint8_t buf[STUB_FRAME_MAX(EMU_STUB_PAYLOAD)];
+	uint32_t crc;
+
+	buf[0] = STUB_SOF;
+	buf[1] = type;
+	buf[2] = seq;
+	buf[3] = len & 0xFF;
+	buf[4] = len >> 8;
+	memcpy(&buf[STUB_HDR_SIZE], payload, len);
+	crc = crc32_update(0, &buf[1], STUB_HDR_SIZE - 1 + len);
+	buf[STUB_HDR_SIZE + len] = crc & 0xFF;
+	buf[STUB_HDR_SIZE + len + 1] = (crc >> 8) & 0xFF;
+	buf[STUB_HDR_SIZE + len + 2] = (crc >> 16) & 0xFF;
+	buf[STUB_HDR_SIZE + len + 3] = crc >> 24;
+	emu_send(buf, STUB_FRAME_MAX(len));
+}
+
+static void emu_stub_status(uint8_t type, uint8_t seq, uint8_t status)
+{
+	if(type == STUB_NAK) {
+		emu.stats.stub_naks++;
+		if(emu.verbose) {
+			fprintf(stderr, "emu: stub NAK %d, want seq %d\n", status, seq);
+		}
+	}
+	emu_stub_reply(type, seq, &status, 1);
+}
+
+static uint32_t emu_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void emu_stub_start(void)
+{
+	uint8_t hello[4];
+
+	emu.stub.running = 1;
+	emu.stub.expect = 0;
+	emu.stub.nak_sent = 0;
+	emu.stub.have = 0;
+	if(emu.stub.window == 0) {
+		emu.stub.window = EMU_STUB_WINDOW;
+	}
+	if(emu.stub.max_payload == 0) {
+		emu.stub.max_payload = EMU_STUB_PAYLOAD;
+	}
+
+	hello[0] = STUB_VERSION;
+	hello[1] = emu.stub.window;
+	hello[2] = emu.stub.max_payload & 0xFF;
+	hello[3] = emu.stub.max_payload >> 8;
+	emu_stub_reply(STUB_HELLO, 0, hello, sizeof(hello));
+}
+
+/*
+    CRC frames are answered again when they are repeated, so are reads of
+    memory, everything else was done the first time and only gets its ACK
+*/
+static void emu_stub_crc(uint8_t seq, const uint8_t *p, unsigned int len)
+{
+	uint8_t reply[EMU_STUB_PAYLOAD];
+	uint32_t addr, n, chunk, piece, crc;
+	unsigned int out = 0;
+	uint8_t *mem;
+
+	if(len != 12) {
+		emu_stub_status(STUB_NAK, seq, STUB_ERR_LEN);
+		return;
+	}
+	addr = emu_le32(p);
+	n = emu_le32(p + 4);
+	chunk = emu_le32(p + 8);
+	if(chunk == 0 || (n + chunk - 1) / chunk * 4 > emu.stub.max_payload) {
+		emu_stub_status(STUB_NAK, seq, STUB_ERR_LEN);
+		return;
+	}
+	if((mem = emu_mem(addr, n, 0)) == NULL) {
+		emu_stub_status(STUB_NAK, seq, STUB_ERR_ADDR);
+		return;
+	}
+
+	while(n) {
+		piece = n < chunk ? n : chunk;
+		crc = crc32_update(0, mem, piece);
+		reply[out++] = crc & 0xFF;
+		reply[out++] = (crc >> 8) & 0xFF;
+		reply[out++] = (crc >> 16) & 0xFF;
+		reply[out++] = crc >> 24;
+		mem += piece;
+		n -= piece;
+	}
+	emu_stub_reply(STUB_CRC, seq, reply, out);
+}
+
+static void emu_stub_handle(uint8_t type, uint8_t seq, const uint8_t *p,
+        unsigned int len)
+{
+	unsigned int i, first, count, pages = emu.flash_size / STM_PAGE_SIZE;
+	uint32_t addr;
+	uint8_t *mem;
+
+	switch(type) {
+		case STUB_PING:
+			break;
+		case STUB_BAUD:
+			/* The ACK still goes at the old rate */
+			emu_stub_status(STUB_ACK, seq, STUB_OK);
+			if(emu.byte_ns && len == 8) {
+				emu_set_baud(emu_le32(p));
+			}
+			return;
+		case STUB_ERASE:
+			first = p[0] | p[1] << 8;
+			count = p[2] | p[3] << 8;
+			if(len != 4 || first + count > pages) {
+				emu_stub_status(STUB_NAK, seq, STUB_ERR_ADDR);
+				return;
+			}
+			memset(&emu.flash[first * STM_PAGE_SIZE], STM_ERASED_BYTE,
+				count * STM_PAGE_SIZE);
+			emu.stats.pages_erased += count;
+			emu_busy((unsigned long long)count * emu.erase_us);
+			break;
+		case STUB_WRITE:
+			addr = emu_le32(p);
+			if(len <= 4 || (mem = emu_mem(addr, len - 4, 1)) == NULL ||
+                    mem < emu.flash || mem >= emu.flash + emu.flash_size) {
+				emu_stub_status(STUB_NAK, seq, STUB_ERR_ADDR);
+				return;
+			}
+			for(i = 0; i < len - 4; i++) {
+				if(mem[i] != STM_ERASED_BYTE) {
+					emu_stub_status(STUB_NAK, seq, STUB_ERR_FLASH);
+					return;
+				}
+			}
+			memcpy(mem, p + 4, len - 4);
+			emu.stats.writes++;
+			emu_busy((len - 4 + 1) / 2 * emu.program_us);
+			break;
+		case STUB_CRC:
+			emu_stub_crc(seq, p, len);
+			return;
+		case STUB_GO:
+			addr = emu_le32(p);
+			fprintf(stderr, "emu: stub GO 0x%08X\n", addr);
+			emu_stub_status(STUB_ACK, seq, STUB_OK);
+			emu.stub.running = 0;
+			emu.synced = 0;
+			return;
+		default:
+			emu_stub_status(STUB_NAK, seq, STUB_ERR_LEN);
+			return;
+	}
+
+	emu_stub_status(STUB_ACK, seq, STUB_OK);
+}
+
+/*
+    A whole frame is in emu.in, check it and keep the sequence in order
+*/
+static void emu_stub_frame(void)
+{
+	unsigned int len = emu.in[3] | emu.in[4] << 8;
+	uint8_t type = emu.in[1], seq = emu.in[2];
+	uint8_t d = seq - emu.stub.expect;
+
+	emu.stats.stub_frames++;
+	if(emu.corrupt_at && emu.stats.stub_frames == emu.corrupt_at) {
+		emu.stats.injected++;
+		emu.in[STUB_HDR_SIZE] ^= 0x01;
+	}
+
+	if(crc32_update(0, &emu.in[1], STUB_HDR_SIZE - 1 + len) !=
+            emu_le32(&emu.in[STUB_HDR_SIZE + len])) {
+		if(!emu.stub.nak_sent) {
+			emu.stub.nak_sent = 1;
+			emu_stub_status(STUB_NAK, emu.stub.expect, STUB_ERR_CRC);
+		}
+		return;
+	}
+
+	if(d >= 0x80) {
+		/* Already handled, the ACK must have been lost */
+		if(type == STUB_CRC) {
+			emu_stub_crc(seq, &emu.in[STUB_HDR_SIZE], len);
+		} else {
+			emu_stub_status(STUB_ACK, seq, STUB_OK);
+		}
+		return;
+	}
+	if(d != 0) {
+		if(!emu.stub.nak_sent) {
+			emu.stub.nak_sent = 1;
+			emu_stub_status(STUB_NAK, emu.stub.expect, STUB_ERR_SEQ);
+		}
+		return;
+	}
+
+	emu.stub.nak_sent = 0;
+	emu.stub.expect++;
+	emu_stub_handle(type, seq, &emu.in[STUB_HDR_SIZE], len);
+}
+
+static void emu_stub_feed(uint8_t b)
+{
+	unsigned int len;
+
+	if(emu.stub.have == 0 && b != STUB_SOF) {
+		return;
+	}
+	emu.in[emu.stub.have++] = b;
+	if(emu.stub.have == STUB_HDR_SIZE) {
+		len = emu.in[3] | emu.in[4] << 8;
+		if(len > emu.stub.max_payload) {
+			/* A header this broken can't be trusted for the length */
+			emu.stub.have = 0;
+			return;
+		}
+		emu.stub.need = STUB_FRAME_MAX(len);
+	}
+	if(emu.stub.have > STUB_HDR_SIZE && emu.stub.have == emu.stub.need) {
+		emu.stub.have = 0;
+		emu_stub_frame();
+	}
+}
+
+/*
+    Run one byte from the host through the bootloader state machine
+*/
+static void emu_feed(uint8_t b)
+{
+	if(emu.stub.running) {
+		emu_stub_feed(b);
+		return;
+	}
+	if(!emu.synced) {
+		if(b == STM_INIT) {
+			emu.synced = 1;
+			emu.state = EMU_CMD;
+			emu_ack();
+		}
+		return;
+	}
+
+	switch(emu.state) {
+		case EMU_CMD:
+			if(b == STM_INIT) {
+				/* Already in sync */
+				emu_byte(STM_NACK);
+				return;
+			}
+			emu.cmd = b;
+			emu.state = EMU_CMD_CS;
+			return;
+		case EMU_CMD_CS:
+			if(b != (emu.cmd ^ 0xFF) || !emu_has_cmd(emu.cmd)) {
+				emu_nack("bad command");
+				return;
+			}
+			emu_command();
+			return;
+		default:
+			break;
+	}
+
+	emu.in[emu.have++] = b;
+	if(emu.have < emu.need) {
+		return;
+	}
+
+	switch(emu.state) {
+		case EMU_ADDR:
+			emu_address();
+			break;
+		case EMU_READ_LEN:
+			emu_read();
+			break;
+		case EMU_WRITE_LEN:
+			emu.need = 1 + emu.in[0] + 1 + 1;
+			emu.state = EMU_WRITE_DATA;
+			break;
+		case EMU_WRITE_DATA:
+			emu_write();
+			break;
+		case EMU_ERASE_COUNT:
+			if((emu.in[0] << 8 | emu.in[1]) >= 0xFFF0) {
+				emu.need = 3;
+				emu.state = EMU_ERASE_MASS;
+			} else {
+				emu.need = 2 + 2 * ((emu.in[0] << 8 | emu.in[1]) + 1) + 1;
+				emu.state = EMU_ERASE_LIST;
+			}
+			break;
+		case EMU_ERASE_MASS:
+		case EMU_ERASE_LIST:
+			emu_erase();
+			break;
+		case EMU_WP_COUNT:
+			emu.need = 1 + emu.in[0] + 1 + 1;
+			emu.state = EMU_WP_LIST;
+			break;
+		case EMU_WP_LIST:
+			emu_write_protect();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+    A byte from the host. It is handled once it is all on the wire and
+    the part is done with whatever it was busy with.
+*/
+static void emu_rx(uint8_t b, unsigned long long now)
+{
+	if(emu.rx_ns < now) {
+		emu.rx_ns = now;
+	}
+	emu.rx_ns += emu.byte_ns;
+	emu.stats.rx_bytes++;
+	if(emu.drop_in_at && emu.stats.rx_bytes == emu.drop_in_at) {
+		emu.stats.dropped++;
+		return;
+	}
+
+	emu_feed(b);
+}
+
+/*
+    Put out every queued reply byte that is due, returns the microseconds
+    until the next one is, -1 if there is none
+*/
+static long emu_flush(void)
+{
+	unsigned long long now = emu_now_ns();
+	uint8_t buf[EMU_OUT_MAX];
+	unsigned int n = 0;
+
+	while(emu.out_tail != emu.out_head &&
+            emu.out[emu.out_tail % EMU_OUT_MAX].due <= now) {
+		buf[n++] = emu.out[emu.out_tail % EMU_OUT_MAX].byte;
+		emu.out_tail++;
+	}
+	if(n && emu.fd >= 0 && write(emu.fd, buf, n) != n) {
+		fprintf(stderr, "emu: reply write failed\n");
+	}
+
+	if(emu.out_tail == emu.out_head) {
+		return -1;
+	}
+
+	return (emu.out[emu.out_tail % EMU_OUT_MAX].due - now + 999) / 1000;
+}
+
+static int emu_load(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if(fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	if(fread(emu.flash, 1, EMU_FLASH_MAX, fp) == 0 && ferror(fp)) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+    Listening socket on localhost for -T
+*/
+static int emu_listen(int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(fd, 1) != 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void display_help(const char *prog_name)
+{
+    fprintf(stdout, "Usage: %s [options]\n", prog_name);
+    fprintf(stdout, "  STM32 bootloader stand-in on a pty or TCP port\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Options:\n");
+    fprintf(stdout, "  -i filename           Initial flash contents\n");
+    fprintf(stdout, "  -l latency_us         Delay every reply (default:0)\n");
+    fprintf(stdout, "  -B baud               Pace bytes both ways at this rate (default:no pacing)\n");
+    fprintf(stdout, "  -E us                 Page erase time (default:0)\n");
+    fprintf(stdout, "  -W us                 Half-word program time (default:0)\n");
+    fprintf(stdout, "  -f kb                 Flash size, up to %d (default:%d)\n",
+        EMU_FLASH_MAX / 1024, EMU_FLASH_SIZE / 1024);
+    fprintf(stdout, "  -p pid                Product ID for GET_ID (default:0x%03X)\n",
+        EMU_PID);
+    fprintf(stdout, "  -n count              NACK the count-th command\n");
+    fprintf(stdout, "  -d count              Lose the count-th byte from the host\n");
+    fprintf(stdout, "  -x count              Lose the count-th reply byte\n");
+    fprintf(stdout, "  -s count[:ms]         Go quiet for ms before the count-th command\n"
+                    "                        (default:1000)\n");
+    fprintf(stdout, "  -b text               Send text as the app banner after GO\n");
+    fprintf(stdout, "  -c count              Corrupt the count-th stub frame\n");
+    fprintf(stdout, "  -w frames             Stub window (default:%d)\n",
+        EMU_STUB_WINDOW);
+    fprintf(stdout, "  -T port               Listen on a localhost TCP port instead of a pty\n");
+    fprintf(stdout, "  -v                    Trace rejected frames to stderr\n");
+    fprintf(stdout, "  -h                    Display this help and exit\n");
+    fprintf(stdout, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct termios tio;
+	struct pollfd pfd[2];
+	struct timespec ts;
+	uint8_t buf[1024];
+	ssize_t r;
+	unsigned long long now;
+	long next_us;
+	char *end;
+	int c, i, slave = -1, lfd = -1, tcp_port = 0;
+
+	memset(emu.flash, STM_ERASED_BYTE, sizeof(emu.flash));
+	emu.pid = EMU_PID;
+	emu.flash_size = EMU_FLASH_SIZE;
+
+	while ((c = getopt(argc, argv, "hvi:l:n:c:w:b:T:B:E:W:f:p:d:x:s:")) != -1) {
+		switch(c) {
+			case 'i':
+				if(emu_load(optarg) != 0) {
+					return 1;
+				}
+				break;
+			case 'l':
+				emu.latency_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				emu.nack_at = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				emu.banner = optarg;
+				break;
+			case 'c':
+				emu.corrupt_at = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				emu.stub.window = strtoul(optarg, NULL, 0);
+				break;
+			case 'B':
+				emu_set_baud(strtoul(optarg, NULL, 0));
+				break;
+			case 'E':
+				emu.erase_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'W':
+				emu.program_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				emu.flash_size = strtoul(optarg, NULL, 0) * 1024;
+				if(emu.flash_size == 0 || emu.flash_size > EMU_FLASH_MAX ||
+                        emu.flash_size % STM_PAGE_SIZE) {
+					fprintf(stderr, "emu: bad flash size %s KB\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				emu.pid = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				emu.drop_in_at = strtoul(optarg, NULL, 0);
+				break;
+			case 'x':
+				emu.drop_out_at = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				emu.stall_at = strtoul(optarg, &end, 0);
+				emu.stall_ms = *end == ':' ? strtoul(end + 1, NULL, 0) : 1000;
+				break;
+			case 'T':
+				tcp_port = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				emu.verbose = 1;
+				break;
+			case 'h':
+			default:
+				display_help(argv[0]);
+				return 1;
+		}
+	}
+
+	if(tcp_port) {
+		lfd = emu_listen(tcp_port);
+		if(lfd < 0) {
+			return 1;
+		}
+		emu.fd = -1;
+		fprintf(stdout, "tcp:127.0.0.1:%d\n", tcp_port);
+	} else {
+		emu.fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if(emu.fd < 0 || grantpt(emu.fd) != 0 || unlockpt(emu.fd) != 0) {
+			perror("pty");
+			return 1;
+		}
+
+		/* Hold the slave open so the pty survives the host closing it */
+		slave = open(ptsname(emu.fd), O_RDWR | O_NOCTTY);
+		if(slave < 0) {
+			perror(ptsname(emu.fd));
+			return 1;
+		}
+		tcgetattr(slave, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+		fprintf(stdout, "%s\n", ptsname(emu.fd));
+	}
+
+	signal(SIGINT, emu_signal);
+	signal(SIGTERM, emu_signal);
+
+	fflush(stdout);
+
+	pfd[1].fd = lfd;
+	pfd[1].events = POLLIN;
+	next_us = -1;
+	while(running) {
+		pfd[0].fd = emu.fd;
+		pfd[0].events = POLLIN;
+		ts.tv_sec = next_us / 1000000;
+		ts.tv_nsec = (next_us % 1000000) * 1000;
+		if(ppoll(pfd, 2, next_us < 0 ? NULL : &ts, NULL) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if(pfd[1].revents & POLLIN) {
+			if(emu.fd >= 0) {
+				close(emu.fd);
+			}
+			emu.fd = accept(lfd, NULL, NULL);
+		}
+		if(pfd[0].revents & (POLLIN | POLLHUP)) {
+			r = read(emu.fd, buf, sizeof(buf));
+			if(r <= 0 && lfd >= 0) {
+				close(emu.fd);
+				emu.fd = -1;
+			}
+			now = emu_now_ns();
+			for(i = 0; i < r; i++) {
+				emu_rx(buf[i], now);
+			}
+		}
+		next_us = emu_flush();
+	}
+
+	fprintf(stderr, "emu: %lu commands, %lu reads, %lu writes, "
+		"%lu pages erased, %lu NACKs, %lu stub frames, %lu stub NAKs "
+		"(%lu injected)\n",
+		emu.stats.cmds, emu.stats.reads, emu.stats.writes,
+		emu.stats.pages_erased, emu.stats.nacks, emu.stats.stub_frames,
+		emu.stats.stub_naks, emu.stats.injected);
+	fprintf(stderr, "emu: %lu bytes in, %lu out, %lu dropped, "
+		"%llu ms erasing and programming\n",
+		emu.stats.rx_bytes, emu.stats.tx_bytes, emu.stats.dropped,
+		emu.stats.busy_us / 1000);
+	fprintf(stderr, "emu: %lu protection commands, %lu mass erases\n",
+		emu.stats.protect_cmds, emu.stats.mass_erases);
+
+	if(slave >= 0) {
+		close(slave);
+	}
+	if(lfd >= 0) {
+		close(lfd);
+	}
+	if(emu.fd >= 0) {
+		close(emu.fd);
+	}
+
+	return 0;
+}